@@ -0,0 +1,400 @@
+/**
+ * barservice.hpp
+ * Defines the data types and Service for the OHLCV bars of the prices
+ * and the trades over several intervals.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef BAR_SERVICE_HPP
+#define BAR_SERVICE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bondinfo.hpp"
+#include "coroconnector.hpp"
+#include "objectpool.hpp"
+#include "pricingservice.hpp"
+#include "soa.hpp"
+#include "timerwheel.hpp"
+#include "tradebookingservice.hpp"
+
+/**
+ * OHLCV bar of a security over an interval starting at start
+ * (milliseconds since epoch). The prices tick at their mid with no
+ * volume, the trades at their price with their quantity.
+ * Type T is the product type.
+ */
+template <typename T>
+class Bar {
+   public:
+    // ctor for a bar
+    Bar(const T &_product, long _interval, long long _start, double _open, double _high, double _low, double _close, long _volume, long _ticks)
+        : product(_product), interval(_interval), start(_start), open(_open), high(_high), low(_low), close(_close), volume(_volume), ticks(_ticks) {}
+
+    // Overwrite the bar in place when recycled by an ObjectPool
+    void Reset(const T &_product, long _interval, long long _start, double _open, double _high, double _low, double _close, long _volume, long _ticks) {
+        product = _product;
+        interval = _interval;
+        start = _start;
+        open = _open;
+        high = _high;
+        low = _low;
+        close = _close;
+        volume = _volume;
+        ticks = _ticks;
+    }
+
+    // Get the product
+    const T &GetProduct() const { return product; }
+
+    // Get the length of the bar in milliseconds
+    long GetInterval() const { return interval; }
+
+    // Get the start of the bar in milliseconds since epoch
+    long long GetStart() const { return start; }
+
+    // Get the first, highest, lowest and last price
+    double GetOpen() const { return open; }
+    double GetHigh() const { return high; }
+    double GetLow() const { return low; }
+    double GetClose() const { return close; }
+
+    // Get the quantity traded
+    long GetVolume() const { return volume; }
+
+    // Get the number of ticks
+    long GetTicks() const { return ticks; }
+
+   private:
+    T product;
+    long interval;
+    long long start;
+    double open;
+    double high;
+    double low;
+    double close;
+    long volume;
+    long ticks;
+};
+
+/**
+ * Intervals of the bars in milliseconds, and number of bars of every
+ * interval kept per security for the queries.
+ */
+struct BarParams {
+    std::vector<long> intervals = {1000, 60000, 300000};
+    size_t history = 256;
+};
+
+/**
+ * Bar service building the bars of every security over every interval at
+ * once. A tick only updates the open bars of its security, under the
+ * security's mutex, and reads no clock: the bars are closed by a timer of
+ * a TimerWheel ticking every millisecond of the wall clock, one per
+ * interval at its next boundary (so the 1m bars start on the minute),
+ * which closes the bars of every security, keeps them in a ring of the
+ * last history bars of the security and interval and publishes them.
+ * An interval without a tick has no bar, and a tick coming before the
+ * timer has fired goes to the bar being closed.
+ * The wheel is advanced by Poll(), from a thread started by Start() or
+ * from a Reactor timer; Flush() closes the bars still open.
+ * Keyed on product identifier.
+ */
+class BondBarService : public Service<string, Bar<Bond> > {
+   private:
+    struct Ohlcv {
+        long long start;
+        double open;
+        double high;
+        double low;
+        double close;
+        long volume;
+        long ticks;
+    };
+
+    // the bars of a security and an interval: the open one and a ring of the last closed ones
+    struct Series {
+        Ohlcv current;
+        std::vector<Ohlcv> ring;
+        size_t head;  // next slot of the ring
+        size_t count;
+    };
+
+    BarParams params;
+    std::vector<const Bond *> bonds;
+    std::vector<Series> series;  // securities x intervals
+    mutable std::vector<std::mutex> locks;
+    std::vector<std::atomic<long long> > boundaries;  // start of the open bars of every interval
+    TimerWheel wheel;
+    std::mutex wheelLock;
+    std::atomic<long> closed;
+    std::atomic<bool> running;
+    std::thread clock;
+
+    static long long Now() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static long long Boundary(long long time, long interval) { return time - time % interval; }
+
+    // update the open bars of a security
+    void Tick(int i, double price, long quantity) {
+        std::lock_guard<std::mutex> lock(locks[i]);
+        for (size_t k = 0; k < params.intervals.size(); ++k) {
+            Ohlcv &bar = series[i * params.intervals.size() + k].current;
+            if (bar.ticks == 0) {
+                bar = Ohlcv{boundaries[k].load(std::memory_order_relaxed), price, price, price, price, 0, 0};
+            } else {
+                bar.high = std::max(bar.high, price);
+                bar.low = std::min(bar.low, price);
+                bar.close = price;
+            }
+            bar.volume += quantity;
+            ++bar.ticks;
+        }
+    }
+
+    // close the open bars of an interval, the next ones start at next
+    void Close(size_t k, long long next) {
+        boundaries[k].store(next, std::memory_order_relaxed);
+        for (size_t i = 0; i < bonds.size(); ++i) {
+            Ohlcv bar;
+            {
+                std::lock_guard<std::mutex> lock(locks[i]);
+                Series &s = series[i * params.intervals.size() + k];
+                bar = s.current;
+                if (bar.ticks == 0) continue;
+                s.ring[s.head] = bar;
+                s.head = (s.head + 1) % s.ring.size();
+                s.count = std::min(s.count + 1, s.ring.size());
+                s.current.ticks = 0;
+            }
+            ++closed;
+            Pooled<Bar<Bond> > out(*bonds[i], params.intervals[k], bar.start, bar.open, bar.high, bar.low, bar.close, bar.volume, bar.ticks);
+            this->Notify(*out);
+        }
+    }
+
+    Bar<Bond> ToBar(int i, size_t k, const Ohlcv &bar) const {
+        return Bar<Bond>(*bonds[i], params.intervals[k], bar.start, bar.open, bar.high, bar.low, bar.close, bar.volume, bar.ticks);
+    }
+
+   public:
+    // ctor, the securities of BondInfo
+    explicit BondBarService(const BarParams &_params = BarParams())
+        : params(_params), locks(BondInfo::GetCUSIP().size()), boundaries(params.intervals.size()), wheel(uint64_t(Now())), closed(0), running(false) {
+        params.history = std::max<size_t>(1, params.history);
+        for (auto &cusip : BondInfo::GetCUSIP()) {
+            bonds.push_back(BondInfo::GetBond(cusip));
+            for (size_t k = 0; k < params.intervals.size(); ++k) series.push_back(Series{Ohlcv{0, 0.0, 0.0, 0.0, 0.0, 0, 0}, std::vector<Ohlcv>(params.history), 0, 0});
+        }
+        long long now = (long long)wheel.GetTime();
+        for (size_t k = 0; k < params.intervals.size(); ++k) {
+            long interval = std::max(1L, params.intervals[k]);
+            params.intervals[k] = interval;
+            boundaries[k].store(Boundary(now, interval));
+            wheel.Schedule(uint64_t(Boundary(now, interval) + interval - now), k);
+        }
+    }
+
+    ~BondBarService() { Stop(); }
+
+    // a price ticks at its mid
+    void OnPrice(const Price<Bond> &price) {
+        int i = BondInfo::GetIndex(price.GetProduct().GetProductId());
+        if (i >= 0) Tick(i, price.GetMid(), 0);
+    }
+
+    // a trade prints at its price
+    void OnTrade(const Trade<Bond> &trade) {
+        int i = BondInfo::GetIndex(trade.GetProduct().GetProductId());
+        if (i >= 0) Tick(i, trade.GetPrice(), trade.GetQuantity());
+    }
+
+    // close the bars whose interval has elapsed
+    void Poll() {
+        std::lock_guard<std::mutex> lock(wheelLock);
+        long long now = Now();
+        if (now <= (long long)wheel.GetTime()) return;
+        wheel.Advance(uint64_t(now), [this](uint64_t k) {
+            long interval = params.intervals[k];
+            long long time = (long long)wheel.GetTime();
+            wheel.Schedule(uint64_t(interval), k);
+            Close(size_t(k), time);
+        });
+    }
+
+    // close the bars still open
+    void Flush() {
+        std::lock_guard<std::mutex> lock(wheelLock);
+        for (size_t k = 0; k < params.intervals.size(); ++k) Close(k, boundaries[k].load());
+    }
+
+    // poll every ms milliseconds on a thread of its own until Stop()
+    void Start(long ms = 10) {
+        if (running.exchange(true)) return;
+        clock = std::thread([this, ms] {
+            while (running.load(std::memory_order_relaxed)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+                Poll();
+            }
+        });
+    }
+
+    void Stop() {
+        if (!running.exchange(false)) return;
+        clock.join();
+    }
+
+    // the last count closed bars (all those kept by default) of a security over an interval, oldest first;
+    // returns the number of bars, 0 for an unknown security or interval
+    size_t GetBars(const string &cusip, long interval, std::vector<Bar<Bond> > &bars, size_t count = SIZE_MAX) const {
+        bars.clear();
+        int i = BondInfo::GetIndex(cusip);
+        auto itr = std::find(params.intervals.begin(), params.intervals.end(), interval);
+        if (i < 0 || itr == params.intervals.end()) return 0;
+        size_t k = size_t(itr - params.intervals.begin());
+        std::lock_guard<std::mutex> lock(locks[i]);
+        const Series &s = series[i * params.intervals.size() + k];
+        size_t n = std::min(count, s.count);
+        bars.reserve(n);
+        for (size_t j = 0; j < n; ++j) bars.push_back(ToBar(i, k, s.ring[(s.head + s.ring.size() - n + j) % s.ring.size()]));
+        return n;
+    }
+
+    // number of bars closed
+    long GetClosedCount() const { return closed.load(); }
+
+    // get the last closed bar of a security over the shortest interval
+    // the result belongs to the calling thread and is valid until its next call
+    virtual Bar<Bond> &GetData(string key) {
+        static thread_local std::vector<Bar<Bond> > result;
+        size_t k = size_t(std::min_element(params.intervals.begin(), params.intervals.end()) - params.intervals.begin());
+        if (params.intervals.empty() || GetBars(key, params.intervals[k], result, 1) == 0) {
+            result.assign(1, Bar<Bond>(*BondInfo::GetBond(key), params.intervals.empty() ? 0 : params.intervals[k], 0, 0.0, 0.0, 0.0, 0.0, 0, 0));
+        }
+        return result.back();
+    }
+
+    // we don't need this method
+    virtual void OnMessage(Bar<Bond> &_bar) {}
+};
+
+/**
+ * Bar listener
+ * to listen the BondPricingService
+ * then pass the prices to BondBarService
+ */
+class BondBarPricingListener : public ServiceListener<Price<Bond> > {
+   private:
+    BondBarService *service;
+
+   public:
+    explicit BondBarPricingListener(BondBarService *_service) : service(_service) {}
+    virtual void ProcessAdd(Price<Bond> &_price) {
+        DEBUG_TEST("BondPricingService -> BondBarService\n");
+        service->OnPrice(_price);
+    }
+    virtual void ProcessRemove(Price<Bond> &_price) {}
+    virtual void ProcessUpdate(Price<Bond> &_price) {}
+};
+
+/**
+ * Bar listener
+ * to listen the BondTradeBookingService
+ * then pass the trades to BondBarService
+ */
+class BondBarTradeListener : public ServiceListener<Trade<Bond> > {
+   private:
+    BondBarService *service;
+
+   public:
+    explicit BondBarTradeListener(BondBarService *_service) : service(_service) {}
+    virtual void ProcessAdd(Trade<Bond> &_trade) {
+        DEBUG_TEST("BondTradeBookingService -> BondBarService\n");
+        service->OnTrade(_trade);
+    }
+    virtual void ProcessRemove(Trade<Bond> &_trade) {}
+    virtual void ProcessUpdate(Trade<Bond> &_trade) {}
+};
+
+/**
+ * Bar connector
+ * to publish the bars to the data_writer process via TCP/IP
+ */
+class BondBarConnector : public Connector<Bar<Bond> > {
+   private:
+    std::string file_name;
+    boost::asio::io_service io_service;
+    tcp::socket socket;
+    // buffers reused across publications
+    std::string line;
+    std::string reply;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<LineWriter> writer;
+
+   public:
+    // ctor
+    explicit BondBarConnector(string file_name_, int port = 1245, Reactor *reactor = nullptr) : file_name(file_name_), socket(io_service) {
+        if (reactor != nullptr) {
+            // asynchronous session on the reactor's event loop
+            writer.reset(MakeLineWriter(*reactor, file_name));
+            writer->Start(port);
+            return;
+        }
+        // connection of the socket
+        std::cout << "connecting to the " << file_name << "...";
+        socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port));
+        this->send_socket(socket, file_name + "\n");
+        string success = this->read_socket(socket);
+        std::cout << "success" << std::endl;
+    }
+    // publish the bar to the data_writer process
+    virtual void Publish(Bar<Bond> &_bar) {
+        std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+        // timestamp,productId,interval,start,open,high,low,close,volume,ticks
+        line.clear();
+        line += std::to_string(ms.count());
+        line += ',';
+        line += _bar.GetProduct().GetProductId();
+        line += ',';
+        line += std::to_string(_bar.GetInterval());
+        line += ',';
+        line += std::to_string(_bar.GetStart());
+        line += ',';
+        line += std::to_string(_bar.GetOpen());
+        line += ',';
+        line += std::to_string(_bar.GetHigh());
+        line += ',';
+        line += std::to_string(_bar.GetLow());
+        line += ',';
+        line += std::to_string(_bar.GetClose());
+        line += ',';
+        line += std::to_string(_bar.GetVolume());
+        line += ',';
+        line += std::to_string(_bar.GetTicks());
+        line += '\n';
+        if (writer) {
+            writer->Write(line);
+        } else {
+            this->send_socket(socket, line);
+            this->read_socket(socket, reply);
+        }
+        DEBUG_TEST("Bar<Bond> -> BondBarConnector\n");
+    }
+    // dtor, we need to kill the data_writer process by sending EOF
+    ~BondBarConnector() {
+        std::cout << "Finished, killing the data_writer (" << file_name << ") process" << std::endl;
+        if (!writer) this->send_socket(socket, "EOF\n");
+    }
+};
+
+#endif
@@ -0,0 +1,288 @@
+/**
+ * bondanalytics.hpp
+ * Yield, modified duration and PV01 of the bonds from their prices,
+ * using the coupon and maturity of the security master (BondInfo).
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef BOND_ANALYTICS_HPP
+#define BOND_ANALYTICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bondinfo.hpp"
+#include "pricingservice.hpp"
+#include "products.hpp"
+#include "soa.hpp"
+
+/**
+ * Analytics engine for a universe of semi-annual coupon bonds.
+ * Everything is per 100 face, on a fixed valuation date so that runs
+ * are reproducible. The data is laid out as a structure of arrays:
+ * a tick reprices its security only (Newton warm-started from its
+ * previous yield), or in batch mode records its price, and Recompute()
+ * reprices the whole universe from the latest prices, running the Newton
+ * steps over the arrays two securities at a time with the vector
+ * extensions of GCC and Clang (v^x as exp(x log v), both polynomials).
+ *
+ * With m the (fractional) number of periods to maturity, n the number
+ * of coupons left, C the semi-annual coupon and v = 1/(1+y/2), the
+ * dirty price is the closed form of the sum of the discounted cash flows
+ *     P(y) = (2C/y) (v^(m-n) - v^m) + 100 v^m
+ * and the accrued interest is C (n-m).
+ * The PV01 is written by the thread feeding the prices and can be read
+ * from any thread with GetPV01(cusip).
+ */
+class BondAnalytics {
+   private:
+    static constexpr double kTolerance = 1e-12;
+    static const int kMaxIterations = 50;
+    static const int kLogTerms = 13;         // of the atanh series of Log
+    static const int kExpTerms = 13;         // of the Taylor series of Exp
+    static constexpr double kMaxYield = 0.8;  // the lanes of Recompute converging outside (-kMaxYield, kMaxYield) are solved again one by one
+
+    // two lanes of the arrays, and the masks of their comparisons
+    typedef double Lanes __attribute__((vector_size(16)));
+    typedef long long Masks __attribute__((vector_size(16)));
+    static const size_t kLanes = sizeof(Lanes) / sizeof(double);
+
+    std::vector<std::string> cusips;
+    std::unordered_map<std::string, int> index;
+    // security master
+    std::vector<double> coupon;   // semi-annual coupon per 100 face
+    std::vector<double> periods;  // m
+    std::vector<double> coupons;  // n
+    // market and results
+    std::vector<double> dirty;
+    std::vector<double> yield;
+    std::vector<double> duration;
+    std::vector<double> pv01;
+    std::unique_ptr<std::atomic<double>[]> published;
+    std::unique_ptr<std::atomic<double>[]> quoted;  // latest clean price, from any thread
+    std::mutex batch;                                // one Recompute at a time
+
+    static Lanes Load(const double *data) {
+        Lanes lanes;
+        std::memcpy(&lanes, data, sizeof(Lanes));
+        return lanes;
+    }
+
+    static void Store(double *data, Lanes lanes) { std::memcpy(data, &lanes, sizeof(Lanes)); }
+
+    // log of every lane as 2 atanh(z), z = (g-1)/(g+1), exact to the last bits for |z| <= 0.2,
+    // i.e. g = 1+y/2 with y in (-kMaxYield, 1)
+    static Lanes Log(Lanes g) {
+        Lanes z = (g - 1.0) / (g + 1.0);
+        Lanes w = z * z;
+        Lanes sum = w * 0.0 + 1.0 / (2 * kLogTerms + 1);
+        for (int k = kLogTerms - 1; k >= 0; --k) sum = sum * w + 1.0 / (2 * k + 1);
+        return 2.0 * z * sum;
+    }
+
+    // exp of every lane: 2^k exp(r) with |r| <= log(2)/2, 2^k built in the exponent bits
+    static Lanes Exp(Lanes t) {
+        const double shift = 6755399441055744.0;  // 1.5 * 2^52, adding it rounds to an integer
+        const double ln2hi = 0.693147180369123816490, ln2lo = 1.90821492927058770002e-10;
+        Lanes k = (t * 1.44269504088896340736 + shift) - shift;
+        Lanes r = (t - k * ln2hi) - k * ln2lo;
+        Lanes sum = r * 0.0 + 1.0;
+        for (int j = kExpTerms; j >= 1; --j) sum = 1.0 + r * sum * (1.0 / j);
+        Masks bits = (__builtin_convertvector(k, Masks) + 1023) << 52;
+        Lanes scale;
+        std::memcpy(&scale, &bits, sizeof(Lanes));
+        return sum * scale;
+    }
+
+    // PriceAndSlope of every lane
+    static void PriceAndSlope(Lanes c, Lanes m, Lanes n, Lanes y, Lanes &price, Lanes &slope) {
+        Masks zero = (y < 1e-9) & (y > -1e-9);
+        y = zero ? y * 0.0 + 1e-9 : y;
+        Lanes g = 1.0 + 0.5 * y;
+        Lanes log = Log(g);
+        Lanes vs = Exp((n - m) * log);
+        Lanes vm = Exp(-m * log);
+        Lanes a = vs - vm;
+        Lanes da = (-(m - n) * vs + m * vm) / (2.0 * g);
+        price = 2.0 * c / y * a + 100.0 * vm;
+        slope = -2.0 * c / (y * y) * a + 2.0 * c / y * da - 100.0 * m * vm / (2.0 * g);
+    }
+
+    // duration and PV01 of a security once its yield is solved
+    void Finish(size_t i) {
+        double price, slope;
+        PriceAndSlope(coupon[i], periods[i], coupons[i], yield[i], price, slope);
+        duration[i] = -slope / price;
+        pv01[i] = -slope * 1e-4;
+        published[i].store(pv01[i], std::memory_order_release);
+    }
+
+   public:
+    // dirty price and its derivative in the yield
+    static void PriceAndSlope(double c, double m, double n, double y, double &price, double &slope) {
+        // away from y = 0 where the closed form is 0/0
+        y = (std::fabs(y) < 1e-9) ? 1e-9 : y;
+        double g = 1.0 + 0.5 * y;
+        double vs = std::pow(g, n - m);  // v^(m-n)
+        double vm = std::pow(g, -m);     // v^m
+        double a = vs - vm;
+        double da = (-(m - n) * vs + m * vm) / (2.0 * g);
+        price = 2.0 * c / y * a + 100.0 * vm;
+        slope = -2.0 * c / (y * y) * a + 2.0 * c / y * da - 100.0 * m * vm / (2.0 * g);
+    }
+
+    // the valuation date
+    static boost::gregorian::date ValuationDate() { return boost::gregorian::date(2020, boost::gregorian::Dec, 15); }
+
+    // ctor, every security priced at par until its first tick
+    explicit BondAnalytics(const std::vector<std::string> &_cusips = BondInfo::GetCUSIP(), boost::gregorian::date valuation = ValuationDate())
+        : cusips(_cusips), published(new std::atomic<double>[_cusips.size()]), quoted(new std::atomic<double>[_cusips.size()]) {
+        size_t size = cusips.size();
+        coupon.resize(size);
+        periods.resize(size);
+        coupons.resize(size);
+        dirty.resize(size);
+        yield.resize(size);
+        duration.resize(size);
+        pv01.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            index[cusips[i]] = int(i);
+            const Bond &bond = *BondInfo::GetBond(cusips[i]);
+            coupon[i] = 50.0 * bond.GetCoupon();
+            periods[i] = 2.0 * (bond.GetMaturityDate() - valuation).days() / 365.25;
+            coupons[i] = std::ceil(periods[i] - 1e-9);
+            yield[i] = bond.GetCoupon();
+            OnPrice(i, 100.0);
+        }
+    }
+
+    // index of the security in the arrays, -1 if it's not in the universe
+    int GetIndex(const std::string &cusip) const {
+        auto itr = index.find(cusip);
+        return (itr != index.end()) ? itr->second : -1;
+    }
+
+    // yield of a security at a clean price (per 100 face), Newton from guess;
+    // it only reads the security master, so it can be called from any thread
+    double SolveYield(size_t i, double price, double guess) const {
+        double target = price + coupon[i] * (coupons[i] - periods[i]);
+        double y = guess;
+        for (int it = 0; it < kMaxIterations; ++it) {
+            double p, slope;
+            PriceAndSlope(coupon[i], periods[i], coupons[i], y, p, slope);
+            double step = (p - target) / slope;
+            y -= step;
+            if (std::fabs(step) < kTolerance) break;
+        }
+        return y;
+    }
+
+    // a price tick (clean, per 100 face): solve the yield from the previous one
+    void OnPrice(size_t i, double price) {
+        quoted[i].store(price, std::memory_order_relaxed);
+        dirty[i] = price + coupon[i] * (coupons[i] - periods[i]);
+        yield[i] = SolveYield(i, price, yield[i]);
+        Finish(i);
+    }
+
+    void OnPrice(const std::string &cusip, double price) {
+        int i = GetIndex(cusip);
+        if (i >= 0) OnPrice(size_t(i), price);
+    }
+
+    // a price tick in batch mode, from any thread: the next Recompute reprices it
+    void SetPrice(const std::string &cusip, double price) {
+        int i = GetIndex(cusip);
+        if (i >= 0) quoted[i].store(price, std::memory_order_relaxed);
+    }
+
+    // reprice the whole universe from the latest prices, Newton warm-started from the previous yields
+    void Recompute() {
+        std::lock_guard<std::mutex> lock(batch);
+        size_t size = cusips.size();
+        for (size_t i = 0; i < size; ++i) dirty[i] = quoted[i].load(std::memory_order_relaxed) + coupon[i] * (coupons[i] - periods[i]);
+        size_t i = 0;
+        for (; i + kLanes <= size; i += kLanes) {
+            Lanes c = Load(coupon.data() + i), m = Load(periods.data() + i), n = Load(coupons.data() + i), target = Load(dirty.data() + i);
+            Lanes guess = Load(yield.data() + i), y = guess;
+            Lanes price, slope;
+            Masks converged = {};
+            for (int it = 0; it < kMaxIterations; ++it) {
+                PriceAndSlope(c, m, n, y, price, slope);
+                Lanes step = (price - target) / slope;
+                y -= step;
+                converged = (step < kTolerance) & (-step < kTolerance);
+                bool all = true;
+                for (size_t k = 0; k < kLanes; ++k) all = all && converged[k];
+                if (all) break;
+            }
+            PriceAndSlope(c, m, n, y, price, slope);
+            Store(yield.data() + i, y);
+            Store(duration.data() + i, -slope / price);
+            Store(pv01.data() + i, -slope * 1e-4);
+            // a lane the polynomials don't cover (or that didn't converge) is solved with pow
+            Masks valid = converged & (y < kMaxYield) & (y > -kMaxYield);
+            for (size_t k = 0; k < kLanes; ++k) {
+                if (!valid[k]) {
+                    yield[i + k] = SolveYield(i + k, quoted[i + k].load(std::memory_order_relaxed), guess[k]);
+                    Finish(i + k);
+                }
+                published[i + k].store(pv01[i + k], std::memory_order_release);
+            }
+        }
+        for (; i < size; ++i) {
+            // the remainder of the lanes
+            yield[i] = SolveYield(i, quoted[i].load(std::memory_order_relaxed), yield[i]);
+            Finish(i);
+        }
+    }
+
+    // number of securities
+    size_t GetSize() const { return cusips.size(); }
+
+    // time to maturity in years
+    double GetYearsToMaturity(size_t i) const { return 0.5 * periods[i]; }
+
+    // cash flow terms of PriceAndSlope: semi-annual coupon, periods to maturity, coupons left
+    double GetCoupon(size_t i) const { return coupon[i]; }
+    double GetPeriods(size_t i) const { return periods[i]; }
+    double GetCouponCount(size_t i) const { return coupons[i]; }
+
+    // results, on the thread feeding the prices
+    double GetYield(size_t i) const { return yield[i]; }
+    double GetModifiedDuration(size_t i) const { return duration[i]; }
+    double GetPV01(size_t i) const { return pv01[i]; }
+
+    // PV01 per 100 face of a security, from any thread
+    double GetPV01(const std::string &cusip) const {
+        int i = GetIndex(cusip);
+        return (i >= 0) ? published[i].load(std::memory_order_acquire) : 0.0;
+    }
+};
+
+/**
+ * Listener feeding the mids of BondPricingService to the analytics engine.
+ */
+class BondAnalyticsListener : public ServiceListener<Price<Bond> > {
+   private:
+    BondAnalytics *analytics;
+
+   public:
+    explicit BondAnalyticsListener(BondAnalytics *_analytics) : analytics(_analytics) {}
+    virtual void ProcessAdd(Price<Bond> &_price) {
+        DEBUG_TEST("BondPricingService -> BondAnalytics\n");
+        analytics->OnPrice(_price.GetProduct().GetProductId(), _price.GetMid());
+    }
+    virtual void ProcessRemove(Price<Bond> &_price) {}
+    virtual void ProcessUpdate(Price<Bond> &_price) {}
+};
+
+#endif
@@ -10,6 +10,7 @@
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <cmath>
 
@@ -21,6 +22,7 @@ class BondInfo {
     static std::vector<std::string> cusips;
     static std::map<std::string, boost::gregorian::date*> date_map;
     static std::map<std::string, Bond*> bond_map;
+    static std::unordered_map<std::string, int> index_map;
 
     
     // method to convert CUSIP from string to the coupon rate
@@ -100,6 +102,18 @@ class BondInfo {
         return bond_map.find(cusip)->second;
     }
 
+    // position of the CUSIP in cusips, -1 if it's not one of ours
+    static int GetIndex(const std::string& cusip) {
+        auto itr = index_map.find(cusip);
+        return (itr != index_map.end()) ? itr->second : -1;
+    }
+
+    // position of a bond in cusips, cached on the bonds of bond_map
+    // and on their copies so that no lookup is needed
+    static int GetIndex(const Bond& bond) {
+        return (bond.GetIndex() >= 0) ? bond.GetIndex() : GetIndex(bond.GetProductId());
+    }
+
     // return the PV01 of the bond
     // We need yield curve to calculate the PV01
     // since we don't have it, we use T/100 instead
@@ -132,6 +146,7 @@ class BondInfo {
                 "91282CAZ4", "91282CAY7",
                 "91282CAV3", "912810ST6", 
                 "912810SS8"};
+        for (size_t i = 0; i < cusips.size(); ++i) index_map[cusips[i]] = int(i);
         // then initialize the date_map
         date_map.insert(make_pair("91282CAX9",  new boost::gregorian::date(2022, Nov, 30)));
         date_map.insert(make_pair("91282CBA80", new boost::gregorian::date(2023, Dec, 15)));
@@ -146,6 +161,7 @@ class BondInfo {
             double coupon = CUSIPToCoupon(cusip);
             auto maturityPtr = CUSIPToDate(cusip);
             auto bond = new Bond(cusip, CUSIP, "T", coupon, *maturityPtr);
+            bond->SetIndex(GetIndex(cusip));
             bond_map.insert(make_pair(cusip, bond));
         }
     }
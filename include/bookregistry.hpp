@@ -0,0 +1,77 @@
+/**
+ * bookregistry.hpp
+ * Registry of the trading books, mapping the book names
+ * ("TRSY1", "TRSY2", ...) to small dense integer ids.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef BOOK_REGISTRY_HPP
+#define BOOK_REGISTRY_HPP
+
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * The ids are handed out in order of first use, starting from 0,
+ * so they can index the per-book arrays (see Position).
+ * The registry is shared by all the threads: lookups take a shared lock,
+ * only registering a new book takes the exclusive one.
+ */
+class BookRegistry {
+   private:
+    struct Registry {
+        std::shared_mutex mutex;
+        std::unordered_map<std::string, int> ids;
+        std::vector<std::string> names;
+    };
+
+    static Registry& Instance() {
+        static Registry registry;
+        return registry;
+    }
+
+   public:
+    // id of the book, registering it on first use
+    static int GetId(const std::string& book) {
+        Registry& registry = Instance();
+        {
+            std::shared_lock<std::shared_mutex> lock(registry.mutex);
+            auto itr = registry.ids.find(book);
+            if (itr != registry.ids.end()) return itr->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(registry.mutex);
+        auto itr = registry.ids.find(book);
+        if (itr != registry.ids.end()) return itr->second;
+        int id = int(registry.names.size());
+        registry.names.push_back(book);
+        registry.ids.emplace(book, id);
+        return id;
+    }
+
+    // id of the book, -1 if it has never been registered
+    static int Find(const std::string& book) {
+        Registry& registry = Instance();
+        std::shared_lock<std::shared_mutex> lock(registry.mutex);
+        auto itr = registry.ids.find(book);
+        return (itr != registry.ids.end()) ? itr->second : -1;
+    }
+
+    // name of the book
+    static std::string GetName(int id) {
+        Registry& registry = Instance();
+        std::shared_lock<std::shared_mutex> lock(registry.mutex);
+        return registry.names[id];
+    }
+
+    // number of registered books
+    static int GetCount() {
+        Registry& registry = Instance();
+        std::shared_lock<std::shared_mutex> lock(registry.mutex);
+        return int(registry.names.size());
+    }
+};
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ * coroconnector.hpp
+ * Coroutine based connectors (C++20) on top of the asio awaitables.
+ * A connector session is written as a plain loop that co_awaits reading
+ * and writing lines, and suspends on the reactor's io_context without a
+ * thread or a stack of its own, so any number of sessions can share it.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef CORO_CONNECTOR_HPP
+#define CORO_CONNECTOR_HPP
+
+// boost 1.74's awaitable.hpp uses std::exchange without including <utility>
+#include <utility>
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include "reactor.hpp"
+#include "soa.hpp"
+
+using boost::asio::awaitable;
+using boost::asio::use_awaitable;
+
+/**
+ * Line oriented socket whose operations are awaitables.
+ */
+class LineSocket {
+   private:
+    tcp::socket socket;
+    boost::asio::streambuf buffer;
+
+   public:
+    explicit LineSocket(const boost::asio::any_io_executor& executor) : socket(executor) {}
+
+    // connect to localhost
+    awaitable<void> Connect(int port) {
+        co_await socket.async_connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port), use_awaitable);
+    }
+
+    // read the next line into line, without the \n
+    awaitable<void> ReadLine(std::string& line) {
+        size_t n = co_await boost::asio::async_read_until(socket, buffer, "\n", use_awaitable);
+        line.resize(n);
+        boost::asio::buffer_copy(boost::asio::buffer(&line[0], n), buffer.data());
+        buffer.consume(n);
+        line.erase(std::remove(line.begin(), line.end(), '\n'), line.end());
+    }
+
+    // write a line (terminated by \n)
+    awaitable<void> WriteLine(const std::string& line) {
+        co_await boost::asio::async_write(socket, boost::asio::buffer(line), use_awaitable);
+    }
+};
+
+/**
+ * Base of the connectors whose subscriber session is a coroutine.
+ * Type V is the data type of the connector.
+ */
+template <typename V>
+class CoroConnector : public Connector<V> {
+   public:
+    // run a subscriber session on the reactor, it counts as running until the coroutine returns
+    static void Spawn(Reactor& reactor, awaitable<void> session) {
+        reactor.SubscriberStarted();
+        boost::asio::co_spawn(reactor.GetContext(), std::move(session), [&reactor](std::exception_ptr e) {
+            if (e) {
+                try {
+                    std::rethrow_exception(e);
+                } catch (const std::exception& ex) {
+                    std::cout << "CoroConnector: " << ex.what() << std::endl;
+                }
+            }
+            reactor.SubscriberFinished();
+        });
+    }
+};
+
+/**
+ * Publisher session with a data_writer process written as a coroutine:
+ * wait for a queued line, write it, wait for the ack, and so on until
+ * the reactor closes it.
+ */
+class CoroLineWriter : public LineWriter {
+   private:
+    Reactor& reactor;
+    std::string file_name;
+    std::string reply;
+    LineRing ring;
+    // never expires, cancelled to wake up the session when a line is queued
+    boost::asio::steady_timer signal;
+    bool closing;
+    long dropped;
+
+    awaitable<void> Run(int port) {
+        LineSocket socket(co_await boost::asio::this_coro::executor);
+        co_await socket.Connect(port);
+        co_await socket.WriteLine(file_name + "\n");
+        co_await socket.ReadLine(reply);
+        std::cout << "connecting to the " << file_name << "...success" << std::endl;
+        while (true) {
+            while (ring.Empty() && !closing) {
+                boost::system::error_code ec;
+                co_await signal.async_wait(boost::asio::redirect_error(use_awaitable, ec));
+            }
+            if (ring.Empty()) break;
+            co_await socket.WriteLine(ring.Front());
+            co_await socket.ReadLine(reply);
+            ring.Pop();
+        }
+        co_await socket.WriteLine("EOF\n");
+    }
+
+   public:
+    CoroLineWriter(Reactor& _reactor, const std::string& _file_name)
+        : reactor(_reactor), file_name(_file_name), signal(_reactor.GetContext()), closing(false), dropped(0) {
+        signal.expires_at(boost::asio::steady_timer::time_point::max());
+        reactor.AddWriter(this);
+    }
+
+    void Start(int port) {
+        boost::asio::co_spawn(reactor.GetContext(), Run(port), [this](std::exception_ptr e) {
+            if (!e) return;
+            try {
+                std::rethrow_exception(e);
+            } catch (const std::exception& ex) {
+                std::cout << "CoroLineWriter (" << file_name << "): " << ex.what() << std::endl;
+            }
+        });
+    }
+
+    void Write(const std::string& line) {
+        // nothing is written once EOF is queued
+        if (closing) {
+            if (dropped++ == 0) std::cout << "CoroLineWriter (" << file_name << "): lines written after the end are dropped" << std::endl;
+            return;
+        }
+        ring.Push(line);
+        signal.cancel();
+    }
+
+    void Close() {
+        closing = true;
+        signal.cancel();
+    }
+};
+
+// the publisher session of a connector on the reactor
+inline LineWriter* MakeLineWriter(Reactor& reactor, const std::string& file_name) {
+    if (reactor.UsesCoroutines()) return new CoroLineWriter(reactor, file_name);
+    return new AsyncLineWriter(reactor, file_name);
+}
+
+#endif
@@ -9,6 +9,9 @@
 #ifndef DATAPUBLISH_HPP
 #define DATAPUBLISH_HPP
 
+// boost 1.74's awaitable.hpp uses std::exchange without including <utility>
+#include <utility>
+
 #include <algorithm>
 #include <boost/asio.hpp>
 #include <cstdlib>
@@ -0,0 +1,428 @@
+/**
+ * exchange.hpp
+ * Local exchange simulator: a price-time priority limit order book per
+ * security, matching the execution orders sent to a market.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef EXCHANGE_HPP
+#define EXCHANGE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bondinfo.hpp"
+#include "executionservice.hpp"
+#include "marketdataservice.hpp"
+#include "products.hpp"
+#include "soa.hpp"
+
+/**
+ * Limit order book of one security with price-time priority.
+ * The prices are ticks of 1/256 in a fixed band, every tick is a level
+ * of the array holding a FIFO of orders as an intrusive doubly linked
+ * list. The orders live in a pool allocated up front and are addressed
+ * by their index, which with the generation of the pool slot is the
+ * handle to cancel them, so a handle of an order filled or cancelled is
+ * refused even once its slot holds another order. A bitmap of the
+ * non-empty levels (64 levels a word, with a summary bit per word) finds
+ * the next best price when a level empties in a couple of word scans, so
+ * adding and cancelling an order are O(1) and nothing is allocated while
+ * matching.
+ */
+class LimitOrderBook {
+   public:
+    typedef uint64_t Handle;
+    static const Handle kNil = UINT64_MAX;
+    static const int kTicksPerPoint = 256;
+    static const int kMinTick = 50 * kTicksPerPoint;  // lowest price of the band
+    static const int kLevels = 100 * kTicksPerPoint;  // prices from 50 to 150
+
+    // a passive order hit by an incoming order
+    struct Fill {
+        int level;
+        long quantity;
+        uint64_t owner;
+        Handle handle;  // of the passive order
+        bool done;      // the passive order is filled in full and gone
+    };
+
+   private:
+    static const uint32_t kNone = UINT32_MAX;
+    static const int kWords = (kLevels + 63) / 64;
+
+    struct Node {
+        uint32_t prev;
+        uint32_t next;
+        int level;
+        long quantity;
+        uint64_t owner;
+        PricingSide side;
+        uint32_t generation;  // bumped every time the slot is freed
+        bool live;
+    };
+
+    struct Level {
+        uint32_t head;
+        uint32_t tail;
+        long quantity;
+        long orders;
+    };
+
+    std::vector<Node> pool;
+    uint32_t freeList;
+    std::vector<Level> levels;
+    std::vector<uint64_t> occupied;  // a bit per non-empty level
+    std::vector<uint64_t> summary;   // a bit per non-zero word of occupied
+    int bestBid;    // -1 if there is no bid
+    int bestOffer;  // kLevels if there is no offer
+
+    uint32_t Allocate() {
+        uint32_t node = freeList;
+        if (node != kNone) freeList = pool[node].next;
+        return node;
+    }
+
+    Handle HandleOf(uint32_t node) const { return (Handle(pool[node].generation) << 32) | node; }
+
+    void Mark(int level) {
+        occupied[level >> 6] |= uint64_t(1) << (level & 63);
+        summary[level >> 12] |= uint64_t(1) << ((level >> 6) & 63);
+    }
+
+    void Clear(int level) {
+        uint64_t &word = occupied[level >> 6];
+        word &= ~(uint64_t(1) << (level & 63));
+        if (word == 0) summary[level >> 12] &= ~(uint64_t(1) << ((level >> 6) & 63));
+    }
+
+    // lowest non-empty level from level up, kLevels if there is none
+    int Above(int level) const {
+        if (level >= kLevels) return kLevels;
+        int w = level >> 6;
+        uint64_t bits = occupied[w] & (~uint64_t(0) << (level & 63));
+        if (bits != 0) return (w << 6) + __builtin_ctzll(bits);
+        for (int s = (w + 1) >> 6; s < int(summary.size()); ++s) {
+            uint64_t words = summary[s];
+            if (s == (w + 1) >> 6) words &= ~uint64_t(0) << ((w + 1) & 63);
+            if (words == 0) continue;
+            int next = (s << 6) + __builtin_ctzll(words);
+            return (next << 6) + __builtin_ctzll(occupied[next]);
+        }
+        return kLevels;
+    }
+
+    // highest non-empty level from level down, -1 if there is none
+    int Below(int level) const {
+        if (level < 0) return -1;
+        int w = level >> 6;
+        uint64_t bits = occupied[w] & (~uint64_t(0) >> (63 - (level & 63)));
+        if (bits != 0) return (w << 6) + 63 - __builtin_clzll(bits);
+        for (int s = (w - 1) >> 6; w > 0 && s >= 0; --s) {
+            uint64_t words = summary[s];
+            if (s == (w - 1) >> 6) words &= ~uint64_t(0) >> (63 - ((w - 1) & 63));
+            if (words == 0) continue;
+            int next = (s << 6) + 63 - __builtin_clzll(words);
+            return (next << 6) + 63 - __builtin_clzll(occupied[next]);
+        }
+        return -1;
+    }
+
+    // take an order off its level, moving the best price if the level empties
+    void Unlink(uint32_t node) {
+        Node &order = pool[node];
+        Level &level = levels[order.level];
+        if (order.prev != kNone) pool[order.prev].next = order.next;
+        else level.head = order.next;
+        if (order.next != kNone) pool[order.next].prev = order.prev;
+        else level.tail = order.prev;
+        level.quantity -= order.quantity;
+        if (--level.orders == 0) {
+            // a level only holds one side, the bids below the best offer and the offers above the best bid
+            Clear(order.level);
+            if (order.level == bestBid) bestBid = Below(order.level - 1);
+            if (order.level == bestOffer) bestOffer = Above(order.level + 1);
+        }
+        order.live = false;
+        ++order.generation;
+        order.next = freeList;
+        freeList = node;
+    }
+
+    // quantity on the other side up to the limit, for FOK
+    long Available(PricingSide side, int limit, long wanted) const {
+        long available = 0;
+        if (side == BID) {
+            for (int l = bestOffer; l < kLevels && l <= limit && available < wanted; l = Above(l + 1)) available += levels[l].quantity;
+        } else {
+            for (int l = bestBid; l >= 0 && l >= limit && available < wanted; l = Below(l - 1)) available += levels[l].quantity;
+        }
+        return available;
+    }
+
+   public:
+    // ctor, room for capacity resting orders
+    explicit LimitOrderBook(size_t capacity = 1 << 16)
+        : pool(capacity), freeList(kNone), levels(kLevels), occupied(kWords, 0), summary((kWords + 63) / 64, 0), bestBid(-1), bestOffer(kLevels) {
+        for (size_t i = capacity; i-- > 0;) {
+            pool[i].next = freeList;
+            pool[i].generation = 0;
+            pool[i].live = false;
+            freeList = uint32_t(i);
+        }
+        for (Level &level : levels) level = Level{kNone, kNone, 0, 0};
+    }
+
+    // level of a price, -1 outside the band
+    static int ToLevel(double price) {
+        long tick = std::lround(price * kTicksPerPoint) - kMinTick;
+        return (tick >= 0 && tick < kLevels) ? int(tick) : -1;
+    }
+
+    // price of a level
+    static double ToPrice(int level) { return double(level + kMinTick) / kTicksPerPoint; }
+
+    // rest an order at the back of its level without matching it, kNil if it can't rest there
+    // (outside the band, crossing the book or the pool is exhausted)
+    Handle Add(PricingSide side, int level, long quantity, uint64_t owner) {
+        if (level < 0 || level >= kLevels || quantity <= 0) return kNil;
+        if (side == BID ? level >= bestOffer : level <= bestBid) return kNil;
+        uint32_t node = Allocate();
+        if (node == kNone) return kNil;
+        Level &l = levels[level];
+        Node &order = pool[node];
+        order.prev = l.tail;
+        order.next = kNone;
+        order.level = level;
+        order.quantity = quantity;
+        order.owner = owner;
+        order.side = side;
+        order.live = true;
+        if (l.tail != kNone) pool[l.tail].next = node;
+        else l.head = node;
+        l.tail = node;
+        l.quantity += quantity;
+        if (l.orders++ == 0) Mark(level);
+        if (side == BID && level > bestBid) bestBid = level;
+        if (side == OFFER && level < bestOffer) bestOffer = level;
+        return HandleOf(node);
+    }
+
+    // cancel a resting order, false for a handle of no order resting
+    // (never given, or of an order already filled or cancelled)
+    bool Cancel(Handle handle) {
+        uint32_t node = uint32_t(handle);
+        if (node >= pool.size() || !pool[node].live || pool[node].generation != uint32_t(handle >> 32)) return false;
+        Unlink(node);
+        return true;
+    }
+
+    // match an incoming order, appending the passive orders it hit to fills;
+    // the part of a LIMIT order left over rests in the book (its handle in rested),
+    // what is left of the other types is cancelled. Returns the quantity filled.
+    long Execute(PricingSide side, OrderType type, int limit, long quantity, uint64_t owner, std::vector<Fill> &fills, Handle *rested = nullptr) {
+        if (rested != nullptr) *rested = kNil;
+        if (type == STOP || quantity <= 0) return 0;  // stops are not supported by the venue
+        if (type == MARKET) limit = (side == BID) ? kLevels - 1 : 0;
+        if (limit < 0 || limit >= kLevels) return 0;
+        if (type == FOK && Available(side, limit, quantity) < quantity) return 0;
+
+        long left = quantity;
+        while (left > 0) {
+            int level = (side == BID) ? bestOffer : bestBid;
+            if (side == BID ? (level >= kLevels || level > limit) : (level < 0 || level < limit)) break;
+            // hit the level in time priority
+            while (left > 0 && levels[level].head != kNone) {
+                uint32_t node = levels[level].head;
+                Node &passive = pool[node];
+                long traded = std::min(left, passive.quantity);
+                bool done = (traded == passive.quantity);
+                fills.push_back(Fill{level, traded, passive.owner, HandleOf(node), done});
+                left -= traded;
+                if (done) {
+                    Unlink(node);
+                } else {
+                    passive.quantity -= traded;
+                    levels[level].quantity -= traded;
+                }
+            }
+        }
+        if (left > 0 && type == LIMIT) {
+            Handle handle = Add(side, limit, left, owner);
+            if (rested != nullptr) *rested = handle;
+        }
+        return quantity - left;
+    }
+
+    // best bid level, -1 if there is none
+    int GetBestBid() const { return bestBid; }
+
+    // best offer level, kLevels if there is none
+    int GetBestOffer() const { return bestOffer; }
+
+    // quantity resting at a level
+    long GetQuantity(int level) const { return levels[level].quantity; }
+};
+
+/**
+ * A simulated venue: one LimitOrderBook per security, with the liquidity
+ * of the market data feed resting in it. Every order book update replaces
+ * the venue's own quotes with the stacks of the update (scaled by the
+ * share of the displayed size the venue shows), and the orders sent to
+ * the venue's market match against them. What a client LIMIT order didn't
+ * fill rests in the book, tracked by its order id: a new quote of the
+ * venue crossing it, or an incoming order, fills it passively and the
+ * fill goes to the fill listener.
+ */
+class ExchangeSimulator : public ExecutionVenue {
+   public:
+    static const uint64_t kVenueOwner = 0;
+
+   private:
+    // a client order resting in a book
+    struct Resting {
+        ExecutionOrder<Bond> order;
+        int book;
+        LimitOrderBook::Handle handle;
+    };
+
+    Market market;
+    double share;
+    std::unordered_map<std::string, int> index;
+    std::vector<std::unique_ptr<LimitOrderBook> > books;
+    std::vector<std::vector<LimitOrderBook::Handle> > quotes;  // the venue's resting orders of every book
+    std::unordered_map<uint64_t, Resting> resting;             // the client orders resting, by owner
+    std::unordered_map<std::string, uint64_t> owners;          // the owner of every order resting
+    std::vector<LimitOrderBook::Fill> matched;
+    uint64_t orders;
+
+    LimitOrderBook *Find(const std::string &cusip, int *i = nullptr) {
+        auto itr = index.find(cusip);
+        if (itr == index.end()) return nullptr;
+        if (i != nullptr) *i = itr->second;
+        return books[itr->second].get();
+    }
+
+    // account for the passive side of the fills of book i: a quote of the venue filled
+    // in full is gone from the book, a client order hit is reported to the fill listener
+    void Settle(int i) {
+        for (const LimitOrderBook::Fill &fill : matched) {
+            if (fill.owner == kVenueOwner) {
+                if (!fill.done) continue;
+                std::vector<LimitOrderBook::Handle> &mine = quotes[i];
+                for (size_t k = 0; k < mine.size(); ++k)
+                    if (mine[k] == fill.handle) {
+                        mine[k] = mine.back();
+                        mine.pop_back();
+                        break;
+                    }
+                continue;
+            }
+            auto itr = resting.find(fill.owner);
+            if (itr == resting.end()) continue;
+            VenueFill passive{LimitOrderBook::ToPrice(fill.level), fill.quantity};
+            if (!fill.done) {
+                if (fillListener != nullptr) fillListener->OnPassiveFill(itr->second.order, passive);
+                continue;
+            }
+            // filled in full: no longer resting by the time the listener sees it
+            ExecutionOrder<Bond> order = itr->second.order;
+            owners.erase(order.GetOrderId());
+            resting.erase(itr);
+            if (fillListener != nullptr) fillListener->OnPassiveFill(order, passive);
+        }
+        matched.clear();
+    }
+
+    // rest a quote of the venue, filling the client orders it crosses first
+    void Quote(int i, PricingSide side, const Order &order) {
+        LimitOrderBook::Handle handle;
+        books[i]->Execute(side, LIMIT, LimitOrderBook::ToLevel(order.GetPrice()), long(order.GetQuantity() * share), kVenueOwner, matched, &handle);
+        if (handle != LimitOrderBook::kNil) quotes[i].push_back(handle);
+        Settle(i);
+    }
+
+   public:
+    // ctor, the books of the BondInfo universe with room for capacity orders each
+    explicit ExchangeSimulator(Market _market, double _share = 1.0, size_t capacity = 1 << 16) : market(_market), share(_share), orders(0) {
+        for (auto &cusip : BondInfo::GetCUSIP()) {
+            index[cusip] = int(books.size());
+            books.emplace_back(new LimitOrderBook(capacity));
+            quotes.emplace_back();
+        }
+    }
+
+    Market GetMarket() const { return market; }
+
+    // the book of a security, nullptr if it isn't listed
+    LimitOrderBook *GetBook(const std::string &cusip) { return Find(cusip); }
+
+    // number of client orders resting
+    size_t GetRestingCount() const { return resting.size(); }
+
+    // replace the venue's quotes with the stacks of an order book update
+    void OnMarketData(const OrderBook<Bond> &orderbook) {
+        int i;
+        LimitOrderBook *book = Find(orderbook.GetProduct().GetProductId(), &i);
+        if (book == nullptr) return;
+        for (LimitOrderBook::Handle handle : quotes[i]) book->Cancel(handle);
+        quotes[i].clear();
+        for (const Order &order : orderbook.GetBidStack()) Quote(i, BID, order);
+        for (const Order &order : orderbook.GetOfferStack()) Quote(i, OFFER, order);
+    }
+
+    // match an order, BID buying from the offers and OFFER selling to the bids;
+    // what a LIMIT order didn't fill rests at its limit until it is cancelled or hit
+    virtual void Execute(const ExecutionOrder<Bond> &order, std::vector<VenueFill> &fills) {
+        int i;
+        LimitOrderBook *book = Find(order.GetProduct().GetProductId(), &i);
+        if (book == nullptr) return;
+        uint64_t owner = ++orders;
+        LimitOrderBook::Handle handle;
+        book->Execute(order.GetPricingSide(), order.GetOrderType(), LimitOrderBook::ToLevel(order.GetPrice()), order.GetVisibleQuantity(), owner, matched, &handle);
+        for (const LimitOrderBook::Fill &fill : matched) fills.push_back(VenueFill{LimitOrderBook::ToPrice(fill.level), fill.quantity});
+        if (handle != LimitOrderBook::kNil && owners.emplace(order.GetOrderId(), owner).second) {
+            resting.emplace(owner, Resting{order, i, handle});
+        } else if (handle != LimitOrderBook::kNil) {
+            book->Cancel(handle);  // an order id already resting can't rest twice
+        }
+        Settle(i);
+    }
+
+    // cancel what rests of a client order, false if nothing of it rests
+    virtual bool Cancel(const std::string &orderId) {
+        auto owner = owners.find(orderId);
+        if (owner == owners.end()) return false;
+        auto itr = resting.find(owner->second);
+        books[itr->second.book]->Cancel(itr->second.handle);
+        resting.erase(itr);
+        owners.erase(owner);
+        return true;
+    }
+};
+
+/**
+ * Listener feeding the order books of BondMarketDataService to a venue,
+ * registered before the algo execution so the venue has the new book
+ * when the algo trades on it.
+ */
+class ExchangeMarketDataListener : public ServiceListener<OrderBook<Bond> > {
+   private:
+    ExchangeSimulator *exchange;
+
+   public:
+    explicit ExchangeMarketDataListener(ExchangeSimulator *_exchange) : exchange(_exchange) {}
+    virtual void ProcessAdd(OrderBook<Bond> &_orderbook) {
+        DEBUG_TEST("BondMarketDataService -> ExchangeSimulator\n");
+        exchange->OnMarketData(_orderbook);
+    }
+    virtual void ProcessRemove(OrderBook<Bond> &_orderbook) {}
+    virtual void ProcessUpdate(OrderBook<Bond> &_orderbook) {}
+};
+
+#endif
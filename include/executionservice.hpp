@@ -7,11 +7,19 @@
 #ifndef EXECUTION_SERVICE_HPP
 #define EXECUTION_SERVICE_HPP
 
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "bondinfo.hpp"
+#include "coroconnector.hpp"
 #include "marketdataservice.hpp"
+#include "objectpool.hpp"
+#include "pricingservice.hpp"
 #include "products.hpp"
 #include "soa.hpp"
 
@@ -32,8 +40,8 @@ enum Market { BROKERTEC,
 template <typename T>
 class ExecutionOrder {
    public:
-    // ctor for an order
-    ExecutionOrder(const T &_product, PricingSide _side, string _orderId, OrderType _orderType, double _price, double _visibleQuantity, double _hiddenQuantity, string _parentOrderId, bool _isChildOrder) : product(_product) {
+    // ctor for an order, booked in the book _bookId of the BookRegistry (-1: any book)
+    ExecutionOrder(const T &_product, PricingSide _side, string _orderId, OrderType _orderType, double _price, double _visibleQuantity, double _hiddenQuantity, string _parentOrderId, bool _isChildOrder, int _bookId = -1) : product(_product) {
         side = _side;
         orderId = _orderId;
         orderType = _orderType;
@@ -42,6 +50,21 @@ class ExecutionOrder {
         hiddenQuantity = _hiddenQuantity;
         parentOrderId = _parentOrderId;
         isChildOrder = _isChildOrder;
+        bookId = _bookId;
+    }
+
+    // Overwrite the order in place when recycled by an ObjectPool
+    void Reset(const T &_product, PricingSide _side, const string &_orderId, OrderType _orderType, double _price, double _visibleQuantity, double _hiddenQuantity, const string &_parentOrderId, bool _isChildOrder, int _bookId = -1) {
+        product = _product;
+        side = _side;
+        orderId = _orderId;
+        orderType = _orderType;
+        price = _price;
+        visibleQuantity = _visibleQuantity;
+        hiddenQuantity = _hiddenQuantity;
+        parentOrderId = _parentOrderId;
+        isChildOrder = _isChildOrder;
+        bookId = _bookId;
     }
 
     // Get the product
@@ -71,6 +94,12 @@ class ExecutionOrder {
     // Is child order?
     bool IsChildOrder() const { return isChildOrder; }
 
+    // Get the id of the book the order is booked in, -1 if it goes to the next book of the rotation
+    int GetBookId() const { return bookId; }
+
+    // Set the book the order is booked in (by the pre-trade checks, which check its limits)
+    void SetBookId(int _bookId) { bookId = _bookId; }
+
    private:
     T product;
     PricingSide side;
@@ -81,6 +110,43 @@ class ExecutionOrder {
     double hiddenQuantity;
     string parentOrderId;
     bool isChildOrder;
+    int bookId;
+};
+
+/**
+ * A fill of an order on a venue.
+ */
+struct VenueFill {
+    double price;
+    long quantity;
+};
+
+/**
+ * Listener of the fills of the orders resting at a venue, hit by the
+ * orders and quotes coming in after them.
+ */
+class VenueFillListener {
+   public:
+    virtual ~VenueFillListener() {}
+    virtual void OnPassiveFill(const ExecutionOrder<Bond> &order, const VenueFill &fill) = 0;
+};
+
+/**
+ * A venue executing the orders sent to a market (see exchange.hpp):
+ * Execute() matches the order and appends its fills, what a LIMIT order
+ * didn't fill rests at the venue until Cancel() or until it is hit, its
+ * later fills going to the fill listener.
+ */
+class ExecutionVenue {
+   protected:
+    VenueFillListener *fillListener = nullptr;
+
+   public:
+    virtual ~ExecutionVenue() {}
+    virtual void Execute(const ExecutionOrder<Bond> &order, std::vector<VenueFill> &fills) = 0;
+    // cancel what rests of an order, false if nothing of it rests
+    virtual bool Cancel(const std::string &orderId) = 0;
+    void SetFillListener(VenueFillListener *listener) { fillListener = listener; }
 };
 
 /**
@@ -100,57 +166,270 @@ class ExecutionService : public Service<string, ExecutionOrder<T> > {
  * Keyed on product identifier.
  * Type T is the product type (Bond).
  */
-class BondExecutionService : public ExecutionService<Bond> {
+class BondExecutionService : public ExecutionService<Bond>, public VenueFillListener {
+   private:
+    // the venue of every market, nullptr for a market filling every order in full
+    ExecutionVenue *venues[CME + 1];
+    std::vector<VenueFill> fills;
+    VenueFillListener *passive;
+
+    void Publish(const ExecutionOrder<Bond> &_order, const VenueFill &fill) {
+        Pooled<ExecutionOrder<Bond> > execution(_order.GetProduct(), _order.GetPricingSide(), _order.GetOrderId(), _order.GetOrderType(),
+                                                fill.price, double(fill.quantity), 0.0, _order.GetParentOrderId(), _order.IsChildOrder(), _order.GetBookId());
+        this->Notify(*execution);
+    }
+
    public:
-    // Execute an order on a market
-    void ExecuteOrder(const ExecutionOrder<Bond> &_order, Market market) {
-        ExecutionOrder<Bond> order = _order;
-        this->Notify(order);
+    BondExecutionService() : venues(), passive(nullptr) {}
+
+    // send the orders for a market to a venue, which reports the fills of its resting orders here
+    void SetVenue(Market market, ExecutionVenue *venue) {
+        venues[market] = venue;
+        if (venue != nullptr) venue->SetFillListener(this);
+    }
+
+    // pass the fills of the resting orders on to listener once they are executions
+    void SetFillListener(VenueFillListener *listener) { passive = listener; }
+
+    // Execute an order on a market, returning the quantity filled
+    // on a venue every fill is an execution of the filled quantity at the fill price,
+    // otherwise the order is executed in full
+    long Execute(const ExecutionOrder<Bond> &_order, Market market) {
+        if (venues[market] == nullptr) {
+            ExecutionOrder<Bond> order = _order;
+            this->Notify(order);
+            return _order.GetVisibleQuantity();
+        }
+        fills.clear();
+        venues[market]->Execute(_order, fills);
+        long filled = 0;
+        for (const VenueFill &fill : fills) {
+            Publish(_order, fill);
+            filled += fill.quantity;
+        }
+        return filled;
+    }
+
+    // a resting order hit at its venue: the fill is an execution like the others
+    virtual void OnPassiveFill(const ExecutionOrder<Bond> &_order, const VenueFill &fill) {
+        Publish(_order, fill);
+        if (passive != nullptr) passive->OnPassiveFill(_order, fill);
     }
+
+    // cancel what rests of an order at the venue of a market, false if nothing of it rests
+    bool Cancel(const std::string &orderId, Market market) { return venues[market] != nullptr && venues[market]->Cancel(orderId); }
+
+    // Execute an order on a market
+    void ExecuteOrder(const ExecutionOrder<Bond> &_order, Market market) { Execute(_order, market); }
+};
+
+/**
+ * Signal conditions of the batch evaluation of BondAlgoExecutionService:
+ * the spread at most maxSpread, the top of book imbalance
+ * |bid - offer| / (bid + offer) quantity at least minImbalance, and the
+ * mid at most maxDeviation away from the fair value (once there is one).
+ * The universe is evaluated every batch updates (0: only on Evaluate()).
+ */
+struct AlgoSignalParams {
+    double maxSpread = 1.0 / 128;
+    double minImbalance = 0.0;
+    double maxDeviation = 1.0;
+    size_t batch = 64;
 };
 
 /**
  * Service for algo executing orders on an exchange for Bond.
+ * By default every order book is evaluated as it comes. In batch mode
+ * (SetBatch) an update only stores the top of book of its security in
+ * arrays indexed by BondInfo::GetIndex, one per field, and Evaluate()
+ * computes the signal of the whole universe in one branch-free loop over
+ * these arrays, then sends the orders of the securities updated since the
+ * last evaluation, in index order. A security updated several times in a
+ * batch is only evaluated on its last book. The loop is written with the
+ * vector extensions of GCC and Clang, two doubles per step, so it runs
+ * on SSE2 or NEON whatever the target flags (the compiler doesn't
+ * vectorize the scalar version below AVX2).
  * Keyed on product identifier.
  * Type T is the product type (Bond).
  */
 class BondAlgoExecutionService : public ExecutionService<Bond> {
    private:
-    // counter to alternate between BID and OFFER
-    int count;
+    // source of the order ids, own counter unless shared with other instances (the shards)
+    std::atomic<long> ownIds;
+    std::atomic<long> *ids;
+    // counters to alternate between BID and OFFER per security (by BondInfo::GetIndex),
+    // when the sides don't follow the order ids
+    bool sidesPerSecurity;
+    std::vector<long> sides;
+    long otherSides;
+
+    // batch mode: the top of book of the universe, structure of arrays
+    bool batchMode;
+    AlgoSignalParams params;
+    std::vector<const Bond *> products;
+    std::vector<double> bidPrice;
+    std::vector<double> offerPrice;
+    std::vector<double> bidQuantity;
+    std::vector<double> offerQuantity;
+    std::vector<double> fairValue;                    // copied from fairValueSource at every evaluation
+    std::vector<std::atomic<double> > fairValueSource;  // written by the fair value's threads
+    std::vector<unsigned char> dirty;
+    std::vector<unsigned char> signal;
+    size_t pending;
+    long evaluations;
+    long orders;
+
+    // two lanes of the arrays, and the masks of their comparisons
+    typedef double Lanes __attribute__((vector_size(16)));
+    typedef long long Masks __attribute__((vector_size(16)));
+    static const size_t kLanes = sizeof(Lanes) / sizeof(double);
+
+    static Lanes Load(const double *data) {
+        Lanes lanes;
+        std::memcpy(&lanes, data, sizeof(Lanes));
+        return lanes;
+    }
+
+    // the side of order id of a security: every book flips it, of any security
+    // (the id's parity) or of that security only
+    PricingSide NextSide(const Bond &product, long id) {
+        if (!sidesPerSecurity) return (id % 2) ? BID : OFFER;
+        int i = BondInfo::GetIndex(product);
+        long &count = (i >= 0 && size_t(i) < sides.size()) ? sides[i] : otherSides;
+        return (++count % 2) ? BID : OFFER;
+    }
+
+    // every book takes an order id, traded or not
+    long NextId() { return ids->fetch_add(1, std::memory_order_relaxed) + 1; }
+
+    void SendOrder(const Bond &product, PricingSide side, long id, double price, double quantity) {
+        string orderId = to_string(id);
+        double hidden_quantity = quantity;
+
+        Pooled<ExecutionOrder<Bond> > order(product,
+                                            side,
+                                            orderId,
+                                            MARKET,
+                                            price,
+                                            quantity,
+                                            hidden_quantity,
+                                            orderId,
+                                            false);
+        this->Notify(*order);
+    }
 
    public:
-    // ctor to initialize counter
-    BondAlgoExecutionService() : count(0) {}
+    // ctor to initialize the counters, the order ids come from _ids if given
+    // (shared by the instances that must not reuse each other's ids, the shards),
+    // and the sides alternate per security if _sidesPerSecurity
+    // (the shards again: the parity of shared ids depends on their interleaving)
+    explicit BondAlgoExecutionService(std::atomic<long> *_ids = nullptr, bool _sidesPerSecurity = false)
+        : ownIds(0), ids(_ids != nullptr ? _ids : &ownIds), sidesPerSecurity(_sidesPerSecurity), sides(BondInfo::GetCUSIP().size(), 0), otherSides(0), batchMode(false), pending(0), evaluations(0), orders(0) {}
+
+    // evaluate the books in batches of the universe from now on
+    void SetBatch(const AlgoSignalParams &_params) {
+        size_t n = BondInfo::GetCUSIP().size();
+        batchMode = true;
+        params = _params;
+        products.clear();
+        for (auto &cusip : BondInfo::GetCUSIP()) products.push_back(BondInfo::GetBond(cusip));
+        bidPrice.assign(n, 0.0);
+        offerPrice.assign(n, 0.0);
+        bidQuantity.assign(n, 0.0);
+        offerQuantity.assign(n, 0.0);
+        fairValue.assign(n, 0.0);
+        std::vector<std::atomic<double> >(n).swap(fairValueSource);
+        for (auto &fair : fairValueSource) fair.store(0.0);
+        dirty.assign(n, 0);
+        signal.assign(n, 0);
+    }
 
     // Algorithm to generate execution
-    // alternating between bid and offer
+    // alternating between bid and offer on every book
     // (taking the opposite side of the order book to cross the spread)
     // and only aggressing when the spread is at its tightest
     // (i.e. 1/128th) to reduce the cost of crossing the spread.
     void AlgoExecute(OrderBook<Bond> &orderbook) {
-        count = (count + 1);
-        PricingSide side = (count % 2) ? BID : OFFER;
+        if (batchMode) {
+            int i = BondInfo::GetIndex(orderbook.GetProduct());
+            if (i < 0 || orderbook.GetBidStack().empty() || orderbook.GetOfferStack().empty()) return;
+            bidPrice[i] = orderbook.GetBidStack()[0].GetPrice();
+            offerPrice[i] = orderbook.GetOfferStack()[0].GetPrice();
+            bidQuantity[i] = orderbook.GetBidStack()[0].GetQuantity();
+            offerQuantity[i] = orderbook.GetOfferStack()[0].GetQuantity();
+            dirty[i] = 1;
+            if (params.batch > 0 && ++pending >= params.batch) Evaluate();
+            return;
+        }
+        long id = NextId();
+        PricingSide side = NextSide(orderbook.GetProduct(), id);
         double spread = orderbook.GetSpread();
         if (spread > 1.0 / 128) return;
 
-        string orderId = to_string(count);
         double price = (side == BID) ? orderbook.GetBidStack()[0].GetPrice() : orderbook.GetOfferStack()[0].GetPrice();
         double quantity = (side == BID) ? orderbook.GetOfferStack()[0].GetQuantity() : orderbook.GetBidStack()[0].GetQuantity();
-        double hidden_quantity = quantity;
+        SendOrder(orderbook.GetProduct(), side, id, price, quantity);
+    }
+
+    // the latest fair value of a security (batch mode), from any thread
+    void SetFairValue(const Price<Bond> &price) {
+        if (!batchMode) return;
+        int i = BondInfo::GetIndex(price.GetProduct());
+        if (i >= 0) fairValueSource[i].store(price.GetMid(), std::memory_order_relaxed);
+    }
+
+    // evaluate the signal of every security and trade the ones updated since the last evaluation (batch mode)
+    void Evaluate() {
+        if (!batchMode) return;
+        size_t n = products.size();
+        for (size_t i = 0; i < n; ++i) fairValue[i] = fairValueSource[i].load(std::memory_order_relaxed);
+
+        const double *bp = bidPrice.data();
+        const double *op = offerPrice.data();
+        const double *bq = bidQuantity.data();
+        const double *oq = offerQuantity.data();
+        const double *fv = fairValue.data();
+        const unsigned char *updated = dirty.data();
+        unsigned char *out = signal.data();
+        const double maxSpread = params.maxSpread, minImbalance = params.minImbalance, maxDeviation = params.maxDeviation;
+        size_t i = 0;
+        for (; i + kLanes <= n; i += kLanes) {
+            // no division nor branch, |x| <= y is x <= y && -x <= y
+            Lanes bid = Load(bp + i), offer = Load(op + i), bidSize = Load(bq + i), offerSize = Load(oq + i), fair = Load(fv + i);
+            Lanes imbalance = bidSize - offerSize;
+            Lanes depth = minImbalance * (bidSize + offerSize);
+            Lanes deviation = 0.5 * (bid + offer) - fair;
+            Masks tight = (offer - bid) <= maxSpread;
+            Masks imbalanced = (imbalance >= depth) | (-imbalance >= depth);
+            Masks priced = (fair <= 0.0) | ((deviation <= maxDeviation) & (-deviation <= maxDeviation));
+            Masks mask = tight & imbalanced & priced;
+            for (size_t k = 0; k < kLanes; ++k) out[i + k] = updated[i + k] & (unsigned char)(mask[k] & 1);
+        }
+        for (; i < n; ++i) {
+            // the remainder of the lanes
+            unsigned char tight = op[i] - bp[i] <= maxSpread;
+            unsigned char imbalanced = std::fabs(bq[i] - oq[i]) >= minImbalance * (bq[i] + oq[i]);
+            unsigned char fair = (fv[i] <= 0.0) | (std::fabs(0.5 * (bp[i] + op[i]) - fv[i]) <= maxDeviation);
+            out[i] = updated[i] & tight & imbalanced & fair;
+        }
 
-        ExecutionOrder<Bond> order(orderbook.GetProduct(),
-                                   side,
-                                   orderId,
-                                   MARKET,
-                                   price,
-                                   quantity,
-                                   hidden_quantity,
-                                   orderId,
-                                   false);
-        this->Notify(order);
+        for (size_t i = 0; i < n; ++i) {
+            if (!dirty[i]) continue;
+            dirty[i] = 0;
+            long id = NextId();
+            PricingSide side = NextSide(*products[i], id);
+            if (!signal[i]) continue;
+            ++orders;
+            SendOrder(*products[i], side, id, side == BID ? bidPrice[i] : offerPrice[i], side == BID ? offerQuantity[i] : bidQuantity[i]);
+        }
+        pending = 0;
+        ++evaluations;
     }
 
+    // number of evaluations of the universe and of orders sent by them (batch mode)
+    long GetEvaluationCount() const { return evaluations; }
+    long GetBatchOrderCount() const { return orders; }
+
     // we don't need this method
     void ExecuteOrder(const ExecutionOrder<Bond> &order, Market market) {}
 };
@@ -174,6 +453,25 @@ class BondAlgoExecutionListener : public ServiceListener<OrderBook<Bond> > {
     virtual void ProcessUpdate(OrderBook<Bond> &_orderbook) {}
 };
 
+/**
+ * Bond Algo Execution service listener
+ * to listen the BondFairValueService
+ * then publish the fair values to BondAlgoExecutionService (batch mode)
+ */
+class BondAlgoFairValueListener : public ServiceListener<Price<Bond> > {
+   private:
+    BondAlgoExecutionService *service;
+
+   public:
+    explicit BondAlgoFairValueListener(BondAlgoExecutionService *_service) : service(_service) {}
+    virtual void ProcessAdd(Price<Bond> &_price) {
+        DEBUG_TEST("BondFairValueService -> BondAlgoExecutionService\n");
+        service->SetFairValue(_price);
+    }
+    virtual void ProcessRemove(Price<Bond> &_price) {}
+    virtual void ProcessUpdate(Price<Bond> &_price) {}
+};
+
 /**
  * Bond Execution service listener
  * to listen the BondAlgoExecutionService
@@ -182,14 +480,14 @@ class BondAlgoExecutionListener : public ServiceListener<OrderBook<Bond> > {
 class BondExecutionListener : public ServiceListener<ExecutionOrder<Bond> > {
    private:
     BondExecutionService *service;
+    Market market;
 
    public:
-    explicit BondExecutionListener(BondExecutionService *_service) : service(_service) {}
+    // ctor, the orders go to one market (BondSmartOrderRouter splits them across the markets)
+    explicit BondExecutionListener(BondExecutionService *_service, Market _market = CME) : service(_service), market(_market) {}
     virtual void ProcessAdd(ExecutionOrder<Bond> &_order) {
         DEBUG_TEST("BondAlgoExecutionService -> BondExecutionService\n");
-        // we didn't use Market argument?
-        // just randomly pass one, won't be used anyway
-        service->ExecuteOrder(_order, CME);
+        service->ExecuteOrder(_order, market);
     }
     // we don't need these methods
     virtual void ProcessRemove(ExecutionOrder<Bond> &_order) {}
@@ -206,10 +504,21 @@ class BondExecutionConnector : public Connector<ExecutionOrder<Bond> > {
     std::string file_name;
     boost::asio::io_service io_service;
     tcp::socket socket;
+    // buffers reused across publications
+    std::string line;
+    std::string reply;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<LineWriter> writer;
 
    public:
     // ctor
-    explicit BondExecutionConnector(string file_name_, int port = 1237) : file_name(file_name_), socket(io_service) {
+    explicit BondExecutionConnector(string file_name_, int port = 1237, Reactor *reactor = nullptr) : file_name(file_name_), socket(io_service) {
+        if (reactor != nullptr) {
+            // asynchronous session on the reactor's event loop
+            writer.reset(MakeLineWriter(*reactor, file_name));
+            writer->Start(port);
+            return;
+        }
         
         // connection of the socket
         std::cout << "connecting to the " << file_name << "...";
@@ -224,23 +533,34 @@ class BondExecutionConnector : public Connector<ExecutionOrder<Bond> > {
     // and prints them when it receives them.
     virtual void Publish(ExecutionOrder<Bond> &_order) {
         std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-        std::string timestamp = std::to_string(ms.count());
-        std::string side = (_order.GetPricingSide() == BID) ? "BUY" : "SELL";
-        std::string productId = _order.GetProduct().GetProductId();
-        std::string orderId = _order.GetOrderId();
-        std::string orderType = "MARKET";
-        std::string price = BondInfo::FormatPrice(_order.GetPrice());
-        std::string visibleQuantity = std::to_string(_order.GetVisibleQuantity());
-        std::string hiddenQuantity = std::to_string(_order.GetHiddenQuantity());
-        std::string line = timestamp + "," + productId + "," + orderId + "," + orderType + "," + side + "," + price + "," + visibleQuantity + "," + hiddenQuantity + "\n";
-        this->send_socket(socket, line + "\n");
-        auto success = this->read_socket(socket);
+        // timestamp,productId,orderId,orderType,side,price,visibleQuantity,hiddenQuantity
+        line.clear();
+        line += std::to_string(ms.count());
+        line += ',';
+        line += _order.GetProduct().GetProductId();
+        line += ',';
+        line += _order.GetOrderId();
+        line += ",MARKET,";
+        line += (_order.GetPricingSide() == BID) ? "BUY" : "SELL";
+        line += ',';
+        line += BondInfo::FormatPrice(_order.GetPrice());
+        line += ',';
+        line += std::to_string(_order.GetVisibleQuantity());
+        line += ',';
+        line += std::to_string(_order.GetHiddenQuantity());
+        line += '\n';
+        if (writer) {
+            writer->Write(line);
+        } else {
+            this->send_socket(socket, line);
+            this->read_socket(socket, reply);
+        }
         DEBUG_TEST("ExecutionOrder -> BondExecutionConnector\n");
     }
     // dtor, we need to kill the data_writer process by sending EOF
     ~BondExecutionConnector() {
         std::cout << "Finished, killing the data_writer (" << file_name << ") process" << std::endl;
-        this->send_socket(socket, "EOF\n");
+        if (!writer) this->send_socket(socket, "EOF\n");
     }
 };
 
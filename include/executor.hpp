@@ -0,0 +1,208 @@
+/**
+ * executor.hpp
+ * Work-stealing task executor with per-key serial lanes.
+ * Services post their listener invocations to it (see Service::SetExecutor)
+ * so the fan-out points of the pipeline run in parallel while the events
+ * of one security stay in order.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Every task is posted with a key, the key is hashed to one of the serial
+ * lanes and the tasks of a lane run one at a time in the order they were
+ * posted. A lane with pending tasks sits in the deque of exactly one worker,
+ * idle workers steal lanes from the front of the other workers' deques.
+ */
+class WorkStealingExecutor {
+   private:
+    // a serial lane of tasks
+    struct Lane {
+        std::mutex mutex;
+        std::deque<std::function<void()> > tasks;
+        bool scheduled = false;  // in a worker deque or running
+    };
+
+    // the deque of lanes owned by a worker
+    struct Worker {
+        std::mutex mutex;
+        std::deque<size_t> lanes;
+    };
+
+    // number of tasks a worker runs from a lane before giving other lanes a turn
+    static const int kBatch = 64;
+
+    size_t num_lanes;
+    std::unique_ptr<Lane[]> lanes;
+    std::vector<std::unique_ptr<Worker> > workers;
+    std::vector<std::thread> threads;
+
+    std::atomic<long> ready;    // lanes waiting in the worker deques
+    std::atomic<long> pending;  // tasks posted but not finished
+    std::atomic<bool> stop;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::mutex drain_mutex;
+    std::condition_variable drained;
+
+    // index of the worker running on this thread (-1 if not a worker of this executor)
+    int WorkerIndex() const {
+        return (current_executor() == this) ? current_worker() : -1;
+    }
+    static const WorkStealingExecutor *&current_executor() {
+        static thread_local const WorkStealingExecutor *executor = nullptr;
+        return executor;
+    }
+    static int &current_worker() {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    // put a lane with pending tasks into a worker deque and wake up a worker
+    void Schedule(size_t lane, bool front) {
+        int self = WorkerIndex();
+        Worker &worker = *workers[self >= 0 ? self : lane % workers.size()];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (front)
+                worker.lanes.push_front(lane);
+            else
+                worker.lanes.push_back(lane);
+        }
+        ready.fetch_add(1);
+        // take the sleep mutex so a worker about to sleep can't miss the wake up
+        { std::lock_guard<std::mutex> lock(sleep_mutex); }
+        wake.notify_one();
+    }
+
+    // pop a lane from the own deque (LIFO) or steal one from another worker (FIFO)
+    bool FindLane(int self, size_t &lane) {
+        size_t n = workers.size();
+        for (size_t i = 0; i < n; ++i) {
+            Worker &worker = *workers[(self + i) % n];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.lanes.empty()) continue;
+            if (i == 0) {
+                lane = worker.lanes.back();
+                worker.lanes.pop_back();
+            } else {
+                lane = worker.lanes.front();
+                worker.lanes.pop_front();
+            }
+            ready.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    // run up to kBatch tasks of the lane, in order
+    void RunLane(size_t index) {
+        Lane &lane = lanes[index];
+        for (int i = 0; i < kBatch; ++i) {
+            std::function<void()> task;
+            {
+                std::lock_guard<std::mutex> lock(lane.mutex);
+                if (lane.tasks.empty()) {
+                    lane.scheduled = false;
+                    return;
+                }
+                task = std::move(lane.tasks.front());
+                lane.tasks.pop_front();
+            }
+            task();
+            if (pending.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(drain_mutex);
+                drained.notify_all();
+            }
+        }
+        // still scheduled, requeue behind the other lanes of this worker
+        Schedule(index, true);
+    }
+
+    void WorkerLoop(int self) {
+        current_executor() = this;
+        current_worker() = self;
+        size_t lane;
+        while (true) {
+            if (FindLane(self, lane)) {
+                RunLane(lane);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this] { return stop.load() || ready.load() > 0; });
+            if (stop.load() && ready.load() == 0) return;
+        }
+    }
+
+   public:
+    // ctor, start the worker threads
+    explicit WorkStealingExecutor(int num_workers = std::thread::hardware_concurrency(), size_t _num_lanes = 256)
+        : num_lanes(_num_lanes), lanes(new Lane[_num_lanes]), ready(0), pending(0), stop(false) {
+        if (num_workers < 1) num_workers = 1;
+        for (int i = 0; i < num_workers; ++i) workers.emplace_back(new Worker());
+        for (int i = 0; i < num_workers; ++i) threads.emplace_back(&WorkStealingExecutor::WorkerLoop, this, i);
+    }
+
+    // dtor, finish the pending tasks and join the workers
+    ~WorkStealingExecutor() {
+        Drain();
+        stop.store(true);
+        { std::lock_guard<std::mutex> lock(sleep_mutex); }
+        wake.notify_all();
+        for (auto &thread : threads) thread.join();
+    }
+
+    WorkStealingExecutor(const WorkStealingExecutor &) = delete;
+    WorkStealingExecutor &operator=(const WorkStealingExecutor &) = delete;
+
+    // post a task to the lane of the key
+    void Post(size_t key, std::function<void()> task) {
+        size_t index = key % num_lanes;
+        Lane &lane = lanes[index];
+        pending.fetch_add(1);
+        bool schedule = false;
+        {
+            std::lock_guard<std::mutex> lock(lane.mutex);
+            lane.tasks.push_back(std::move(task));
+            if (!lane.scheduled) {
+                lane.scheduled = true;
+                schedule = true;
+            }
+        }
+        if (schedule) Schedule(index, false);
+    }
+
+    // post a task to the lane of a string key (e.g. the CUSIP)
+    void Post(const std::string &key, std::function<void()> task) {
+        Post(std::hash<std::string>()(key), std::move(task));
+    }
+
+    // block until every posted task (including the ones they post) has run
+    void Drain() {
+        std::unique_lock<std::mutex> lock(drain_mutex);
+        drained.wait(lock, [this] { return pending.load() == 0; });
+    }
+
+    // number of worker threads
+    int GetWorkerCount() const { return int(workers.size()); }
+};
+
+// lane key of the pipeline data: the hash of its product identifier (CUSIP)
+template <typename V>
+size_t ProductLaneKey(const V &data) {
+    return std::hash<std::string>()(data.GetProduct().GetProductId());
+}
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * fairvalueservice.hpp
+ * Fair value of the bonds joining the internal prices (BondPricingService)
+ * with the order books (BondMarketDataService).
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef FAIR_VALUE_SERVICE_HPP
+#define FAIR_VALUE_SERVICE_HPP
+
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bondinfo.hpp"
+#include "marketdataservice.hpp"
+#include "objectpool.hpp"
+#include "pricingservice.hpp"
+#include "soa.hpp"
+
+/**
+ * Parameters of the fair value: the order book side is the microprice
+ * of the first depth levels (each side at its volume weighted price,
+ * weighted by the quantity of the other side), blended with the internal
+ * mid with bookWeight.
+ */
+struct FairValueParams {
+    int depth = 1;
+    double bookWeight = 0.5;
+};
+
+/**
+ * Fair value service keeping the latest internal price and the latest
+ * order book side by side, in arrays indexed by BondInfo::GetIndex.
+ * A tick only recomputes its own side (the internal mid and spread, or
+ * the microprice and spread of the book) and blends it with the other
+ * side as last seen, then the fair value is published as a Price<Bond>
+ * with the internal spread (the book's until there is an internal price).
+ * Until a security has both sides, its fair value is the side it has.
+ * The prices and the books may tick on different threads, every security
+ * has its own mutex.
+ * Keyed on product identifier.
+ */
+class BondFairValueService : public Service<string, Price<Bond> > {
+   private:
+    struct Security {
+        bool hasInternal;
+        double internalMid;
+        double internalSpread;
+        bool hasBook;
+        double microprice;
+        double bookSpread;
+    };
+
+    FairValueParams params;
+    std::vector<Security> securities;
+    std::vector<std::mutex> locks;
+    std::vector<Price<Bond> > fair;
+
+    // blend the two sides and publish
+    void Publish(int i) {
+        const Security &security = securities[i];
+        double mid = security.hasInternal ? security.internalMid : security.microprice;
+        if (security.hasInternal && security.hasBook) mid = params.bookWeight * security.microprice + (1.0 - params.bookWeight) * security.internalMid;
+        double spread = security.hasInternal ? security.internalSpread : security.bookSpread;
+        fair[i].Reset(fair[i].GetProduct(), mid, spread);
+        Pooled<Price<Bond> > price(fair[i].GetProduct(), mid, spread);
+        this->Notify(*price);
+    }
+
+   public:
+    // ctor, the securities of BondInfo
+    explicit BondFairValueService(const FairValueParams &_params = FairValueParams())
+        : params(_params), securities(BondInfo::GetCUSIP().size(), Security{false, 0.0, 0.0, false, 0.0, 0.0}), locks(BondInfo::GetCUSIP().size()) {
+        for (auto &cusip : BondInfo::GetCUSIP()) fair.push_back(Price<Bond>(*BondInfo::GetBond(cusip), 0.0, 0.0));
+    }
+
+    // an internal price ticks
+    void OnPrice(const Price<Bond> &price) {
+        int i = BondInfo::GetIndex(price.GetProduct().GetProductId());
+        if (i < 0) return;
+        std::lock_guard<std::mutex> lock(locks[i]);
+        Security &security = securities[i];
+        security.hasInternal = true;
+        security.internalMid = price.GetMid();
+        security.internalSpread = price.GetBidOfferSpread();
+        Publish(i);
+    }
+
+    // an order book ticks
+    void OnOrderBook(const OrderBook<Bond> &orderbook) {
+        int i = BondInfo::GetIndex(orderbook.GetProduct().GetProductId());
+        const vector<Order> &bids = orderbook.GetBidStack();
+        const vector<Order> &offers = orderbook.GetOfferStack();
+        if (i < 0 || bids.empty() || offers.empty()) return;
+        // volume weighted price and quantity of each side over the first levels
+        double bid = 0.0, offer = 0.0;
+        long bidQuantity = 0, offerQuantity = 0;
+        for (size_t k = 0; k < bids.size() && int(k) < params.depth; ++k) {
+            bid += bids[k].GetPrice() * bids[k].GetQuantity();
+            bidQuantity += bids[k].GetQuantity();
+        }
+        for (size_t k = 0; k < offers.size() && int(k) < params.depth; ++k) {
+            offer += offers[k].GetPrice() * offers[k].GetQuantity();
+            offerQuantity += offers[k].GetQuantity();
+        }
+        if (bidQuantity <= 0 || offerQuantity <= 0) return;
+        bid /= bidQuantity;
+        offer /= offerQuantity;
+        // the side with more quantity pushes the price towards the other one
+        double microprice = (bid * offerQuantity + offer * bidQuantity) / double(bidQuantity + offerQuantity);
+
+        std::lock_guard<std::mutex> lock(locks[i]);
+        Security &security = securities[i];
+        security.hasBook = true;
+        security.microprice = microprice;
+        security.bookSpread = offers[0].GetPrice() - bids[0].GetPrice();
+        Publish(i);
+    }
+
+    // the last fair value of a security
+    virtual Price<Bond> &GetData(string key) {
+        int i = BondInfo::GetIndex(key);
+        if (i < 0) {
+            std::cout << "Can't find bond " << key << std::endl;
+            exit(0);
+        }
+        return fair[i];
+    }
+
+    // we don't need this method
+    virtual void OnMessage(Price<Bond> &_price) {}
+};
+
+/**
+ * Fair value listener
+ * to listen the BondPricingService
+ * then pass the internal prices to BondFairValueService
+ */
+class BondFairValuePricingListener : public ServiceListener<Price<Bond> > {
+   private:
+    BondFairValueService *service;
+
+   public:
+    explicit BondFairValuePricingListener(BondFairValueService *_service) : service(_service) {}
+    virtual void ProcessAdd(Price<Bond> &_price) {
+        DEBUG_TEST("BondPricingService -> BondFairValueService\n");
+        service->OnPrice(_price);
+    }
+    virtual void ProcessRemove(Price<Bond> &_price) {}
+    virtual void ProcessUpdate(Price<Bond> &_price) {}
+};
+
+/**
+ * Fair value listener
+ * to listen the BondMarketDataService
+ * then pass the order books to BondFairValueService
+ */
+class BondFairValueMarketDataListener : public ServiceListener<OrderBook<Bond> > {
+   private:
+    BondFairValueService *service;
+
+   public:
+    explicit BondFairValueMarketDataListener(BondFairValueService *_service) : service(_service) {}
+    virtual void ProcessAdd(OrderBook<Bond> &_orderbook) {
+        DEBUG_TEST("BondMarketDataService -> BondFairValueService\n");
+        service->OnOrderBook(_orderbook);
+    }
+    virtual void ProcessRemove(OrderBook<Bond> &_orderbook) {}
+    virtual void ProcessUpdate(OrderBook<Bond> &_orderbook) {}
+};
+
+#endif
@@ -10,9 +10,12 @@
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 
+#include "coroconnector.hpp"
 #include "pricingservice.hpp"
 #include "soa.hpp"
 
@@ -22,10 +25,21 @@ class GUIConnector : public Connector<Price<V> > {
     std::string file_name;
     boost::asio::io_service io_service;
     tcp::socket socket;
+    // buffers reused across publications
+    std::string line;
+    std::string reply;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<LineWriter> writer;
 
    public:
     // ctor
-    explicit GUIConnector(string file_name_, int port = 1235) : file_name(file_name_), socket(io_service) {
+    explicit GUIConnector(string file_name_, int port = 1235, Reactor *reactor = nullptr) : file_name(file_name_), socket(io_service) {
+        if (reactor != nullptr) {
+            // asynchronous session on the reactor's event loop
+            writer.reset(MakeLineWriter(*reactor, file_name));
+            writer->Start(port);
+            return;
+        }
         // connection of the socket
         std::cout << "connecting to the " << file_name << "...";
         socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port));
@@ -37,15 +51,28 @@ class GUIConnector : public Connector<Price<V> > {
     // with millisecond precision to a file gui.txt.
     virtual void Publish(Price<V> &_price) {
         std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-        std::string info = to_string(ms.count()) + "," + _price.GetProduct().GetProductId() + "," + to_string(_price.GetMid()) + "," + to_string(_price.GetBidOfferSpread()) + "\n";
-        this->send_socket(socket, info + "\n");
-        auto success = this->read_socket(socket);
+        // timestamp,productId,mid,spread
+        line.clear();
+        line += to_string(ms.count());
+        line += ',';
+        line += _price.GetProduct().GetProductId();
+        line += ',';
+        line += to_string(_price.GetMid());
+        line += ',';
+        line += to_string(_price.GetBidOfferSpread());
+        line += '\n';
+        if (writer) {
+            writer->Write(line);
+        } else {
+            this->send_socket(socket, line);
+            this->read_socket(socket, reply);
+        }
         DEBUG_TEST("%s -> GUIConnector\n", _price.GetProduct().GetProductId().c_str());
     }
     // dtor, we need to kill the data_writer process by sending EOF
     ~GUIConnector() {
         std::cout << "Finished, killing the data_writer (" << file_name << ") process" << std::endl;
-        this->send_socket(socket, "EOF\n");
+        if (!writer) this->send_socket(socket, "EOF\n");
     }
 };
 
@@ -56,6 +83,7 @@ class GUIService : public Service<std::string, Price<T> > {
     int throttle;
     int count;
     GUIConnector<T> *gui_connector;
+    std::mutex mutex;  // throttle state and socket shared by all the lanes
 
    public:
     explicit GUIService(GUIConnector<T> *gui_connector_, long long int _throttle = 300) : gui_connector(gui_connector_) {
@@ -67,9 +95,10 @@ class GUIService : public Service<std::string, Price<T> > {
     // we don't need this function
     virtual void onMessage(Price<T> &_price) {}
 
-    void ProvideData(Price<T> data) {
+    void ProvideData(Price<T> &data) {
         uint64_t current_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-        if (current_time - last_time >= throttle && count < 100) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (static_cast<long long>(current_time - last_time) >= throttle && count < 100) {
             last_time = current_time;
             gui_connector->Publish(data);
             count++;
@@ -7,6 +7,14 @@
 #ifndef HISTORICAL_DATA_SERVICE_HPP
 #define HISTORICAL_DATA_SERVICE_HPP
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include "soa.hpp"
 
 /**
@@ -19,12 +27,14 @@ class HistoricalDataService : Service<string, T> {
    private:
     Connector<T> *connector;
     std::string dataType;  // T
+    std::mutex mutex;      // the connector socket is shared by all the lanes
    public:
     // ctor
     explicit HistoricalDataService(Connector<T> *_connector, std::string _dataType) : connector(_connector), dataType(_dataType) {}
     // Persist data to a store
     void PersistData(string persistKey, T &_data) {
         DEBUG_TEST("Persisting historical %s data\n", dataType.c_str());
+        std::lock_guard<std::mutex> lock(mutex);
         connector->Publish(_data);
     }
 };
@@ -38,7 +48,7 @@ template <typename T>
 class HistoricalDataListener : public ServiceListener<T> {
    private:
     HistoricalDataService<T> *service;
-    int count;  // persistent key
+    std::atomic<int> count;  // persistent key
 
    public:
     explicit HistoricalDataListener(HistoricalDataService<T> *_service) : service(_service), count(0) {}
@@ -50,4 +60,66 @@ class HistoricalDataListener : public ServiceListener<T> {
     virtual void ProcessUpdate(T &_data) {}
 };
 
+/**
+ * Listener persisting only the latest value of every key: the updates are
+ * held back and Flush() persists the ones that changed since the last flush.
+ * ProcessAdd flushes by itself once the interval has elapsed, the owner
+ * calls Flush() at the end of the run (or on a Reactor timer).
+ * Type T is the data type to persist.
+ */
+template <typename T>
+class ConflatingHistoricalDataListener : public ServiceListener<T> {
+   private:
+    HistoricalDataService<T> *service;
+    std::function<std::string(const T &)> keyOf;
+    std::chrono::milliseconds interval;
+    std::chrono::steady_clock::time_point lastFlush;
+    // latest value of every key, and the slots changed since the last flush
+    std::unordered_map<std::string, size_t> slots;
+    std::vector<T> latest;
+    std::vector<char> dirty;
+    std::vector<size_t> pending;
+    int count;  // persistent key
+    std::mutex mutex;
+
+    void FlushLocked() {
+        for (size_t slot : pending) {
+            service->PersistData(std::to_string(count++), latest[slot]);
+            dirty[slot] = 0;
+        }
+        pending.clear();
+        lastFlush = std::chrono::steady_clock::now();
+    }
+
+   public:
+    ConflatingHistoricalDataListener(HistoricalDataService<T> *_service, std::function<std::string(const T &)> _keyOf, long ms)
+        : service(_service), keyOf(_keyOf), interval(ms), lastFlush(std::chrono::steady_clock::now()), count(0) {}
+
+    virtual void ProcessAdd(T &_data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string key = keyOf(_data);
+        auto itr = slots.find(key);
+        if (itr == slots.end()) {
+            itr = slots.emplace(key, latest.size()).first;
+            latest.push_back(_data);
+            dirty.push_back(0);
+        } else {
+            latest[itr->second] = _data;
+        }
+        if (!dirty[itr->second]) {
+            dirty[itr->second] = 1;
+            pending.push_back(itr->second);
+        }
+        if (std::chrono::steady_clock::now() - lastFlush >= interval) FlushLocked();
+    }
+    virtual void ProcessRemove(T &_data) {}
+    virtual void ProcessUpdate(T &_data) {}
+
+    // persist the values held back
+    void Flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        FlushLocked();
+    }
+};
+
 #endif
@@ -7,7 +7,11 @@
 #ifndef INQUIRY_SERVICE_HPP
 #define INQUIRY_SERVICE_HPP
 
+#include <memory>
+
 #include "bondinfo.hpp"
+#include "coroconnector.hpp"
+#include "objectpool.hpp"
 #include "soa.hpp"
 #include "tradebookingservice.hpp"
 
@@ -34,6 +38,16 @@ class Inquiry {
         state = _state;
     }
 
+    // Overwrite the inquiry in place when recycled by an ObjectPool
+    void Reset(const string& _inquiryId, const T& _product, Side _side, long _quantity, double _price, InquiryState _state) {
+        inquiryId = _inquiryId;
+        product = _product;
+        side = _side;
+        quantity = _quantity;
+        price = _price;
+        state = _state;
+    }
+
     // Get the inquiry ID
     const string& GetInquiryId() const { return inquiryId; }
 
@@ -150,10 +164,15 @@ class BondInquiryService : public InquiryService<Bond> {
  * Keyed on some identifier.
  * Type T is the product type (Inquiry<Bond>).
  */
-class BondInquiryConnector : public Connector<Inquiry<Bond> > {
+class BondInquiryConnector : public CoroConnector<Inquiry<Bond> > {
    private:
     string file_name;
     BondInquiryService* service;
+    // buffers reused across records
+    string line;
+    std::vector<std::string> tokens;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<AsyncLineReader> reader;
 
    public:
     explicit BondInquiryConnector(string file_name_, BondInquiryService* _service) : file_name(file_name_), service(_service) {}
@@ -170,27 +189,54 @@ class BondInquiryConnector : public Connector<Inquiry<Bond> > {
         // send the file request message to the server
         send_socket(socket, file_name);
 
-        string line = read_socket(socket);
+        read_socket(socket, line);
 
         trim(line);
         std::cout << "success" << std::endl;
         while (line != "EOF") {
-            std::vector<std::string> tokens = split(line, ',');
-            std::string inquiryId = tokens[0];
-            std::string productId = tokens[1];
-            Side side = (tokens[2] == "BUY") ? BUY : SELL;
-            Bond product = *BondInfo::GetBond(productId);
-            Inquiry<Bond> inquiry(inquiryId, product, side, 0, 0, RECEIVED);
-            service->OnMessage(inquiry);
-
-            DEBUG_TEST("Inquiry RECEIVED -> BondInquiryService\n");
-
+            ProcessLine(line);
             // request for another line to the server
             send_socket(socket, file_name);
-            line = read_socket(socket);
+            read_socket(socket, line);
             trim(line);
         }
     }
+
+    // subscribe on the reactor's event loop instead of blocking on the socket
+    void Subscribe(Reactor& reactor, int port) {
+        reader.reset(new AsyncLineReader(reactor, file_name, [this](std::string& _line) { ProcessLine(_line); }));
+        reader->Start(port);
+    }
+
+    // subscribe as a coroutine on the reactor's event loop, run it with CoroConnector::Spawn
+    awaitable<void> CoSubscribe(int port) {
+        LineSocket socket(co_await boost::asio::this_coro::executor);
+        co_await socket.Connect(port);
+        std::string request = file_name + "\n";
+        co_await socket.WriteLine(request);
+        co_await socket.ReadLine(line);
+        std::cout << "connecting to the " << file_name << "...success" << std::endl;
+        while (line != "EOF") {
+            ProcessLine(line);
+            // request for another line to the server
+            co_await socket.WriteLine(request);
+            co_await socket.ReadLine(line);
+        }
+    }
+
+    // parse one line of inquiries.txt and pass it to the service
+    void ProcessLine(const std::string& line) {
+        AllocationCounter::RecordEvent();
+        split(line, ',', tokens);
+        const std::string& inquiryId = tokens[0];
+        const std::string& productId = tokens[1];
+        Side side = (tokens[2] == "BUY") ? BUY : SELL;
+        // recycled from the per-thread pool
+        Pooled<Inquiry<Bond> > inquiry(inquiryId, *BondInfo::GetBond(productId), side, 0, 0, RECEIVED);
+        service->OnMessage(*inquiry);
+
+        DEBUG_TEST("Inquiry RECEIVED -> BondInquiryService\n");
+    }
 };
 
 
@@ -204,10 +250,21 @@ class BondAllInquiriesConnector : public Connector<Inquiry<Bond> > {
     std::string file_name;
     boost::asio::io_service io_service;
     tcp::socket socket;
+    // buffers reused across publications
+    std::string line;
+    std::string reply;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<LineWriter> writer;
 
    public:
     // ctor
-    explicit BondAllInquiriesConnector(string file_name_, int port = 1237) : file_name(file_name_), socket(io_service) {
+    explicit BondAllInquiriesConnector(string file_name_, int port = 1237, Reactor *reactor = nullptr) : file_name(file_name_), socket(io_service) {
+        if (reactor != nullptr) {
+            // asynchronous session on the reactor's event loop
+            writer.reset(MakeLineWriter(*reactor, file_name));
+            writer->Start(port);
+            return;
+        }
         
         // connection of the socket
         std::cout << "connecting to the " << file_name << "...";
@@ -222,20 +279,29 @@ class BondAllInquiriesConnector : public Connector<Inquiry<Bond> > {
     // and prints them when it receives them.
     virtual void Publish(Inquiry<Bond> &_inquiry) {
         std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-        std::string timestamp = std::to_string(ms.count());
-        std::string productId = _inquiry.GetProduct().GetProductId();
-        std::string price = BondInfo::FormatPrice(_inquiry.GetPrice());
-        std::string state = (_inquiry.GetState() == DONE) ? "DONE" : "REJECTED";
-        std::string line = timestamp + "," + productId + "," + price + "," + state + "\n";
-        this->send_socket(socket, line + "\n");
-        auto success = this->read_socket(socket);
+        // timestamp,productId,price,state
+        line.clear();
+        line += std::to_string(ms.count());
+        line += ',';
+        line += _inquiry.GetProduct().GetProductId();
+        line += ',';
+        line += BondInfo::FormatPrice(_inquiry.GetPrice());
+        line += ',';
+        line += (_inquiry.GetState() == DONE) ? "DONE" : "REJECTED";
+        line += '\n';
+        if (writer) {
+            writer->Write(line);
+        } else {
+            this->send_socket(socket, line);
+            this->read_socket(socket, reply);
+        }
         DEBUG_TEST("Inquiry<Bond> -> BondAllInquiriesConnector\n");
         
     }
     // dtor, we need to kill the data_writer process by sending EOF
     ~BondAllInquiriesConnector() {
         std::cout << "Finished, killing the data_writer (" << file_name << ") process" << std::endl;
-        this->send_socket(socket, "EOF\n");
+        if (!writer) this->send_socket(socket, "EOF\n");
     }
 };
 
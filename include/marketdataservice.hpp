@@ -7,12 +7,15 @@
 #ifndef MARKET_DATA_SERVICE_HPP
 #define MARKET_DATA_SERVICE_HPP
 
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "bondinfo.hpp"
+#include "coroconnector.hpp"
+#include "objectpool.hpp"
 #include "products.hpp"
 #include "soa.hpp"
-#include "bondinfo.hpp"
 
 using namespace std;
 
@@ -82,6 +85,15 @@ class OrderBook {
                                                   bidStack(_bidStack),
                                                   offerStack(_offerStack) {}
 
+    // Overwrite the order book in place when recycled by an ObjectPool
+    void Reset(const T& _product,
+               const vector<Order>& _bidStack,
+               const vector<Order>& _offerStack) {
+        product = _product;
+        bidStack = _bidStack;
+        offerStack = _offerStack;
+    }
+
     // Get the product
     const T& GetProduct() const { return product; }
 
@@ -145,8 +157,12 @@ class BondMarketDataService : public MarketDataService<Bond> {
     }
     // update the map and notify the listeners
     virtual void OnMessage(OrderBook<Bond>& _orderbook) {
-        orderbooks.erase(_orderbook.GetProduct().GetProductId());
-        orderbooks.insert(make_pair(_orderbook.GetProduct().GetProductId(), _orderbook));
+        // overwrite the stored book in place so its stacks keep their capacity
+        auto itr = orderbooks.find(_orderbook.GetProduct().GetProductId());
+        if (itr != orderbooks.end())
+            itr->second = _orderbook;
+        else
+            orderbooks.insert(make_pair(_orderbook.GetProduct().GetProductId(), _orderbook));
         this->Notify(_orderbook);
     }
 };
@@ -156,10 +172,17 @@ class BondMarketDataService : public MarketDataService<Bond> {
  * Keyed on product identifier (CUSIPS string).
  * Type T is the product type (OrderBook<Bond>).
  */
-class BondMarketDataConnector : public Connector<OrderBook<Bond> > {
+class BondMarketDataConnector : public CoroConnector<OrderBook<Bond> > {
    private:
     string file_name;
     BondMarketDataService* marketdata_service;
+    // buffers reused across records
+    string line;
+    std::vector<std::string> tokens;
+    std::vector<Order> bidStack;
+    std::vector<Order> offerStack;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<AsyncLineReader> reader;
 
    public:
     explicit BondMarketDataConnector
@@ -179,37 +202,65 @@ class BondMarketDataConnector : public Connector<OrderBook<Bond> > {
         // send the file request message to the server
         send_socket(socket, file_name);
 
-        string line = read_socket(socket);
+        read_socket(socket, line);
         
         trim(line);
         std::cout << "success" << std::endl;
         while (line != "EOF") {
-            std::vector<std::string> tokens = split(line, ',');
-            // Transform data.
-            std::string productId = tokens[0];
-            std::vector<Order> bidStack;
-            std::vector<Order> offerStack;
-            // tokens 1,2,3,4,5 -> bid 4,3,2,1,0
-            // tokens 6,7,8,9,10 -> offer 0,1,2,3,4
-            for (int i=0; i<=4; ++i) {
-                double bid_price = BondInfo::CalculatePrice(tokens[5-i]);
-                double offer_price = BondInfo::CalculatePrice(tokens[6+i]);
-                // L millions quantity for L-level
-                double quantity = 1000000*(i+1);
-                bidStack.push_back(Order(bid_price,quantity,BID));
-                offerStack.push_back(Order(offer_price,quantity,OFFER));
-            }
-            Bond bond = *BondInfo::GetBond(productId);
-            OrderBook<Bond> orderbook(bond, bidStack, offerStack);
-            // For each price, call Service.OnMessage() once to pass this piece of data.
-            marketdata_service->OnMessage(orderbook);
-            DEBUG_TEST("OrderBook of %s -> BondMarketDataService\n", productId.c_str());
+            ProcessLine(line);
             // request for another line to the server
             send_socket(socket, file_name);
-            line = read_socket(socket);
+            read_socket(socket, line);
             trim(line);
         }
     }
+
+    // subscribe on the reactor's event loop instead of blocking on the socket
+    void Subscribe(Reactor& reactor, int port) {
+        reader.reset(new AsyncLineReader(reactor, file_name, [this](std::string& _line) { ProcessLine(_line); }));
+        reader->Start(port);
+    }
+
+    // subscribe as a coroutine on the reactor's event loop, run it with CoroConnector::Spawn
+    awaitable<void> CoSubscribe(int port) {
+        LineSocket socket(co_await boost::asio::this_coro::executor);
+        co_await socket.Connect(port);
+        std::string request = file_name + "\n";
+        co_await socket.WriteLine(request);
+        co_await socket.ReadLine(line);
+        std::cout << "connecting to the " << file_name << "...success" << std::endl;
+        while (line != "EOF") {
+            ProcessLine(line);
+            // request for another line to the server
+            co_await socket.WriteLine(request);
+            co_await socket.ReadLine(line);
+        }
+    }
+
+    // parse one line of marketdata.txt and pass it to the service
+    void ProcessLine(const std::string& line) {
+        AllocationCounter::RecordEvent();
+        split(line, ',', tokens);
+        // Transform data.
+        const std::string& productId = tokens[0];
+        bidStack.clear();
+        offerStack.clear();
+        // tokens 1,2,3,4,5 -> bid 4,3,2,1,0
+        // tokens 6,7,8,9,10 -> offer 0,1,2,3,4
+        for (int i=0; i<=4; ++i) {
+            double bid_price = BondInfo::CalculatePrice(tokens[5-i]);
+            double offer_price = BondInfo::CalculatePrice(tokens[6+i]);
+            // L millions quantity for L-level
+            double quantity = 1000000*(i+1);
+            bidStack.push_back(Order(bid_price,quantity,BID));
+            offerStack.push_back(Order(offer_price,quantity,OFFER));
+        }
+        // recycled from the per-thread pool
+        Pooled<OrderBook<Bond> > orderbook(*BondInfo::GetBond(productId), bidStack, offerStack);
+        // For each price, call Service.OnMessage() once to pass this piece of data.
+        marketdata_service->OnMessage(*orderbook);
+        DEBUG_TEST("OrderBook of %s -> BondMarketDataService\n", productId.c_str());
+    }
 };
 
 #endif
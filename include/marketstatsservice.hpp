@@ -0,0 +1,254 @@
+/**
+ * marketstatsservice.hpp
+ * Rolling statistics of the market per security: VWAP of the trades,
+ * realized volatility, average spread and imbalance of the top of book.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef MARKET_STATS_SERVICE_HPP
+#define MARKET_STATS_SERVICE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bondinfo.hpp"
+#include "marketdataservice.hpp"
+#include "soa.hpp"
+#include "streamoperators.hpp"
+#include "tradebookingservice.hpp"
+
+/**
+ * Windows of the statistics: the last tradeWindow trades for the VWAP,
+ * the last bookWindow order books for the others, and only those younger
+ * than ms milliseconds if ms > 0.
+ */
+struct MarketStatsParams {
+    size_t tradeWindow = 100;
+    size_t bookWindow = 100;
+    long ms = 0;
+};
+
+/**
+ * Statistics of a security over its windows.
+ */
+struct MarketStats {
+    double vwap = 0.0;        // of the trades
+    double volatility = 0.0;  // realized, square root of the sum of the squared log returns of the mid
+    double spread = 0.0;      // average
+    double imbalance = 0.0;   // average of (bid - offer) / (bid + offer) quantity at the top of book
+    long trades = 0;          // in the window
+    long books = 0;           // in the window
+};
+
+/**
+ * Market statistics service on BondMarketDataService and BondTradeBookingService.
+ * Every statistic is a SlidingWindow of streamoperators.hpp (a ring buffer
+ * and running sums per security, O(1) per update) whose aggregates land in
+ * the security's slot. The slots are seqlocks: a writer (under the slot's
+ * mutex, the trades and the books may come from different threads) makes
+ * the sequence odd, stores the statistics and makes it even again, and
+ * GetStats() copies them without a lock, retrying while the sequence is
+ * odd or moved, so the algo can read them at market data rate.
+ * Keyed on product identifier.
+ */
+class MarketStatsService : public Service<string, MarketStats> {
+   public:
+    enum Field { VWAP,
+                 VOLATILITY,
+                 SPREAD,
+                 IMBALANCE };
+
+   private:
+    // a log return of the mid of a security
+    struct MidReturn {
+        const std::string *cusip;
+        double value;
+    };
+
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<double> vwap{0.0};
+        std::atomic<double> volatility{0.0};
+        std::atomic<double> spread{0.0};
+        std::atomic<double> imbalance{0.0};
+        std::atomic<long> trades{0};
+        std::atomic<long> books{0};
+        std::mutex writer;
+        double mid = 0.0;  // last mid, on the market data thread
+    };
+
+    /**
+     * Listener storing the aggregates of a window in the slots
+     */
+    class WindowListener : public ServiceListener<Window<string> > {
+       private:
+        MarketStatsService *service;
+        Field field;
+
+       public:
+        WindowListener(MarketStatsService *_service, Field _field) : service(_service), field(_field) {}
+        virtual void ProcessAdd(Window<string> &_window) { service->Store(_window, field); }
+        virtual void ProcessRemove(Window<string> &_window) {}
+        virtual void ProcessUpdate(Window<string> &_window) {}
+    };
+
+    std::vector<std::string> cusips;
+    std::vector<Slot> slots;
+    SlidingWindow<string, Trade<Bond> > vwapWindow;
+    SlidingWindow<string, MidReturn> volatilityWindow;
+    SlidingWindow<string, OrderBook<Bond> > spreadWindow;
+    SlidingWindow<string, OrderBook<Bond> > imbalanceWindow;
+    WindowListener vwapListener;
+    WindowListener volatilityListener;
+    WindowListener spreadListener;
+    WindowListener imbalanceListener;
+
+    // write an aggregate into the slot of its security
+    void Store(const Window<string> &window, Field field) {
+        int i = BondInfo::GetIndex(window.GetKey());
+        if (i < 0) return;
+        Slot &slot = slots[i];
+        const WindowStats &stats = window.GetStats();
+        std::lock_guard<std::mutex> lock(slot.writer);
+        uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+        slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        switch (field) {
+            case VWAP:
+                slot.vwap.store(stats.WeightedMean(), std::memory_order_relaxed);
+                slot.trades.store(stats.count, std::memory_order_relaxed);
+                break;
+            case VOLATILITY:
+                slot.volatility.store(std::sqrt(std::max(0.0, stats.sumSquares)), std::memory_order_relaxed);
+                break;
+            case SPREAD:
+                slot.spread.store(stats.Mean(), std::memory_order_relaxed);
+                slot.books.store(stats.count, std::memory_order_relaxed);
+                break;
+            case IMBALANCE:
+                slot.imbalance.store(stats.Mean(), std::memory_order_relaxed);
+                break;
+        }
+        slot.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    static double Imbalance(const OrderBook<Bond> &orderbook) {
+        double bid = orderbook.GetBidStack()[0].GetQuantity();
+        double offer = orderbook.GetOfferStack()[0].GetQuantity();
+        return (bid + offer > 0) ? (bid - offer) / (bid + offer) : 0.0;
+    }
+
+   public:
+    // ctor, the securities of BondInfo
+    explicit MarketStatsService(const MarketStatsParams &params = MarketStatsParams())
+        : cusips(BondInfo::GetCUSIP()),
+          slots(cusips.size()),
+          vwapWindow([](const Trade<Bond> &t) { return t.GetProduct().GetProductId(); }, [](const Trade<Bond> &t) { return t.GetPrice(); },
+                     params.tradeWindow, params.ms, [](const Trade<Bond> &t) { return double(t.GetQuantity()); }),
+          volatilityWindow([](const MidReturn &r) { return *r.cusip; }, [](const MidReturn &r) { return r.value; }, params.bookWindow, params.ms),
+          spreadWindow([](const OrderBook<Bond> &o) { return o.GetProduct().GetProductId(); }, [](const OrderBook<Bond> &o) { return o.GetSpread(); },
+                       params.bookWindow, params.ms),
+          imbalanceWindow([](const OrderBook<Bond> &o) { return o.GetProduct().GetProductId(); }, &MarketStatsService::Imbalance, params.bookWindow, params.ms),
+          vwapListener(this, VWAP),
+          volatilityListener(this, VOLATILITY),
+          spreadListener(this, SPREAD),
+          imbalanceListener(this, IMBALANCE) {
+        vwapWindow.AddListener(&vwapListener);
+        volatilityWindow.AddListener(&volatilityListener);
+        spreadWindow.AddListener(&spreadListener);
+        imbalanceWindow.AddListener(&imbalanceListener);
+    }
+
+    // a trade is booked
+    void AddTrade(Trade<Bond> &trade) { vwapWindow.OnMessage(trade); }
+
+    // an order book ticks
+    void AddOrderBook(OrderBook<Bond> &orderbook) {
+        int i = BondInfo::GetIndex(orderbook.GetProduct().GetProductId());
+        if (i < 0 || orderbook.GetBidStack().empty() || orderbook.GetOfferStack().empty()) return;
+        double mid = 0.5 * (orderbook.GetBidStack()[0].GetPrice() + orderbook.GetOfferStack()[0].GetPrice());
+        double last = slots[i].mid;
+        slots[i].mid = mid;
+        if (last > 0.0 && mid > 0.0) {
+            MidReturn r{&cusips[i], std::log(mid / last)};
+            volatilityWindow.OnMessage(r);
+        }
+        spreadWindow.OnMessage(orderbook);
+        imbalanceWindow.OnMessage(orderbook);
+    }
+
+    // a consistent copy of the statistics of a security, lock-free;
+    // false if it is not in the universe
+    bool GetStats(int i, MarketStats &stats) const {
+        if (i < 0 || size_t(i) >= slots.size()) return false;
+        const Slot &slot = slots[i];
+        while (true) {
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence & 1) continue;
+            stats.vwap = slot.vwap.load(std::memory_order_relaxed);
+            stats.volatility = slot.volatility.load(std::memory_order_relaxed);
+            stats.spread = slot.spread.load(std::memory_order_relaxed);
+            stats.imbalance = slot.imbalance.load(std::memory_order_relaxed);
+            stats.trades = slot.trades.load(std::memory_order_relaxed);
+            stats.books = slot.books.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == sequence) return true;
+        }
+    }
+
+    bool GetStats(const std::string &cusip, MarketStats &stats) const { return GetStats(BondInfo::GetIndex(cusip), stats); }
+
+    // get the statistics of a security
+    // the result belongs to the calling thread and is valid until its next call
+    virtual MarketStats &GetData(string key) {
+        static thread_local MarketStats result;
+        result = MarketStats();
+        GetStats(key, result);
+        return result;
+    }
+};
+
+/**
+ * Market stats listener
+ * to listen the BondTradeBookingService
+ * then pass the trades to MarketStatsService
+ */
+class MarketStatsTradeListener : public ServiceListener<Trade<Bond> > {
+   private:
+    MarketStatsService *service;
+
+   public:
+    explicit MarketStatsTradeListener(MarketStatsService *_service) : service(_service) {}
+    virtual void ProcessAdd(Trade<Bond> &_trade) {
+        DEBUG_TEST("BondTradeBookingService -> MarketStatsService\n");
+        service->AddTrade(_trade);
+    }
+    virtual void ProcessRemove(Trade<Bond> &_trade) {}
+    virtual void ProcessUpdate(Trade<Bond> &_trade) {}
+};
+
+/**
+ * Market stats listener
+ * to listen the BondMarketDataService
+ * then pass the order books to MarketStatsService
+ */
+class MarketStatsMarketDataListener : public ServiceListener<OrderBook<Bond> > {
+   private:
+    MarketStatsService *service;
+
+   public:
+    explicit MarketStatsMarketDataListener(MarketStatsService *_service) : service(_service) {}
+    virtual void ProcessAdd(OrderBook<Bond> &_orderbook) {
+        DEBUG_TEST("BondMarketDataService -> MarketStatsService\n");
+        service->AddOrderBook(_orderbook);
+    }
+    virtual void ProcessRemove(OrderBook<Bond> &_orderbook) {}
+    virtual void ProcessUpdate(OrderBook<Bond> &_orderbook) {}
+};
+
+#endif
@@ -0,0 +1,317 @@
+/**
+ * objectpool.hpp
+ * Per-thread object pools for the pipeline message types, node arenas for
+ * the containers, plus a counter to measure heap allocations per ingested
+ * event.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef OBJECTPOOL_HPP
+#define OBJECTPOOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Allocation counter.
+ * Counts every call of the global operator new (only when the program is
+ * built with -DCOUNT_ALLOCATIONS, see DEFINE_ALLOCATION_COUNTER below)
+ * and every record pushed into the system by a subscriber connector.
+ * The first kWarmupEvents events are excluded from the steady-state figure
+ * since that's where the pools, buffers and maps are filled up.
+ */
+class AllocationCounter {
+   public:
+    static const long kWarmupEvents = 1000;
+
+    // number of heap allocations so far
+    static std::atomic<long>& Allocations() {
+        static std::atomic<long> allocations(0);
+        return allocations;
+    }
+
+    // number of events ingested so far
+    static std::atomic<long>& Events() {
+        static std::atomic<long> events(0);
+        return events;
+    }
+
+    // heap allocations made before the end of the warmup
+    static std::atomic<long>& WarmupAllocations() {
+        static std::atomic<long> warmup(0);
+        return warmup;
+    }
+
+    // called by the replacement operator new
+    static void RecordAllocation() {
+        Allocations().fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // called by the connectors once per record
+    static void RecordEvent() {
+        long events = Events().fetch_add(1, std::memory_order_relaxed) + 1;
+        if (events == kWarmupEvents)
+            WarmupAllocations().store(Allocations().load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    // print the allocations per event (total and steady state)
+    static void Report() {
+        long allocations = Allocations().load();
+        long events = Events().load();
+        std::cout << "heap allocations: " << allocations << ", events: " << events;
+        if (events > 0)
+            std::cout << ", allocations/event: " << double(allocations) / events;
+        if (events > kWarmupEvents) {
+            long steady = allocations - WarmupAllocations().load();
+            std::cout << ", steady state allocations/event: " << double(steady) / (events - kWarmupEvents);
+        }
+        std::cout << std::endl;
+    }
+};
+
+// Replace the global operator new/delete to count the heap allocations.
+// Must be expanded in exactly one translation unit (main.cpp).
+#define DEFINE_ALLOCATION_COUNTER                                   \
+    void* operator new(std::size_t size) {                         \
+        AllocationCounter::RecordAllocation();                     \
+        if (void* p = std::malloc(size ? size : 1)) return p;      \
+        throw std::bad_alloc();                                    \
+    }                                                              \
+    void operator delete(void* p) noexcept { std::free(p); }       \
+    void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+/**
+ * Per-thread recycling pool of event objects.
+ * Released objects are not destroyed but kept on a free list, and the next
+ * Acquire() calls T::Reset() with the ctor arguments to overwrite them in
+ * place, so the strings and vectors inside the event reuse their capacity.
+ * An object must be released on the thread that acquired it.
+ * Type T is the event type (OrderBook<Bond>, Trade<Bond>, ...).
+ */
+template <typename T>
+class ObjectPool {
+   private:
+    std::vector<T*> free_list;
+    std::vector<T*> all;
+    long acquired;
+    long allocated;
+
+   public:
+    explicit ObjectPool(size_t capacity = 64) : acquired(0), allocated(0) {
+        free_list.reserve(capacity);
+        all.reserve(capacity);
+    }
+
+    ~ObjectPool() {
+        for (auto p : all) delete p;
+    }
+
+    // the pool of the calling thread
+    static ObjectPool<T>& Local() {
+        static thread_local ObjectPool<T> pool;
+        return pool;
+    }
+
+    // get an object from the pool, constructing a new one only if the pool is empty
+    template <typename... Args>
+    T* Acquire(Args&&... args) {
+        ++acquired;
+        if (free_list.empty()) {
+            ++allocated;
+            T* p = new T(std::forward<Args>(args)...);
+            all.push_back(p);
+            return p;
+        }
+        T* p = free_list.back();
+        free_list.pop_back();
+        p->Reset(std::forward<Args>(args)...);
+        return p;
+    }
+
+    // give the object back to the pool
+    void Release(T* p) { free_list.push_back(p); }
+
+    // number of Acquire() calls
+    long GetAcquired() const { return acquired; }
+
+    // number of objects constructed on the heap
+    long GetAllocated() const { return allocated; }
+};
+
+/**
+ * RAII handle of a pooled event, released to its pool when out of scope.
+ */
+template <typename T>
+class Pooled {
+   private:
+    ObjectPool<T>* pool;
+    T* object;
+
+   public:
+    template <typename... Args>
+    explicit Pooled(Args&&... args) : pool(&ObjectPool<T>::Local()) {
+        object = pool->Acquire(std::forward<Args>(args)...);
+    }
+    Pooled(const Pooled&) = delete;
+    Pooled& operator=(const Pooled&) = delete;
+    ~Pooled() { pool->Release(object); }
+
+    T& operator*() const { return *object; }
+    T* operator->() const { return object; }
+};
+
+/**
+ * Recycling pool of event copies shared by the threads: a copy is acquired
+ * on the thread notifying the event and released on the executor worker
+ * running its listeners. Released copies are kept on a free list and
+ * overwritten by copy assignment, so the strings inside the event reuse
+ * their capacity.
+ */
+template <typename T>
+class SharedObjectPool {
+   private:
+    std::mutex mutex;
+    std::vector<T*> free_list;
+    std::vector<T*> all;
+
+   public:
+    SharedObjectPool() {}
+    SharedObjectPool(const SharedObjectPool&) = delete;
+    SharedObjectPool& operator=(const SharedObjectPool&) = delete;
+    ~SharedObjectPool() {
+        for (auto p : all) delete p;
+    }
+
+    // a pooled copy of the value, constructed on the heap only if the pool is empty
+    T* Acquire(const T& value) {
+        T* p = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!free_list.empty()) {
+                p = free_list.back();
+                free_list.pop_back();
+            }
+        }
+        if (p != nullptr) {
+            *p = value;
+            return p;
+        }
+        p = new T(value);
+        std::lock_guard<std::mutex> lock(mutex);
+        all.push_back(p);
+        return p;
+    }
+
+    // give the copy back to the pool, from any thread
+    void Release(T* p) {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_list.push_back(p);
+    }
+};
+
+/**
+ * Arena of fixed-size nodes owned by one container (through the copies of
+ * its PoolAllocator), so the nodes live as long as the container whatever
+ * the thread that allocated them. The node size is the size of the first
+ * allocation; memory is carved out of chunks of kChunkNodes nodes and
+ * freed nodes go to an intrusive free list, the chunks are only returned
+ * with the arena. Not thread safe, it's guarded by whatever guards its container.
+ */
+class NodeArena {
+   private:
+    static const size_t kChunkNodes = 256;
+    union Node {
+        Node* next;
+        alignas(std::max_align_t) char storage[1];
+    };
+    size_t size;  // of a node, 0 until the first allocation
+    Node* free_list;
+    std::vector<void*> chunks;
+
+   public:
+    NodeArena() : size(0), free_list(nullptr) {}
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+    ~NodeArena() {
+        for (auto chunk : chunks) ::operator delete(chunk);
+    }
+
+    static size_t RoundUp(size_t n) {
+        n = std::max(n, sizeof(Node));
+        return (n + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t);
+    }
+
+    // whether the arena serves nodes of that size
+    bool Serves(size_t _size) {
+        if (size == 0) size = RoundUp(_size);
+        return RoundUp(_size) == size;
+    }
+
+    void* Allocate() {
+        if (free_list == nullptr) {
+            char* chunk = static_cast<char*>(::operator new(kChunkNodes * size));
+            chunks.push_back(chunk);
+            for (size_t i = 0; i < kChunkNodes; ++i) {
+                Node* node = reinterpret_cast<Node*>(chunk + i * size);
+                node->next = free_list;
+                free_list = node;
+            }
+        }
+        Node* node = free_list;
+        free_list = node->next;
+        return node;
+    }
+
+    void Deallocate(void* p) {
+        Node* node = static_cast<Node*>(p);
+        node->next = free_list;
+        free_list = node;
+    }
+};
+
+/**
+ * STL allocator backed by a NodeArena of its own, meant for the node based
+ * containers (std::map, std::list) on the pipeline: the container and its
+ * rebound allocators share the arena, which goes away with the last of them.
+ * Single-object allocations of the arena's node size come from the arena,
+ * the rest from the heap.
+ */
+template <typename T>
+class PoolAllocator {
+   public:
+    typedef T value_type;
+
+    PoolAllocator() : arena(std::make_shared<NodeArena>()) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other) noexcept : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        if (n == 1 && arena->Serves(sizeof(T))) return static_cast<T*>(arena->Allocate());
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n == 1 && arena->Serves(sizeof(T)))
+            arena->Deallocate(p);
+        else
+            ::operator delete(p);
+    }
+
+    std::shared_ptr<NodeArena> arena;
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.arena == b.arena; }
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>& a, const PoolAllocator<U>& b) { return a.arena != b.arena; }
+
+#endif
@@ -0,0 +1,392 @@
+/**
+ * pnlservice.hpp
+ * Defines the data types and Service for the realized and unrealized PnL
+ * of the trades, marked to market.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef PNL_SERVICE_HPP
+#define PNL_SERVICE_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bondinfo.hpp"
+#include "bookregistry.hpp"
+#include "coroconnector.hpp"
+#include "marketdataservice.hpp"
+#include "objectpool.hpp"
+#include "positionservice.hpp"
+#include "pricingservice.hpp"
+#include "settlement.hpp"
+#include "soa.hpp"
+#include "tradebookingservice.hpp"
+
+/**
+ * PnL of a security in a book, or across all the books ("ALL").
+ * Type T is the product type.
+ */
+template <typename T>
+class PnL {
+   public:
+    // ctor for a PnL value
+    PnL(const T &_product, const string &_book, long _position, double _realized, double _unrealized, double _accrued = 0.0)
+        : product(_product), book(_book), position(_position), realized(_realized), unrealized(_unrealized), accrued(_accrued) {}
+
+    // Overwrite the PnL value in place when recycled by an ObjectPool
+    void Reset(const T &_product, const string &_book, long _position, double _realized, double _unrealized, double _accrued = 0.0) {
+        product = _product;
+        book = _book;
+        position = _position;
+        realized = _realized;
+        unrealized = _unrealized;
+        accrued = _accrued;
+    }
+
+    // Get the product
+    const T &GetProduct() const { return product; }
+
+    // Get the book
+    const string &GetBook() const { return book; }
+
+    // Get the position the PnL is marked on
+    long GetPosition() const { return position; }
+
+    // Get the realized PnL
+    double GetRealized() const { return realized; }
+
+    // Get the unrealized PnL
+    double GetUnrealized() const { return unrealized; }
+
+    // Get the total PnL
+    double GetTotal() const { return realized + unrealized; }
+
+    // Get the interest accrued on the position at its settlement date
+    double GetAccrued() const { return accrued; }
+
+   private:
+    T product;
+    string book;
+    long position;
+    double realized;
+    double unrealized;
+    double accrued;
+};
+
+/**
+ * Bond PnL Service, fed the trades by BondTradeBookingService and the marks
+ * by BondMarketDataService (mid of the top of book) and BondPricingService (mid).
+ * Average cost accounting: every (security, book) keeps its position, its
+ * signed cost and its realized PnL, the security keeps the sums over its
+ * books, so the unrealized PnL is mark * position - cost and a tick only
+ * touches its own security. The totals of the books across the securities
+ * are atomics moved by the deltas.
+ * Prices are per 100 face, the PnL is in currency. Given a SettlementEngine,
+ * the PnL also carries the interest accrued on the position at T+1.
+ * Keyed on product identifier (the PnL across the books).
+ */
+class BondPnLService : public Service<string, PnL<Bond> > {
+   private:
+    // one security in one book
+    struct Cell {
+        long position;
+        double cost;      // signed cost of the position, per 100 face
+        double realized;  // in currency
+        Cell() : position(0), cost(0.0), realized(0.0) {}
+    };
+
+    struct Security {
+        std::mutex mutex;
+        const Bond *bond;
+        int settlement;  // index in the SettlementEngine, -1 without one
+        double mark;
+        bool marked;  // by the market, until then the mark is the last trade price
+        long position;
+        double cost;
+        double realized;
+        std::vector<Cell> books;  // by BookRegistry id
+        Security(const Bond *_bond, int _settlement) : bond(_bond), settlement(_settlement), mark(0.0), marked(false), position(0), cost(0.0), realized(0.0) {}
+    };
+
+    // filled in the ctor only, so the threads can look up concurrently
+    std::unordered_map<std::string, int> index;
+    std::vector<std::unique_ptr<Security> > securities;
+    // totals of the books, by BookRegistry id
+    std::unique_ptr<std::atomic<double>[]> bookRealized;
+    std::unique_ptr<std::atomic<double>[]> bookUnrealized;
+    const SettlementEngine *settlement;
+
+    Security *Find(const std::string &cusip) {
+        auto itr = index.find(cusip);
+        return (itr != index.end()) ? securities[itr->second].get() : nullptr;
+    }
+
+    // interest accrued on a position of a security
+    double Accrued(const Security &security, long position) const {
+        return (security.settlement >= 0) ? position * settlement->GetAccrued(size_t(security.settlement)) / 100.0 : 0.0;
+    }
+
+    // move the mark of a security and the unrealized PnL of its books, with its lock held
+    void Remark(Security &security, double mark) {
+        double move = mark - security.mark;
+        security.mark = mark;
+        if (move == 0.0) return;
+        for (size_t b = 0; b < security.books.size(); ++b)
+            if (security.books[b].position != 0) bookUnrealized[b].fetch_add(move * security.books[b].position / 100.0);
+    }
+
+   public:
+    // ctor, flat in every security, with the accrued interest from the settlement engine if given
+    explicit BondPnLService(const SettlementEngine *_settlement = nullptr)
+        : bookRealized(new std::atomic<double>[AtomicPosition<Bond>::kMaxBooks]), bookUnrealized(new std::atomic<double>[AtomicPosition<Bond>::kMaxBooks]), settlement(_settlement) {
+        for (int b = 0; b < AtomicPosition<Bond>::kMaxBooks; ++b) {
+            bookRealized[b].store(0.0);
+            bookUnrealized[b].store(0.0);
+        }
+        for (auto &cusip : BondInfo::GetCUSIP()) {
+            index[cusip] = int(securities.size());
+            securities.emplace_back(new Security(BondInfo::GetBond(cusip), settlement ? settlement->GetIndex(cusip) : -1));
+        }
+    }
+
+    // book a trade: extend or reduce the position at its average cost, realizing the reduction
+    void AddTrade(const Trade<Bond> &trade) {
+        Security *security = Find(trade.GetProduct().GetProductId());
+        int book = trade.GetBookId();
+        if (security == nullptr || book >= AtomicPosition<Bond>::kMaxBooks) return;
+        double price = trade.GetPrice();
+        long quantity = (trade.GetSide() == BUY) ? trade.GetQuantity() : -trade.GetQuantity();
+        long position, total_position;
+        double realized, unrealized, total_realized, total_unrealized;
+        {
+            std::lock_guard<std::mutex> lock(security->mutex);
+            if (!security->marked) Remark(*security, price);
+            if (size_t(book) >= security->books.size()) security->books.resize(book + 1);
+            Cell &cell = security->books[book];
+            double before = security->mark * cell.position - cell.cost;
+
+            // the part closing the position is realized at its average cost
+            long closed = 0;
+            if (cell.position != 0 && (cell.position > 0) != (quantity > 0))
+                closed = (quantity > 0) ? std::min(quantity, -cell.position) : -std::min(-quantity, cell.position);
+            double closed_cost = (closed != 0) ? cell.cost * closed / cell.position : 0.0;
+            double pnl = (closed != 0) ? -(price * closed - closed_cost) / 100.0 : 0.0;
+            // the rest opens (or extends) it at the trade price
+            double cost = closed_cost + price * (quantity - closed);
+
+            cell.position += quantity;
+            cell.cost += cost;
+            cell.realized += pnl;
+            security->position += quantity;
+            security->cost += cost;
+            security->realized += pnl;
+            double after = security->mark * cell.position - cell.cost;
+            bookRealized[book].fetch_add(pnl);
+            bookUnrealized[book].fetch_add((after - before) / 100.0);
+
+            position = cell.position;
+            realized = cell.realized;
+            unrealized = after / 100.0;
+            total_position = security->position;
+            total_realized = security->realized;
+            total_unrealized = (security->mark * security->position - security->cost) / 100.0;
+        }
+        Pooled<PnL<Bond> > book_pnl(*security->bond, trade.GetBook(), position, realized, unrealized, Accrued(*security, position));
+        this->Notify(*book_pnl);
+        Pooled<PnL<Bond> > pnl(*security->bond, "ALL", total_position, total_realized, total_unrealized, Accrued(*security, total_position));
+        this->Notify(*pnl);
+    }
+
+    // a new mark for a security
+    void Mark(const std::string &cusip, double mark) {
+        Security *security = Find(cusip);
+        if (security == nullptr) return;
+        long position;
+        double realized, unrealized;
+        {
+            std::lock_guard<std::mutex> lock(security->mutex);
+            security->marked = true;
+            if (mark == security->mark) return;
+            Remark(*security, mark);
+            position = security->position;
+            realized = security->realized;
+            unrealized = (security->mark * security->position - security->cost) / 100.0;
+        }
+        // nothing to report on a flat security that never traded
+        if (position == 0 && realized == 0.0) return;
+        Pooled<PnL<Bond> > pnl(*security->bond, "ALL", position, realized, unrealized, Accrued(*security, position));
+        this->Notify(*pnl);
+    }
+
+    // the realized and unrealized PnL of a book across all the securities
+    double GetBookRealized(const std::string &book) const {
+        int id = BookRegistry::Find(book);
+        return (id >= 0 && id < AtomicPosition<Bond>::kMaxBooks) ? bookRealized[id].load() : 0.0;
+    }
+    double GetBookUnrealized(const std::string &book) const {
+        int id = BookRegistry::Find(book);
+        return (id >= 0 && id < AtomicPosition<Bond>::kMaxBooks) ? bookUnrealized[id].load() : 0.0;
+    }
+
+    // dirty market value of the positions across the books at their marks, settling T+1,
+    // from the batch revaluation of the settlement engine (0 without one)
+    double GetMarketValue() {
+        if (settlement == nullptr) return 0.0;
+        size_t size = settlement->GetSize();
+        std::vector<double> clean(size, 0.0), value(size, 0.0);
+        std::vector<long> quantity(size, 0);
+        for (auto &security : securities) {
+            if (security->settlement < 0) continue;
+            std::lock_guard<std::mutex> lock(security->mutex);
+            clean[security->settlement] = security->mark;
+            quantity[security->settlement] = security->position;
+        }
+        settlement->Revalue(clean.data(), quantity.data(), value.data());
+        double total = 0.0;
+        for (double v : value) total += v;
+        return total;
+    }
+
+    // the PnL of a security across the books
+    // the result belongs to the calling thread and is valid until its next call
+    virtual PnL<Bond> &GetData(string key) {
+        Security *security = Find(key);
+        if (security == nullptr) {
+            std::cout << "Can't find bond " << key << std::endl;
+            exit(0);
+        }
+        static thread_local PnL<Bond> result(*security->bond, "ALL", 0, 0.0, 0.0);
+        std::lock_guard<std::mutex> lock(security->mutex);
+        result.Reset(*security->bond, "ALL", security->position, security->realized, (security->mark * security->position - security->cost) / 100.0, Accrued(*security, security->position));
+        return result;
+    }
+
+    // the PnL is computed here, not fed by a connector
+    virtual void OnMessage(PnL<Bond> &data) {}
+};
+
+/**
+ * PnL listener to listen to BondTradeBookingService.
+ */
+class BondPnLTradeListener : public ServiceListener<Trade<Bond> > {
+   private:
+    BondPnLService *service;
+
+   public:
+    explicit BondPnLTradeListener(BondPnLService *_service) : service(_service) {}
+    virtual void ProcessAdd(Trade<Bond> &_trade) {
+        DEBUG_TEST("BondTradeBookingService -> BondPnLService\n");
+        service->AddTrade(_trade);
+    }
+    virtual void ProcessRemove(Trade<Bond> &_trade) {}
+    virtual void ProcessUpdate(Trade<Bond> &_trade) {}
+};
+
+/**
+ * PnL listener to listen to BondMarketDataService, marking at the mid of the top of book.
+ */
+class BondPnLMarketDataListener : public ServiceListener<OrderBook<Bond> > {
+   private:
+    BondPnLService *service;
+
+   public:
+    explicit BondPnLMarketDataListener(BondPnLService *_service) : service(_service) {}
+    virtual void ProcessAdd(OrderBook<Bond> &_orderbook) {
+        DEBUG_TEST("BondMarketDataService -> BondPnLService\n");
+        if (_orderbook.GetBidStack().empty() || _orderbook.GetOfferStack().empty()) return;
+        double mid = 0.5 * (_orderbook.GetBidStack()[0].GetPrice() + _orderbook.GetOfferStack()[0].GetPrice());
+        service->Mark(_orderbook.GetProduct().GetProductId(), mid);
+    }
+    virtual void ProcessRemove(OrderBook<Bond> &_orderbook) {}
+    virtual void ProcessUpdate(OrderBook<Bond> &_orderbook) {}
+};
+
+/**
+ * PnL listener to listen to BondPricingService, marking at the mid.
+ */
+class BondPnLPricingListener : public ServiceListener<Price<Bond> > {
+   private:
+    BondPnLService *service;
+
+   public:
+    explicit BondPnLPricingListener(BondPnLService *_service) : service(_service) {}
+    virtual void ProcessAdd(Price<Bond> &_price) {
+        DEBUG_TEST("BondPricingService -> BondPnLService\n");
+        service->Mark(_price.GetProduct().GetProductId(), _price.GetMid());
+    }
+    virtual void ProcessRemove(Price<Bond> &_price) {}
+    virtual void ProcessUpdate(Price<Bond> &_price) {}
+};
+
+/**
+ * Bond PnL Connector
+ * to publish the PnL to another process via TCP/IP
+ */
+class BondPnLConnector : public Connector<PnL<Bond> > {
+   private:
+    std::string file_name;
+    boost::asio::io_service io_service;
+    tcp::socket socket;
+    // buffers reused across publications
+    std::string line;
+    std::string reply;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<LineWriter> writer;
+
+   public:
+    // ctor
+    explicit BondPnLConnector(string file_name_, int port = 1244, Reactor *reactor = nullptr) : file_name(file_name_), socket(io_service) {
+        if (reactor != nullptr) {
+            // asynchronous session on the reactor's event loop
+            writer.reset(MakeLineWriter(*reactor, file_name));
+            writer->Start(port);
+            return;
+        }
+        // connection of the socket
+        std::cout << "connecting to the " << file_name << "...";
+        socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port));
+        this->send_socket(socket, file_name + "\n");
+        string success = this->read_socket(socket);
+        std::cout << "success" << std::endl;
+    }
+    // publish the PnL to the data_writer process
+    virtual void Publish(PnL<Bond> &_pnl) {
+        std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+        // timestamp,productId,book,position,realized,unrealized,total,accrued
+        line.clear();
+        line += std::to_string(ms.count());
+        line += ',';
+        line += _pnl.GetProduct().GetProductId();
+        line += ',';
+        line += _pnl.GetBook();
+        line += ',';
+        line += std::to_string(_pnl.GetPosition());
+        line += ',';
+        line += std::to_string(_pnl.GetRealized());
+        line += ',';
+        line += std::to_string(_pnl.GetUnrealized());
+        line += ',';
+        line += std::to_string(_pnl.GetTotal());
+        line += ',';
+        line += std::to_string(_pnl.GetAccrued());
+        line += '\n';
+        if (writer) {
+            writer->Write(line);
+        } else {
+            this->send_socket(socket, line);
+            this->read_socket(socket, reply);
+        }
+        DEBUG_TEST("PnL<Bond> -> BondPnLConnector\n");
+    }
+    // dtor, we need to kill the data_writer process by sending EOF
+    ~BondPnLConnector() {
+        std::cout << "Finished, killing the data_writer (" << file_name << ") process" << std::endl;
+        if (!writer) this->send_socket(socket, "EOF\n");
+    }
+};
+
+#endif
@@ -7,13 +7,19 @@
 #ifndef POSITION_SERVICE_HPP
 #define POSITION_SERVICE_HPP
 
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "bondinfo.hpp"
+#include "bookregistry.hpp"
+#include "coroconnector.hpp"
+#include "objectpool.hpp"
 #include "products.hpp"
 #include "soa.hpp"
 #include "tradebookingservice.hpp"
@@ -28,35 +34,122 @@ template <typename T>
 class Position {
    public:
     // ctor for a position
-    Position(const T &_product) : product(_product) {}
+    Position(const T &_product) : product(_product), aggregate(0) {}
+
+    // Reset the position when recycled by an ObjectPool
+    void Reset(const T &_product) {
+        product = _product;
+        positions.clear();
+        aggregate = 0;
+    }
 
     // Get the product
     const T &GetProduct() const { return product; }
 
-    // Get the position quantity
-    long GetPosition(string &book) { return positions[book]; }
+    // Get the position quantity of a book by its BookRegistry id
+    long GetPosition(int bookId) const {
+        return (bookId >= 0 && size_t(bookId) < positions.size()) ? positions[bookId] : 0;
+    }
+
+    // Get the position quantity (0 for a book we never traded, nothing is inserted)
+    long GetPosition(const string &book) const { return GetPosition(BookRegistry::Find(book)); }
 
     // Get the aggregate position
-    // I assume this means we add position of different books?
-    long GetAggregatePosition() {
-        long position = 0;
-        for (auto const &pos : positions) position += pos.second;
-        return position;
+    // the sum of the positions of the different books, kept up to date by AddPosition
+    long GetAggregatePosition() const { return aggregate; }
+
+    // Add a new position with side into the book with this BookRegistry id
+    void AddPosition(int bookId, long position, Side side) {
+        position = (side == BUY) ? position : -position;
+        if (size_t(bookId) >= positions.size()) positions.resize(bookId + 1, 0);
+        positions[bookId] += position;
+        aggregate += position;
     }
 
     // Add a new position with side into the specific book
-    void AddPosition(string book, long position, Side side) {
+    void AddPosition(const string &book, long position, Side side) {
+        AddPosition(BookRegistry::GetId(book), position, side);
+    }
+
+   private:
+    T product;
+    // dense array indexed by book id
+    vector<long> positions;
+    long aggregate;
+};
+
+/**
+ * Position of a security shared by the threads booking trades into it.
+ * Every book is an atomic counter and the aggregate is kept alongside,
+ * so AddPosition never blocks. Snapshot() gives a consistent copy of all
+ * the books: a writer bumps writers before touching the counters and
+ * generation after, and the reader retries until no writer was active
+ * and the generation didn't move while it was copying.
+ * Type T is the product type.
+ */
+template <typename T>
+class AtomicPosition {
+   public:
+    // the books are indexed by their BookRegistry id
+    static const int kMaxBooks = 256;
+
+    // ctor for a flat position
+    explicit AtomicPosition(const T &_product) : product(_product), books(new std::atomic<long>[kMaxBooks]), used(0), aggregate(0), generation(0), writers(0) {
+        for (int i = 0; i < kMaxBooks; ++i) books[i].store(0, std::memory_order_relaxed);
+    }
+
+    // Get the product
+    const T &GetProduct() const { return product; }
+
+    // Add a new position with side into the book with this BookRegistry id
+    void AddPosition(int bookId, long position, Side side) {
+        if (bookId < 0 || bookId >= kMaxBooks) {
+            std::cout << "AtomicPosition: book id " << bookId << " out of range" << std::endl;
+            exit(0);
+        }
         position = (side == BUY) ? position : -position;
-        auto itr = positions.find(book);
-        if (itr != positions.end())
-            itr->second += position;
-        else
-            positions.insert(std::make_pair(book, position));
+        writers.fetch_add(1);
+        int n = used.load();
+        while (n <= bookId && !used.compare_exchange_weak(n, bookId + 1)) {
+        }
+        books[bookId].fetch_add(position);
+        aggregate.fetch_add(position);
+        generation.fetch_add(1);
+        writers.fetch_sub(1);
+    }
+
+    // Get the aggregate position, without a snapshot
+    long GetAggregatePosition() const { return aggregate.load(); }
+
+    // Get the position of a book by its BookRegistry id, without a snapshot
+    long GetPosition(int bookId) const {
+        return (bookId >= 0 && bookId < kMaxBooks) ? books[bookId].load(std::memory_order_relaxed) : 0;
+    }
+
+    // number of books traded so far (1 + the highest book id)
+    int GetBookCount() const { return used.load(std::memory_order_relaxed); }
+
+    // copy a consistent view of every book into a Position
+    void Snapshot(Position<T> &position) const {
+        while (true) {
+            long g = generation.load();
+            if (writers.load() == 0) {
+                position.Reset(product);
+                int n = used.load();
+                for (int i = 0; i < n; ++i) position.AddPosition(i, books[i].load(), BUY);
+                if (writers.load() == 0 && generation.load() == g) return;
+            }
+            std::this_thread::yield();
+        }
     }
 
    private:
     T product;
-    map<string, long> positions;
+    std::unique_ptr<std::atomic<long>[]> books;
+    std::atomic<int> used;  // 1 + the highest book id traded
+    std::atomic<long> aggregate;
+    std::atomic<long> generation;
+    std::atomic<int> writers;
 };
 
 /**
@@ -78,47 +171,56 @@ class PositionService : public Service<string, Position<T> > {
  */
 class BondPositionService : public PositionService<Bond> {
    private:
-    map<string, Position<Bond> > positions;
+    // filled in the ctor only, so the threads can look up concurrently
+    map<string, std::unique_ptr<AtomicPosition<Bond> > > positions;
+
+    AtomicPosition<Bond> &Find(const string &cusip) {
+        auto itr = positions.find(cusip);
+        if (itr == positions.end()) {
+            std::cout << "Can't find position " << cusip << " in the BondPossitionService" << std::endl;
+            exit(0);
+        }
+        return *itr->second;
+    }
 
    public:
     // initailize the map cusip -> position(bond)
-    BondPositionService() {
-        auto cusips = BondInfo::GetCUSIP();
+    BondPositionService() : BondPositionService(BondInfo::GetCUSIP()) {}
+
+    // keep the positions of the given CUSIPs only (a shard of the universe)
+    explicit BondPositionService(const std::vector<std::string> &cusips) {
         for (auto cusip : cusips) {
             auto bond = BondInfo::GetBond(cusip);
-            auto position = Position<Bond>(*bond);
-            positions.insert(make_pair(cusip, position));
+            positions.insert(make_pair(cusip, std::unique_ptr<AtomicPosition<Bond> >(new AtomicPosition<Bond>(*bond))));
         }
     }
-    // Add a trade to the service
+    // Add a trade to the service, safe to call from several threads
     virtual void AddTrade(const Trade<Bond> &_trade) {
-        string cusip = _trade.GetProduct().GetProductId();
-        string book = _trade.GetBook();
-        long quantity = _trade.GetQuantity();
-        Side side = _trade.GetSide();
-        // first update the positions map
-        auto itr = positions.find(cusip);
-        if (itr != positions.end()) {
-            Position<Bond> &position = itr->second;
-            position.AddPosition(book, quantity, side);
-            // then notify all the listeners
-            this->Notify(itr->second);
-        } else {
-            std::cout << "Can't find bond " << cusip << " in the BondPossitionService" << std::endl;
-            exit(0);
-        }
+        AtomicPosition<Bond> &position = Find(_trade.GetProduct().GetProductId());
+        // first update the position, lock-free
+        position.AddPosition(_trade.GetBookId(), _trade.GetQuantity(), _trade.GetSide());
+        // then notify all the listeners with a snapshot
+        Pooled<Position<Bond> > snapshot(position.GetProduct());
+        position.Snapshot(*snapshot);
+        this->Notify(*snapshot);
     }
 
     // GetData method, the Service's original job!
+    // returns a snapshot owned by the calling thread, valid until its next GetData call
     virtual Position<Bond> &GetData(string key) {
-        auto itr = positions.find(key);
-        if (itr == positions.end()) {
-            std::cout << "Can't find position " << key << " in the BondPossitionService" << std::endl;
-            exit(0);
-        } else {
-            return positions.find(key)->second;
-        }
+        static thread_local std::unique_ptr<Position<Bond> > snapshot;
+        AtomicPosition<Bond> &position = Find(key);
+        if (!snapshot)
+            snapshot.reset(new Position<Bond>(position.GetProduct()));
+        position.Snapshot(*snapshot);
+        return *snapshot;
     }
+
+    // the aggregate position of a security without taking a snapshot
+    long GetAggregatePosition(const string &cusip) { return Find(cusip).GetAggregatePosition(); }
+
+    // the lock-free position of a security, to read its counters directly
+    const AtomicPosition<Bond> &GetAtomicPosition(const string &cusip) { return Find(cusip); }
 };
 
 /**
@@ -150,10 +252,21 @@ class BondPositionConnector : public Connector<Position<Bond> > {
     std::string file_name;
     boost::asio::io_service io_service;
     tcp::socket socket;
+    // buffers reused across publications
+    std::string line;
+    std::string reply;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<LineWriter> writer;
 
    public:
     // ctor
-    explicit BondPositionConnector(string file_name_, int port = 1237) : file_name(file_name_), socket(io_service) {
+    explicit BondPositionConnector(string file_name_, int port = 1237, Reactor *reactor = nullptr) : file_name(file_name_), socket(io_service) {
+        if (reactor != nullptr) {
+            // asynchronous session on the reactor's event loop
+            writer.reset(MakeLineWriter(*reactor, file_name));
+            writer->Start(port);
+            return;
+        }
         // connection of the socket
         std::cout << "connecting to the " << file_name << "...";
         socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port));
@@ -167,23 +280,32 @@ class BondPositionConnector : public Connector<Position<Bond> > {
     // and prints them when it receives them.
     virtual void Publish(Position<Bond> &_position) {
         std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-        std::string timestamp = std::to_string(ms.count());
-        std::string aggregate_position = std::to_string(_position.GetAggregatePosition());
-        std::string productId = _position.GetProduct().GetProductId();
         // cycle through the books above in order TRSY1, TRSY2, TRSY3
-        std::vector<std::string> books = {"TRSY1", "TRSY2", "TRSY3"};
-        std::string position1 = std::to_string(_position.GetPosition(books[0]));
-        std::string position2 = std::to_string(_position.GetPosition(books[1]));
-        std::string position3 = std::to_string(_position.GetPosition(books[2]));
-        std::string line = timestamp + "," + productId + "," + position1 + "," + position2 + "," + position3 + "," + aggregate_position + "\n";
-        this->send_socket(socket, line + "\n");
-        auto success = this->read_socket(socket);
+        static const int books[] = {BookRegistry::GetId("TRSY1"), BookRegistry::GetId("TRSY2"), BookRegistry::GetId("TRSY3")};
+        // timestamp,productId,position1,position2,position3,aggregate
+        line.clear();
+        line += std::to_string(ms.count());
+        line += ',';
+        line += _position.GetProduct().GetProductId();
+        for (int book : books) {
+            line += ',';
+            line += std::to_string(_position.GetPosition(book));
+        }
+        line += ',';
+        line += std::to_string(_position.GetAggregatePosition());
+        line += '\n';
+        if (writer) {
+            writer->Write(line);
+        } else {
+            this->send_socket(socket, line);
+            this->read_socket(socket, reply);
+        }
         DEBUG_TEST("Position<Bond> -> BondPositionConnector\n");
     }
     // dtor, we need to kill the data_writer process by sending EOF
     ~BondPositionConnector() {
         std::cout << "Finished, killing the data_writer (" << file_name << ") process" << std::endl;
-        this->send_socket(socket, "EOF\n");
+        if (!writer) this->send_socket(socket, "EOF\n");
     }
 };
 
@@ -0,0 +1,280 @@
+/**
+ * pretraderiskservice.hpp
+ * Defines the limits and the Service checking the algo orders against
+ * them before they reach BondExecutionService.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef PRE_TRADE_RISK_SERVICE_HPP
+#define PRE_TRADE_RISK_SERVICE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "bondinfo.hpp"
+#include "bookregistry.hpp"
+#include "executionservice.hpp"
+#include "marketdataservice.hpp"
+#include "positionservice.hpp"
+#include "riskservice.hpp"
+#include "soa.hpp"
+#include "tradebookingservice.hpp"
+
+/**
+ * Limits of a security, and of the security in each book. Quantities are
+ * face amounts, the notional is in currency at the order price and the
+ * PV01 is the risk of the position as in output/risk.txt (position times
+ * the PV01 of BondRiskService). The rates are in seconds of event time
+ * (see BondPreTradeRiskService). The defaults leave room above what the
+ * algo reaches on the data of data_generator.py in every mode (positions
+ * up to about 1.7bn, all of it in one book in shards mode, and a risk up
+ * to about 0.4bn), so they only stop a runaway algo.
+ */
+struct PreTradeLimits {
+    long maxPosition = 2500000000;        // aggregate position over the books
+    long maxBookPosition = 2000000000;    // position in the book the order is booked in
+    double maxNotional = 2500000000.0;    // aggregate position at the order price
+    double maxPV01 = 600000000.0;         // aggregate position PV01
+    double maxOrderRate = 200.0;          // orders per second
+    double maxOrderBurst = 100.0;         // orders allowed back to back
+    double maxBookOrderRate = 100.0;      // orders per second into the book
+    double maxBookOrderBurst = 50.0;      // orders allowed back to back into the book
+};
+
+enum PreTradeCheck { CHECK_PASSED,
+                     CHECK_POSITION,
+                     CHECK_BOOK_POSITION,
+                     CHECK_NOTIONAL,
+                     CHECK_PV01,
+                     CHECK_ORDER_RATE,
+                     CHECK_BOOK_ORDER_RATE };
+
+/**
+ * Pre-trade risk check stage between BondAlgoExecutionService and
+ * BondExecutionService: an order passing every check is notified
+ * downstream, one breaching a limit is counted and dropped.
+ * The limits apply to the position the order would leave behind, and
+ * an order reducing the exposure always passes. An order without a book
+ * (one not sliced from a parent) is checked in the next book of the
+ * rotation of BondTradeBookingListener (SetRotation), which it takes and
+ * is booked in if it passes, so the orders go to the books they go to
+ * without the checks; the book limits (position and order rate) are
+ * those of the security in that book.
+ * The order rates are token buckets refilled in event time: the feed has
+ * no timestamps, so every order book update of a security moves its clock
+ * by kUpdateInterval (BondPreTradeClockListener) and a replay of the same
+ * data is accepted or rejected the same way at any speed.
+ * The checks read the atomic counters of BondPositionService and the
+ * unit PV01 of BondRiskService directly, without locks or snapshots; the
+ * per-security state (pointers resolved in the ctor, indexed by
+ * BondInfo::GetIndex, the clocks and the order rate token buckets) belongs
+ * to the thread running the market data and the algo execution.
+ * Keyed on product identifier.
+ */
+class BondPreTradeRiskService : public ExecutionService<Bond> {
+   public:
+    static constexpr double kUpdateInterval = 0.01;  // seconds of event time between two order book updates of a security
+
+   private:
+    // order rate token bucket
+    struct Bucket {
+        double tokens;
+        double refill;  // event time of the last refill, in seconds
+
+        // take a token if there is one after the refill at rate up to burst
+        bool Take(double rate, double burst, double now) {
+            double elapsed = now - refill;
+            refill = now;
+            tokens = std::min(burst, tokens + elapsed * rate);
+            if (tokens < 1.0) return false;
+            tokens -= 1.0;
+            return true;
+        }
+    };
+
+    // the security in one book
+    struct Book {
+        PreTradeLimits limits;
+        Bucket rate;
+    };
+
+    struct Security {
+        const AtomicPosition<Bond> *position;  // nullptr if the security isn't checked here
+        const std::atomic<double> *pv01;
+        PreTradeLimits limits;
+        long updates;  // order book updates, the event time of the security
+        Bucket rate;
+        std::vector<Book> books;  // in the order of the book ids of the rotation
+    };
+
+    BondPositionService *positions;
+    BondRiskService *risk;
+    std::vector<Security> securities;
+    // the rotation of the books the orders are booked in
+    BookRotation ownRotation;
+    BookRotation *rotation;
+    std::atomic<long> rejects[CHECK_BOOK_ORDER_RATE + 1];
+
+    // whether the position after the order breaches a limit, allowing any reduction
+    static bool Breaches(double after, double before, double limit) {
+        return std::fabs(after) > limit && std::fabs(after) > std::fabs(before);
+    }
+
+    Security *Find(const std::string &cusip) {
+        int i = BondInfo::GetIndex(cusip);
+        return (i >= 0 && securities[i].position != nullptr) ? &securities[i] : nullptr;
+    }
+
+   public:
+    // ctor, the same limits for every security of BondInfo and every book
+    BondPreTradeRiskService(BondPositionService *_positions, BondRiskService *_risk, const PreTradeLimits &limits = PreTradeLimits(), const std::vector<std::string> &cusips = BondInfo::GetCUSIP())
+        : positions(_positions), risk(_risk), rotation(&ownRotation) {
+        for (auto &count : rejects) count.store(0);
+        securities.resize(BondInfo::GetCUSIP().size(), Security{nullptr, nullptr, limits, 0, Bucket{0.0, 0.0}, {}});
+        for (auto &cusip : cusips) {
+            int i = BondInfo::GetIndex(cusip);
+            if (i < 0) continue;
+            Security &security = securities[i];
+            security.position = &positions->GetAtomicPosition(cusip);
+            security.pv01 = &risk->GetUnitPV01Source(cusip);
+            security.rate.tokens = limits.maxOrderBurst;
+            security.books.assign(rotation->GetBookIds().size(), Book{limits, Bucket{limits.maxBookOrderBurst, 0.0}});
+        }
+    }
+
+    // choose the books from the rotation of the trade booking (BondTradeBookingListener::GetRotation)
+    void SetRotation(BookRotation *_rotation) { rotation = _rotation; }
+
+    // an order book update moves the event time of its security
+    void OnMarketData(const OrderBook<Bond> &orderbook) {
+        int i = BondInfo::GetIndex(orderbook.GetProduct());
+        if (i >= 0) ++securities[i].updates;
+    }
+
+    // event time of a security in seconds
+    double GetTime(const Bond &product) const {
+        int i = BondInfo::GetIndex(product);
+        return (i >= 0) ? securities[i].updates * kUpdateInterval : 0.0;
+    }
+
+    // set the limits of one security (in every book)
+    void SetLimits(const std::string &cusip, const PreTradeLimits &limits) {
+        Security *security = Find(cusip);
+        if (security == nullptr) return;
+        security->limits = limits;
+        security->rate.tokens = limits.maxOrderBurst;
+        for (auto &book : security->books) book = Book{limits, Bucket{limits.maxBookOrderBurst, book.rate.refill}};
+    }
+
+    // set the book limits (maxBookPosition, maxBookOrderRate, maxBookOrderBurst) of one security in one book
+    void SetLimits(const std::string &cusip, const std::string &book, const PreTradeLimits &limits) {
+        Security *security = Find(cusip);
+        size_t slot = rotation->Slot(BookRegistry::Find(book));
+        if (security == nullptr || slot == security->books.size()) return;
+        Book &target = security->books[slot];
+        target.limits = limits;
+        target.rate.tokens = limits.maxBookOrderBurst;
+    }
+
+    // run the checks of an order in the book it is booked in (the next one of the rotation if it has none):
+    // the limits of the security then those of the book, from the cheapest to the dearest
+    PreTradeCheck Check(const ExecutionOrder<Bond> &order) {
+        int i = BondInfo::GetIndex(order.GetProduct());
+        if (i < 0 || securities[i].position == nullptr) return CHECK_PASSED;
+        Security &security = securities[i];
+        const PreTradeLimits &limits = security.limits;
+        size_t slot = rotation->Slot(order.GetBookId());
+        if (slot == security.books.size()) slot = rotation->Peek();
+        Book &book = security.books[slot];
+        long quantity = (order.GetPricingSide() == BID) ? order.GetVisibleQuantity() : -order.GetVisibleQuantity();
+
+        long before = security.position->GetAggregatePosition();
+        long after = before + quantity;
+        if (Breaches(after, before, limits.maxPosition)) return CHECK_POSITION;
+        long position = security.position->GetPosition(rotation->GetBookIds()[slot]);
+        if (Breaches(position + quantity, position, book.limits.maxBookPosition)) return CHECK_BOOK_POSITION;
+        double price = order.GetPrice() / 100.0;
+        if (Breaches(after * price, before * price, limits.maxNotional)) return CHECK_NOTIONAL;
+        double pv01 = security.pv01->load(std::memory_order_relaxed);
+        if (Breaches(after * pv01, before * pv01, limits.maxPV01)) return CHECK_PV01;
+
+        // token buckets, last so that a rejected order doesn't use up a token
+        double now = security.updates * kUpdateInterval;
+        if (!security.rate.Take(limits.maxOrderRate, limits.maxOrderBurst, now)) return CHECK_ORDER_RATE;
+        if (!book.rate.Take(book.limits.maxBookOrderRate, book.limits.maxBookOrderBurst, now)) {
+            // give the security's token back, the order isn't sent
+            security.rate.tokens += 1.0;
+            return CHECK_BOOK_ORDER_RATE;
+        }
+        return CHECK_PASSED;
+    }
+
+    // pass the order downstream, booked in the book it was checked against, if it is within the limits
+    void Submit(ExecutionOrder<Bond> &order) {
+        bool rotate = rotation->Slot(order.GetBookId()) == rotation->GetBookIds().size();
+        PreTradeCheck check = Check(order);
+        if (check != CHECK_PASSED) {
+            rejects[check].fetch_add(1, std::memory_order_relaxed);
+            DEBUG_TEST("BondPreTradeRiskService rejected order %s\n", order.GetOrderId().c_str());
+            return;
+        }
+        if (rotate) order.SetBookId(rotation->GetBookIds()[rotation->Next()]);
+        this->Notify(order);
+    }
+
+    void ExecuteOrder(const ExecutionOrder<Bond> &_order, Market market) {
+        ExecutionOrder<Bond> order = _order;
+        Submit(order);
+    }
+
+    // number of orders rejected by a check
+    long GetRejects(PreTradeCheck check) const { return rejects[check].load(); }
+
+    // number of orders rejected by all the checks
+    long GetRejects() const {
+        long total = 0;
+        for (auto &count : rejects) total += count.load();
+        return total;
+    }
+};
+
+/**
+ * Pre-trade risk listener
+ * to listen the BondAlgoExecutionService
+ * then pass the execution order to BondPreTradeRiskService
+ */
+class BondPreTradeRiskListener : public ServiceListener<ExecutionOrder<Bond> > {
+   private:
+    BondPreTradeRiskService *service;
+
+   public:
+    explicit BondPreTradeRiskListener(BondPreTradeRiskService *_service) : service(_service) {}
+    virtual void ProcessAdd(ExecutionOrder<Bond> &_order) {
+        DEBUG_TEST("BondAlgoExecutionService -> BondPreTradeRiskService\n");
+        service->Submit(_order);
+    }
+    virtual void ProcessRemove(ExecutionOrder<Bond> &_order) {}
+    virtual void ProcessUpdate(ExecutionOrder<Bond> &_order) {}
+};
+
+/**
+ * Listener moving the event time of BondPreTradeRiskService on every
+ * update of BondMarketDataService, registered before the algo execution
+ * so the orders of an update are checked at its time.
+ */
+class BondPreTradeClockListener : public ServiceListener<OrderBook<Bond> > {
+   private:
+    BondPreTradeRiskService *service;
+
+   public:
+    explicit BondPreTradeClockListener(BondPreTradeRiskService *_service) : service(_service) {}
+    virtual void ProcessAdd(OrderBook<Bond> &_orderbook) { service->OnMarketData(_orderbook); }
+    virtual void ProcessRemove(OrderBook<Bond> &_orderbook) {}
+    virtual void ProcessUpdate(OrderBook<Bond> &_orderbook) {}
+};
+
+#endif
@@ -10,12 +10,15 @@
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <string>
 #include <utility>
 
+#include "bondinfo.hpp"
+#include "coroconnector.hpp"
+#include "objectpool.hpp"
 #include "products.hpp"
 #include "soa.hpp"
-#include "bondinfo.hpp"
 
 /**
  * A price object consisting of mid and bid/offer spread.
@@ -33,6 +36,13 @@ class Price {
         bidOfferSpread = _bidOfferSpread;
     }
 
+    // Overwrite the price in place when recycled by an ObjectPool
+    void Reset(const T& _product, double _mid, double _bidOfferSpread) {
+        product = _product;
+        mid = _mid;
+        bidOfferSpread = _bidOfferSpread;
+    }
+
     // Get the product
     const T& GetProduct() const { return product; }
 
@@ -43,7 +53,7 @@ class Price {
     double GetBidOfferSpread() const { return bidOfferSpread; }
 
    private:
-    const T& product;
+    T product;
     double mid;
     double bidOfferSpread;
 };
@@ -65,10 +75,13 @@ class BondPricingService : public Service<string, Price<Bond> > {
     // called by the connector
     // update the map and them notifty the listeners (BondAlgoStreamingService)
     virtual void OnMessage(Price<Bond>& _price) {
-        // since we didn't implement the copy ctor/copy assignment operator
-        // we use insert method instead of [] operator to update price
-        prices.erase(_price.GetProduct().GetProductId());
-        prices.insert(make_pair(_price.GetProduct().GetProductId(), _price));
+        // overwrite the stored price in place instead of erase/insert
+        // so no map node is allocated once every product has been seen
+        auto itr = prices.find(_price.GetProduct().GetProductId());
+        if (itr != prices.end())
+            itr->second = _price;
+        else
+            prices.insert(make_pair(_price.GetProduct().GetProductId(), _price));
         Service<string, Price<Bond> >::Notify(_price);
     }
 };
@@ -78,10 +91,15 @@ class BondPricingService : public Service<string, Price<Bond> > {
  * Keyed on product identifier (CUSIPS string).
  * Type T is the product type (Price<Bond>).
  */
-class BondPricingConnector : public Connector<Price<Bond> > {
+class BondPricingConnector : public CoroConnector<Price<Bond> > {
    private:
     string file_name;
     BondPricingService* pricing_service;
+    // buffers reused across records
+    string line;
+    std::vector<std::string> tokens;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<AsyncLineReader> reader;
 
    public:
     explicit BondPricingConnector(string file_name_, BondPricingService* pricing_service_) : file_name(file_name_), pricing_service(pricing_service_) {}
@@ -99,36 +117,61 @@ class BondPricingConnector : public Connector<Price<Bond> > {
         // send the file request message to the server
         send_socket(socket, file_name);
 
-        string line = read_socket(socket);
+        read_socket(socket, line);
         
         trim(line);
         std::cout << "success" << std::endl;
         while (line != "EOF") {
-            std::vector<std::string> tokens = split(line, ',');
-            
-            // Transform data.
-            int digitPartLength = tokens[1].size();
-            if (tokens[1][digitPartLength - 1] == '+')
-                tokens[1][digitPartLength - 1] = '4';
-
-            double price = BondInfo::CalculatePrice(tokens[1]);
-            double spread = (double)(tokens[2][0] - '0') / 128.0;
-            double coupon = BondInfo::CUSIPToCoupon(tokens[0]);
-
-            boost::gregorian::date* maturityPtr = BondInfo::CUSIPToDate(tokens[0]);
-
-            Bond bond(tokens[0], CUSIP, "T", coupon, *maturityPtr);
-            Price<Bond> bondPrice(bond, price, spread);
-            DEBUG_TEST("price = %.3lf -> BondPricingService\n", price);
-
-            // For each price, call Service.OnMessage() once to pass this piece of data.
-            pricing_service->OnMessage(bondPrice);
+            ProcessLine(line);
             // request for another line to the server
             send_socket(socket, file_name);
-            line = read_socket(socket);
+            read_socket(socket, line);
             trim(line);
         }
     }
+
+    // subscribe on the reactor's event loop instead of blocking on the socket
+    void Subscribe(Reactor& reactor, int port) {
+        reader.reset(new AsyncLineReader(reactor, file_name, [this](std::string& _line) { ProcessLine(_line); }));
+        reader->Start(port);
+    }
+
+    // subscribe as a coroutine on the reactor's event loop, run it with CoroConnector::Spawn
+    awaitable<void> CoSubscribe(int port) {
+        LineSocket socket(co_await boost::asio::this_coro::executor);
+        co_await socket.Connect(port);
+        std::string request = file_name + "\n";
+        co_await socket.WriteLine(request);
+        co_await socket.ReadLine(line);
+        std::cout << "connecting to the " << file_name << "...success" << std::endl;
+        while (line != "EOF") {
+            ProcessLine(line);
+            // request for another line to the server
+            co_await socket.WriteLine(request);
+            co_await socket.ReadLine(line);
+        }
+    }
+
+    // parse one line of prices.txt and pass it to the service
+    void ProcessLine(const std::string& line) {
+        AllocationCounter::RecordEvent();
+        split(line, ',', tokens);
+        
+        // Transform data.
+        int digitPartLength = tokens[1].size();
+        if (tokens[1][digitPartLength - 1] == '+')
+            tokens[1][digitPartLength - 1] = '4';
+
+        double price = BondInfo::CalculatePrice(tokens[1]);
+        double spread = (double)(tokens[2][0] - '0') / 128.0;
+
+        // recycled from the per-thread pool
+        Pooled<Price<Bond> > bondPrice(*BondInfo::GetBond(tokens[0]), price, spread);
+        DEBUG_TEST("price = %.3lf -> BondPricingService\n", price);
+
+        // For each price, call Service.OnMessage() once to pass this piece of data.
+        pricing_service->OnMessage(*bondPrice);
+    }
 };
 
 #endif
@@ -61,6 +61,12 @@ class Bond : public Product {
     // Get the bond identifier type
     BondIdType GetBondIdType() const;
 
+    // Get the position of the bond in BondInfo's securities, -1 if it's not one of them
+    int GetIndex() const;
+
+    // Set the position of the bond in BondInfo's securities
+    void SetIndex(int _index);
+
     // Print the bond
     friend ostream& operator<<(ostream& output, const Bond& bond);
 
@@ -70,6 +76,7 @@ class Bond : public Product {
     string ticker;
     float coupon;
     date maturityDate;
+    int index;
 };
 
 /**
@@ -182,9 +189,11 @@ Bond::Bond(string _productId, BondIdType _bondIdType, string _ticker, float _cou
     ticker = _ticker;
     coupon = _coupon;
     maturityDate = _maturityDate;
+    index = -1;
 }
 
 Bond::Bond() : Product(0, BOND) {
+    index = -1;
 }
 
 const string& Bond::GetTicker() const {
@@ -203,6 +212,14 @@ BondIdType Bond::GetBondIdType() const {
     return bondIdType;
 }
 
+int Bond::GetIndex() const {
+    return index;
+}
+
+void Bond::SetIndex(int _index) {
+    index = _index;
+}
+
 ostream& operator<<(ostream& output, const Bond& bond) {
     output << bond.ticker << " " << bond.coupon << " " << bond.GetMaturityDate();
     return output;
@@ -0,0 +1,318 @@
+/**
+ * reactor.hpp
+ * Single-threaded event loop running every connector as asynchronous
+ * operations on one boost::asio::io_context.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+/**
+ * Interface of the publisher sessions the reactor closes at the end
+ * (AsyncLineWriter here, CoroLineWriter in coroconnector.hpp).
+ */
+class LineWriter {
+   public:
+    virtual ~LineWriter() {}
+
+    // connect to the data_writer on localhost and send the file name
+    virtual void Start(int port) = 0;
+
+    // queue a line (terminated by \n) to be written
+    virtual void Write(const std::string& line) = 0;
+
+    // send EOF to the data_writer once the queue is written out
+    virtual void Close() = 0;
+};
+
+/**
+ * FIFO of the lines waiting to be written, a ring of strings reused
+ * so that queueing a line only copies it into an existing buffer.
+ */
+class LineRing {
+   private:
+    std::vector<std::string> ring;
+    size_t head;
+    size_t count;
+
+    // grow the ring keeping the queued lines in order
+    void Grow() {
+        std::vector<std::string> bigger(ring.empty() ? 16 : 2 * ring.size());
+        for (size_t i = 0; i < count; ++i) bigger[i].swap(ring[(head + i) % ring.size()]);
+        ring.swap(bigger);
+        head = 0;
+    }
+
+   public:
+    LineRing() : head(0), count(0) {}
+
+    bool Empty() const { return count == 0; }
+
+    void Push(const std::string& line) {
+        if (count == ring.size()) Grow();
+        ring[(head + count) % ring.size()] = line;
+        ++count;
+    }
+
+    std::string& Front() { return ring[head]; }
+
+    void Pop() {
+        head = (head + 1) % ring.size();
+        --count;
+    }
+};
+
+/**
+ * The reactor owns the io_context, keeps track of the running subscribers
+ * and, once the last one has reached EOF, fires the timers a last time
+ * and closes the publishers so that Run() returns when everything has
+ * been written out. The end runs in phases: first the timers producing
+ * events (Every), then the ones writing them out (EveryFlush), then the
+ * publishers close.
+ */
+class Reactor {
+   private:
+    // a repeating timer
+    struct Timer {
+        boost::asio::steady_timer timer;
+        std::chrono::milliseconds interval;
+        std::function<void()> callback;
+        bool flush;
+        Timer(boost::asio::io_context& context, long ms, std::function<void()> _callback, bool _flush)
+            : timer(context), interval(ms), callback(_callback), flush(_flush) {}
+    };
+
+    boost::asio::io_context context;
+    int active_subscribers;
+    bool finished;
+    bool coroutines;
+    std::vector<LineWriter*> writers;
+    std::vector<std::unique_ptr<Timer> > timers;
+
+    void Arm(Timer* timer) {
+        timer->timer.expires_after(timer->interval);
+        timer->timer.async_wait([this, timer](const boost::system::error_code& ec) {
+            if (ec || finished) return;
+            timer->callback();
+            Arm(timer);
+        });
+    }
+
+    inline void Finish();
+
+   public:
+    Reactor() : active_subscribers(0), finished(false), coroutines(false) {}
+
+    // the io_context shared by all the connectors
+    boost::asio::io_context& GetContext() { return context; }
+
+    // run the event loop on the calling thread until all the data is processed
+    void Run() { context.run(); }
+
+    // call back every ms milliseconds while the subscribers are running,
+    // and one last time when they have all finished
+    void Every(long ms, std::function<void()> callback) {
+        timers.emplace_back(new Timer(context, ms, callback, false));
+        Arm(timers.back().get());
+    }
+
+    // same for a timer writing out to the publishers, whose last call comes
+    // after the last call of every timer of Every, in whatever order they were registered
+    void EveryFlush(long ms, std::function<void()> callback) {
+        timers.emplace_back(new Timer(context, ms, callback, true));
+        Arm(timers.back().get());
+    }
+
+    // whether all the subscribers have finished (true during the last call of the timers)
+    bool IsFinished() const { return finished; }
+
+    // register a publisher to close at the end
+    void AddWriter(LineWriter* writer) { writers.push_back(writer); }
+
+    // whether the connector sessions are written as coroutines (see coroconnector.hpp)
+    void SetCoroutines(bool _coroutines) { coroutines = _coroutines; }
+    bool UsesCoroutines() const { return coroutines; }
+
+    // book-keeping of the subscribers
+    void SubscriberStarted() { ++active_subscribers; }
+    void SubscriberFinished() {
+        if (--active_subscribers == 0) Finish();
+    }
+};
+
+/**
+ * Subscriber session with a data_reader process: request a line,
+ * wait for it, pass it to the handler and request the next one, until EOF.
+ */
+class AsyncLineReader {
+   private:
+    Reactor& reactor;
+    tcp::socket socket;
+    std::string file_name;
+    std::string request;
+    std::string line;
+    boost::asio::streambuf buffer;
+    std::function<void(std::string&)> handler;
+    bool connected;
+
+    void Fail(const boost::system::error_code& ec) {
+        std::cout << "AsyncLineReader (" << file_name << "): " << ec.message() << std::endl;
+        reactor.SubscriberFinished();
+    }
+
+    void RequestLine() {
+        boost::asio::async_write(socket, boost::asio::buffer(request),
+                                 [this](const boost::system::error_code& ec, size_t) {
+                                     if (ec) return Fail(ec);
+                                     ReadLine();
+                                 });
+    }
+
+    void ReadLine() {
+        boost::asio::async_read_until(socket, buffer, "\n",
+                                      [this](const boost::system::error_code& ec, size_t n) {
+                                          if (ec) return Fail(ec);
+                                          line.resize(n);
+                                          boost::asio::buffer_copy(boost::asio::buffer(&line[0], n), buffer.data());
+                                          buffer.consume(n);
+                                          line.erase(std::remove(line.begin(), line.end(), '\n'), line.end());
+                                          if (!connected) {
+                                              connected = true;
+                                              std::cout << "connecting to the " << file_name << "...success" << std::endl;
+                                          }
+                                          if (line == "EOF") {
+                                              reactor.SubscriberFinished();
+                                              return;
+                                          }
+                                          handler(line);
+                                          RequestLine();
+                                      });
+    }
+
+   public:
+    AsyncLineReader(Reactor& _reactor, const std::string& _file_name, std::function<void(std::string&)> _handler)
+        : reactor(_reactor), socket(_reactor.GetContext()), file_name(_file_name), request(_file_name + "\n"), handler(_handler), connected(false) {}
+
+    // connect to the data_reader on localhost and start requesting lines
+    void Start(int port) {
+        reactor.SubscriberStarted();
+        socket.async_connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port),
+                             [this](const boost::system::error_code& ec) {
+                                 if (ec) return Fail(ec);
+                                 RequestLine();
+                             });
+    }
+};
+
+/**
+ * Publisher session with a data_writer process.
+ * Lines are queued in a ring of reused strings and written one at a time,
+ * each one acknowledged by the data_writer before the next is sent.
+ */
+class AsyncLineWriter : public LineWriter {
+   private:
+    tcp::socket socket;
+    std::string file_name;
+    std::string first_line;
+    std::string last_line;
+    boost::asio::streambuf buffer;
+    LineRing ring;
+    bool connected;
+    bool writing;
+    bool closing;
+    long dropped;
+
+    void Fail(const boost::system::error_code& ec) {
+        std::cout << "AsyncLineWriter (" << file_name << "): " << ec.message() << std::endl;
+        writing = true;  // stop writing
+    }
+
+    void Send(const std::string& data, bool last) {
+        writing = true;
+        boost::asio::async_write(socket, boost::asio::buffer(data),
+                                 [this, last](const boost::system::error_code& ec, size_t) {
+                                     if (ec) return Fail(ec);
+                                     if (last) return;
+                                     WaitAck();
+                                 });
+    }
+
+    void WaitAck() {
+        boost::asio::async_read_until(socket, buffer, "\n",
+                                      [this](const boost::system::error_code& ec, size_t n) {
+                                          if (ec) return Fail(ec);
+                                          buffer.consume(n);
+                                          if (!connected) {
+                                              connected = true;
+                                              std::cout << "connecting to the " << file_name << "...success" << std::endl;
+                                          } else {
+                                              ring.Pop();
+                                          }
+                                          writing = false;
+                                          WriteNext();
+                                      });
+    }
+
+    void WriteNext() {
+        if (writing || !connected) return;
+        if (!ring.Empty())
+            Send(ring.Front(), false);
+        else if (closing)
+            Send(last_line, true);
+    }
+
+   public:
+    AsyncLineWriter(Reactor& reactor, const std::string& _file_name)
+        : socket(reactor.GetContext()), file_name(_file_name), first_line(_file_name + "\n"), last_line("EOF\n"), connected(false), writing(false), closing(false), dropped(0) {
+        reactor.AddWriter(this);
+    }
+
+    void Start(int port) {
+        writing = true;
+        socket.async_connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port),
+                             [this](const boost::system::error_code& ec) {
+                                 if (ec) return Fail(ec);
+                                 Send(first_line, false);
+                             });
+    }
+
+    void Write(const std::string& line) {
+        // nothing is written once EOF is queued
+        if (closing) {
+            if (dropped++ == 0) std::cout << "AsyncLineWriter (" << file_name << "): lines written after the end are dropped" << std::endl;
+            return;
+        }
+        ring.Push(line);
+        WriteNext();
+    }
+
+    void Close() {
+        closing = true;
+        WriteNext();
+    }
+};
+
+// all the subscribers are done: drain the producing timers, then flush, then close the publishers
+void Reactor::Finish() {
+    finished = true;
+    for (auto& timer : timers) timer->timer.cancel();
+    for (auto& timer : timers)
+        if (!timer->flush) timer->callback();
+    for (auto& timer : timers)
+        if (timer->flush) timer->callback();
+    for (auto writer : writers) writer->Close();
+}
+
+#endif
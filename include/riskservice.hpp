@@ -7,7 +7,17 @@
 #ifndef RISK_SERVICE_HPP
 #define RISK_SERVICE_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bondanalytics.hpp"
 #include "bondinfo.hpp"
+#include "coroconnector.hpp"
+#include "objectpool.hpp"
 #include "positionservice.hpp"
 #include "soa.hpp"
 
@@ -24,6 +34,13 @@ class PV01 {
         quantity = _quantity;
     }
 
+    // Overwrite the PV01 value in place when recycled by an ObjectPool
+    void Reset(const T& _product, double _pv01, long _quantity) {
+        product = _product;
+        pv01 = _pv01;
+        quantity = _quantity;
+    }
+
     // Get the product on this PV01 value
     const T& GetProduct() const { return product; }
 
@@ -82,55 +99,163 @@ class RiskService : public Service<string, PV01<T> > {
  * Bond Risk Service to vend out risk for a particular security and across a risk bucketed sector.
  * Keyed on product identifier.
  * Type T is the product type (Bond).
+ * The exposure of every security and the totals of the bucketed sectors (FrontEnd, Belly, LongEnd)
+ * up to date: a position change applies its delta to the security
+ * and to the sector it belongs to, and so does a move of the PV01 of
+ * the security on a price tick (Reprice), so reading the risk never rescans.
+ * The exposures are atomics, the positions of different securities
+ * may come in from different threads.
  */
 class BondRiskService : public RiskService<Bond> {
    private:
-    std::map<std::string, PV01<Bond> > risks;
+    // risk of one security
+    struct Exposure {
+        const Bond* bond;
+        int bucket;                // index in buckets, -1 if in no sector
+        std::atomic<double> pv01;  // PV01 of one unit at the last position change
+        std::atomic<long> quantity;
+        std::atomic<double> risk;  // quantity * pv01
+        Exposure(const Bond* _bond, double _pv01, int _bucket) : bond(_bond), bucket(_bucket), pv01(_pv01), quantity(0), risk(0.0) {}
+    };
+
+    // running totals of a sector
+    struct Bucket {
+        std::string name;
+        std::atomic<long> quantity;
+        std::atomic<double> risk;  // sum of quantity * pv01
+        explicit Bucket(const std::string& _name) : name(_name), quantity(0), risk(0.0) {}
+    };
+
+    // filled in the ctor only, so the threads can look up concurrently
+    std::map<std::string, std::unique_ptr<Exposure> > risks;
+    std::vector<std::unique_ptr<Bucket> > buckets;
+    // PV01 from the market if given, the BondInfo table otherwise
+    const BondAnalytics* analytics;
+
+    Exposure& Find(const std::string& cusip) {
+        auto itr = risks.find(cusip);
+        if (itr == risks.end()) {
+            std::cout << "Can't find bond " << cusip << std::endl;
+            exit(0);
+        }
+        return *itr->second;
+    }
 
    public:
-    // add a position will increase the risk
+    // the sectors of the treasury curve
+    static std::vector<BucketedSector<Bond> > GetSectors() {
+        static const char* names[] = {"FrontEnd", "Belly", "LongEnd"};
+        static const std::vector<std::vector<std::string> > cusips = {
+            {"91282CAX9", "91282CBA80"},              // 2Y, 3Y
+            {"91282CAZ4", "91282CAY7", "91282CAV3"},  // 5Y, 7Y, 10Y
+            {"912810ST6", "912810SS8"}};              // 20Y, 30Y
+        std::vector<BucketedSector<Bond> > sectors;
+        for (size_t i = 0; i < cusips.size(); ++i) {
+            std::vector<Bond> products;
+            for (auto& cusip : cusips[i]) products.push_back(*BondInfo::GetBond(cusip));
+            sectors.push_back(BucketedSector<Bond>(products, names[i]));
+        }
+        return sectors;
+    }
+
+    // ctor, flat exposure in every security
+    explicit BondRiskService(const BondAnalytics* _analytics = nullptr) : analytics(_analytics) {
+        for (auto& sector : GetSectors()) buckets.emplace_back(new Bucket(sector.GetName()));
+        auto sectors = GetSectors();
+        for (auto& cusip : BondInfo::GetCUSIP()) {
+            int bucket = -1;
+            for (size_t i = 0; i < sectors.size(); ++i)
+                for (auto& product : sectors[i].GetProducts())
+                    if (product.GetProductId() == cusip) bucket = int(i);
+            risks.insert(std::make_pair(cusip, std::unique_ptr<Exposure>(new Exposure(BondInfo::GetBond(cusip), analytics ? analytics->GetPV01(cusip) : BondInfo::GetPV01(cusip), bucket))));
+        }
+    }
+
+    // a position change moves the risk of the security and of its sector by the delta,
+    // repriced with the current PV01 of the security
     void AddPosition(Position<Bond>& position) {
+        const std::string& cusip = position.GetProduct().GetProductId();
+        Exposure& exposure = Find(cusip);
+        double pv01 = analytics ? analytics->GetPV01(cusip) : exposure.pv01.load();
         long quantity = position.GetAggregatePosition();
-        std::string cusip = position.GetProduct().GetProductId();
-        // get pv01 value from BondInfo class
-        double pv01_value = BondInfo::GetPV01(cusip);
-        PV01<Bond> pv01_object(position.GetProduct(), pv01_value, quantity);
-        this->Notify(pv01_object);
+        exposure.pv01.store(pv01);
+        long delta = quantity - exposure.quantity.exchange(quantity);
+        double risk = quantity * pv01;
+        double risk_delta = risk - exposure.risk.exchange(risk);
+        if (exposure.bucket >= 0) {
+            Bucket& bucket = *buckets[exposure.bucket];
+            bucket.quantity.fetch_add(delta);
+            bucket.risk.fetch_add(risk_delta);
+        }
+        Pooled<PV01<Bond> > pv01_object(position.GetProduct(), pv01, quantity);
+        this->Notify(*pv01_object);
+    }
+
+    // a price tick moved the PV01 of a security: the risk of the security and of its sector
+    // move by quantity * (new PV01 - old PV01)
+    void Reprice(const std::string& cusip) {
+        if (analytics == nullptr) return;
+        auto itr = risks.find(cusip);
+        if (itr == risks.end()) return;
+        Reprice(cusip, *itr->second);
+    }
+
+    // the whole universe was repriced (BondAnalytics::Recompute): reprice every security
+    void Reprice() {
+        if (analytics == nullptr) return;
+        for (auto& risk : risks) Reprice(risk.first, *risk.second);
     }
-    // return the bucketed sector's pv01
+
+   private:
+    void Reprice(const std::string& cusip, Exposure& exposure) {
+        double pv01 = analytics->GetPV01(cusip);
+        double old = exposure.pv01.exchange(pv01);
+        if (pv01 == old) return;
+        double risk_delta = exposure.quantity.load() * (pv01 - old);
+        exposure.risk.fetch_add(risk_delta);
+        if (exposure.bucket >= 0) buckets[exposure.bucket]->risk.fetch_add(risk_delta);
+    }
+
+   public:
+    // return the bucketed sector's pv01, the weighted average pv01 of its products
+    // O(1) for the sectors of GetSectors(), without allocating;
+    // the result belongs to the calling thread and is valid until its next call
     PV01<BucketedSector<Bond> >& GetBucketedRisk(BucketedSector<Bond>& sector) {
-        double pv01_value = 0;
-        double quantity = 0;
-        auto products = sector.GetProducts();
-        // pv01_value is the weighted sum of pv01 of each product
-        for (auto& product : products) {
-            std::string cusip = product.GetProductId();
-            PV01<Bond>& pv01_bond = this->GetData(cusip);
-            quantity += pv01_bond.GetQuantity();
-            pv01_value += pv01_bond.GetQuantity() * pv01_bond.GetPV01();
+        static thread_local PV01<BucketedSector<Bond> > result(sector, 0.0, 0);
+        long quantity = 0;
+        double risk = 0.0;
+        auto itr = std::find_if(buckets.begin(), buckets.end(), [&sector](const std::unique_ptr<Bucket>& bucket) { return bucket->name == sector.GetName(); });
+        if (itr != buckets.end()) {
+            quantity = (*itr)->quantity.load();
+            risk = (*itr)->risk.load();
+        } else {
+            // not one of our sectors, add up its products
+            for (auto& product : sector.GetProducts()) {
+                Exposure& exposure = Find(product.GetProductId());
+                quantity += exposure.quantity.load();
+                risk += exposure.risk.load();
+            }
         }
-        pv01_value /= quantity;
-        auto ret = new PV01<BucketedSector<Bond> >(sector, pv01_value, quantity);
-        return *ret;
+        result.Reset(sector, quantity != 0 ? risk / quantity : 0.0, quantity);
+        return result;
     }
+
+    // PV01 of one unit of a security at its last position change, lock-free
+    double GetUnitPV01(const std::string& cusip) { return Find(cusip).pv01.load(std::memory_order_relaxed); }
+
+    // the atomic behind GetUnitPV01, for the readers resolving it once
+    const std::atomic<double>& GetUnitPV01Source(const std::string& cusip) { return Find(cusip).pv01; }
+
     // get the PV01 of a product (bond)
+    // the result belongs to the calling thread and is valid until its next call
     virtual PV01<Bond>& GetData(string key) {
-        auto itr = risks.find(key);
-        if (itr != risks.end())
-            return itr->second;
-        else {
-            std::cout << "Can't find bond " << key << std::endl;
-            exit(0);
-        }
+        Exposure& exposure = Find(key);
+        static thread_local PV01<Bond> result(*exposure.bond, 0.0, 0);
+        result.Reset(*exposure.bond, exposure.pv01.load(), exposure.quantity.load());
+        return result;
     }
 };
 
-/**
- * Bond Risk Listener to listen the BondPositionService and
- * notify the BondRiskService
- * Keyed on product identifier.
- * Type T is the product type (Bond).
- */
 class BondRiskListener : public ServiceListener<Position<Bond> > {
    private:
     BondRiskService* service;
@@ -145,6 +270,62 @@ class BondRiskListener : public ServiceListener<Position<Bond> > {
     virtual void ProcessUpdate(Position<Bond>& _pos) {}
 };
 
+/**
+ * Bond Risk listener to listen the BondPricingService,
+ * registered after BondAnalyticsListener so the PV01 of the tick is solved
+ * then reprice the risk of the security with it
+ */
+class BondRiskPricingListener : public ServiceListener<Price<Bond> > {
+   private:
+    BondRiskService* service;
+
+   public:
+    explicit BondRiskPricingListener(BondRiskService* _service) : service(_service) {}
+    virtual void ProcessAdd(Price<Bond>& _price) {
+        DEBUG_TEST("BondPricingService -> BondRiskService\n");
+        service->Reprice(_price.GetProduct().GetProductId());
+    }
+    virtual void ProcessRemove(Price<Bond>& _price) {}
+    virtual void ProcessUpdate(Price<Bond>& _price) {}
+};
+
+/**
+ * Bond Risk listener to listen the BondPricingService in batch mode
+ * (instead of BondAnalyticsListener and BondRiskPricingListener):
+ * a tick only records its price in the analytics, and every batch ticks
+ * (and on Refresh) the whole universe is repriced at once, then the risk
+ * of every security with it
+ */
+class BondRiskBatchListener : public ServiceListener<Price<Bond> > {
+   private:
+    BondAnalytics* analytics;
+    BondRiskService* service;
+    size_t batch;
+    std::atomic<size_t> ticks;
+    std::atomic<long> refreshes;
+
+   public:
+    BondRiskBatchListener(BondAnalytics* _analytics, BondRiskService* _service, size_t _batch) : analytics(_analytics), service(_service), batch(_batch), ticks(0), refreshes(0) {}
+
+    // reprice the universe and its risk from the latest prices, from any thread
+    void Refresh() {
+        analytics->Recompute();
+        service->Reprice();
+        ++refreshes;
+    }
+
+    // number of refreshes of the universe
+    long GetRefreshCount() const { return refreshes.load(); }
+
+    virtual void ProcessAdd(Price<Bond>& _price) {
+        DEBUG_TEST("BondPricingService -> BondAnalytics -> BondRiskService\n");
+        analytics->SetPrice(_price.GetProduct().GetProductId(), _price.GetMid());
+        if (batch > 0 && (ticks.fetch_add(1) + 1) % batch == 0) Refresh();
+    }
+    virtual void ProcessRemove(Price<Bond>& _price) {}
+    virtual void ProcessUpdate(Price<Bond>& _price) {}
+};
+
 /**
  * Bond Risk Connector
  * to publish the risk to another process via TCP/IP
@@ -155,10 +336,21 @@ class BondRiskConnector : public Connector<PV01<Bond> > {
     std::string file_name;
     boost::asio::io_service io_service;
     tcp::socket socket;
+    // buffers reused across publications
+    std::string line;
+    std::string reply;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<LineWriter> writer;
 
    public:
     // ctor
-    explicit BondRiskConnector(string file_name_, int port = 1237) : file_name(file_name_), socket(io_service) {
+    explicit BondRiskConnector(string file_name_, int port = 1237, Reactor *reactor = nullptr) : file_name(file_name_), socket(io_service) {
+        if (reactor != nullptr) {
+            // asynchronous session on the reactor's event loop
+            writer.reset(MakeLineWriter(*reactor, file_name));
+            writer->Start(port);
+            return;
+        }
         
         // connection of the socket
         std::cout << "connecting to the " << file_name << "...";
@@ -173,19 +365,27 @@ class BondRiskConnector : public Connector<PV01<Bond> > {
     // and prints them when it receives them.
     virtual void Publish(PV01<Bond> &_risk) {
         std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-        std::string timestamp = std::to_string(ms.count());
-        std::string productId = _risk.GetProduct().GetProductId();
-        std::string pv01 = std::to_string(_risk.GetPV01() * _risk.GetQuantity());
-        std::string line = timestamp + "," + productId + "," + pv01 + "\n";
-        this->send_socket(socket, line + "\n");
-        auto success = this->read_socket(socket);
+        // timestamp,productId,pv01
+        line.clear();
+        line += std::to_string(ms.count());
+        line += ',';
+        line += _risk.GetProduct().GetProductId();
+        line += ',';
+        line += std::to_string(_risk.GetPV01() * _risk.GetQuantity());
+        line += '\n';
+        if (writer) {
+            writer->Write(line);
+        } else {
+            this->send_socket(socket, line);
+            this->read_socket(socket, reply);
+        }
         DEBUG_TEST("PV01<Bond> -> BondRiskConnector\n");
         
     }
     // dtor, we need to kill the data_writer process by sending EOF
     ~BondRiskConnector() {
         std::cout << "Finished, killing the data_writer (" << file_name << ") process" << std::endl;
-        this->send_socket(socket, "EOF\n");
+        if (!writer) this->send_socket(socket, "EOF\n");
     }
 };
 
@@ -0,0 +1,234 @@
+/**
+ * scenarioservice.hpp
+ * Defines the data types and Service revaluing the positions under
+ * curve scenarios (parallel shifts, twists, key-rate shocks).
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef SCENARIO_SERVICE_HPP
+#define SCENARIO_SERVICE_HPP
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bondanalytics.hpp"
+#include "bondinfo.hpp"
+#include "positionservice.hpp"
+#include "products.hpp"
+#include "riskservice.hpp"
+#include "soa.hpp"
+#include "yieldcurveservice.hpp"
+
+/**
+ * A curve scenario: a par yield shock (in basis points) for every pillar
+ * of the treasury curve, i.e. for every security of the universe in the
+ * order of the BondAnalytics arrays.
+ */
+class Scenario {
+   public:
+    // ctor for a scenario
+    Scenario(const std::string &_name, const std::vector<double> &_shocks) : name(_name), shocks(_shocks) {}
+
+    // Get the name of the scenario
+    const std::string &GetName() const { return name; }
+
+    // Get the shocks in basis points
+    const std::vector<double> &GetShocks() const { return shocks; }
+
+   private:
+    std::string name;
+    std::vector<double> shocks;
+};
+
+/**
+ * The risk grid of one scenario: the PnL of every security and the total.
+ */
+class ScenarioRisk {
+   public:
+    // ctor for the result of a scenario
+    ScenarioRisk(const std::string &_name, const std::vector<std::string> &_cusips) : name(_name), cusips(_cusips), pnl(_cusips.size(), 0.0), total(0.0) {}
+
+    // Get the name of the scenario
+    const std::string &GetName() const { return name; }
+
+    // Get the securities of the grid
+    const std::vector<std::string> &GetCUSIPs() const { return cusips; }
+
+    // Get the PnL of every security
+    const std::vector<double> &GetPnL() const { return pnl; }
+
+    // Get the PnL of the whole book
+    double GetTotal() const { return total; }
+
+    // set by ScenarioService
+    std::vector<double> &MutablePnL() { return pnl; }
+    void SetTotal(double _total) { total = _total; }
+
+   private:
+    std::string name;
+    std::vector<std::string> cusips;
+    std::vector<double> pnl;
+    double total;
+};
+
+/**
+ * Scenario Service next to BondRiskService.
+ * Run() takes the aggregate positions and the curve bootstrapped by
+ * YieldCurveService, shocks the par yields of its pillars, rebuilds the
+ * discount factors and reprices the cash flows of every position on the
+ * shocked curve, against their value on the unshocked one; it then
+ * notifies its listeners with the risk grid of each scenario. The
+ * scenarios are split across threads, each one with a copy of the curve.
+ * Keyed on scenario name.
+ */
+class ScenarioService : public Service<std::string, ScenarioRisk> {
+   private:
+    const BondAnalytics *analytics;
+    YieldCurveService *curves;
+    BondPositionService *positions;
+    int num_threads;
+    std::vector<std::string> cusips;
+    std::vector<Scenario> scenarios;
+    std::vector<ScenarioRisk> results;
+    // flattened scenarios x pillars, in basis points
+    std::vector<double> shocks;
+
+    // the cash flows of the securities (time in years, amount per 100 face),
+    // those of security i are [first[i], first[i + 1])
+    std::vector<double> flowTime, flowAmount;
+    std::vector<size_t> first;
+    // filled by Run(): the curve, the positions and their value on the curve
+    std::unique_ptr<YieldCurve> curve;
+    std::vector<double> quantity, base;
+
+    // dirty price per 100 face of security i on a curve
+    double Value(const YieldCurve &on, size_t i) const {
+        double price = 0.0;
+        for (size_t k = first[i]; k < first[i + 1]; ++k) price += flowAmount[k] * on.DiscountFactor(flowTime[k]);
+        return price;
+    }
+
+    // the PnL of scenarios [begin, end)
+    void Revalue(size_t begin, size_t end) {
+        size_t size = cusips.size();
+        YieldCurve shocked(*curve);
+        std::vector<double> par(size);
+        for (size_t s = begin; s < end; ++s) {
+            const double *shock = &shocks[s * size];
+            for (size_t i = 0; i < size; ++i) par[i] = curve->GetParYield(i) + 1e-4 * shock[i];
+            shocked.SetParYields(par);
+            double *pnl = results[s].MutablePnL().data();
+            double total = 0.0;
+            for (size_t i = 0; i < size; ++i) {
+                pnl[i] = quantity[i] * (Value(shocked, i) - base[i]) / 100.0;
+                total += pnl[i];
+            }
+            results[s].SetTotal(total);
+        }
+    }
+
+   public:
+    // ctor, the securities and their cash flows are those of the analytics engine, the pillars of the curve;
+    // num_threads = 0 for one thread per core
+    ScenarioService(const BondAnalytics *_analytics, YieldCurveService *_curves, BondPositionService *_positions, int _num_threads = 0)
+        : analytics(_analytics), curves(_curves), positions(_positions), num_threads(_num_threads) {
+        for (size_t i = 0; i < analytics->GetSize(); ++i) {
+            cusips.push_back(BondInfo::GetCUSIP()[i]);
+            // n coupons, the last one with the principal at m periods
+            double c = analytics->GetCoupon(i), m = analytics->GetPeriods(i), n = analytics->GetCouponCount(i);
+            first.push_back(flowTime.size());
+            for (int k = 1; k <= int(n); ++k) {
+                flowTime.push_back(0.5 * (m - n + k));
+                flowAmount.push_back(k == int(n) ? c + 100.0 : c);
+            }
+        }
+        first.push_back(flowTime.size());
+        if (num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // add a scenario to the run
+    void AddScenario(const Scenario &scenario) {
+        scenarios.push_back(scenario);
+        results.push_back(ScenarioRisk(scenario.GetName(), cusips));
+        shocks.insert(shocks.end(), scenario.GetShocks().begin(), scenario.GetShocks().end());
+    }
+
+    // the standard stress set: parallel shifts and twists from -100bp to +100bp
+    // (5bp steps) and +/-1..25bp key-rate shocks on every risk bucket
+    void AddStandardScenarios() {
+        size_t size = cusips.size();
+        const YieldCurve &pillars = curves->GetData("");
+        double short_end = pillars.GetTenor(0);
+        double long_end = pillars.GetTenor(size - 1);
+        for (int bp = -100; bp <= 100; bp += 5) {
+            AddScenario(Scenario("parallel " + std::to_string(bp) + "bp", std::vector<double>(size, bp)));
+            if (bp == 0) continue;
+            // steepener for bp > 0, flattener for bp < 0, pivoting at the 10Y
+            std::vector<double> twist(size);
+            double pivot = 10.0;
+            for (size_t i = 0; i < size; ++i) twist[i] = bp * (pillars.GetTenor(i) - pivot) / (long_end - short_end);
+            AddScenario(Scenario("twist " + std::to_string(bp) + "bp", twist));
+        }
+        for (auto &sector : BondRiskService::GetSectors()) {
+            std::vector<bool> in_sector(size, false);
+            for (auto &product : sector.GetProducts()) {
+                int i = analytics->GetIndex(product.GetProductId());
+                if (i >= 0) in_sector[i] = true;
+            }
+            for (int bp = -25; bp <= 25; ++bp) {
+                if (bp == 0) continue;
+                std::vector<double> shock(size, 0.0);
+                for (size_t i = 0; i < size; ++i)
+                    if (in_sector[i]) shock[i] = bp;
+                AddScenario(Scenario("keyrate " + sector.GetName() + " " + std::to_string(bp) + "bp", shock));
+            }
+        }
+    }
+
+    // revalue the current positions under every scenario and publish the grids
+    void Run() {
+        size_t size = cusips.size();
+        curve.reset(new YieldCurve(curves->GetData("")));
+        quantity.resize(size);
+        base.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            quantity[i] = double(positions->GetAggregatePosition(cusips[i]));
+            base[i] = Value(*curve, i);
+        }
+
+        // split the scenarios in contiguous ranges, one per thread
+        size_t count = scenarios.size();
+        size_t chunk = (count + num_threads - 1) / num_threads;
+        std::vector<std::thread> threads;
+        for (size_t begin = chunk; begin < count; begin += chunk)
+            threads.emplace_back(&ScenarioService::Revalue, this, begin, std::min(count, begin + chunk));
+        Revalue(0, std::min(count, chunk));
+        for (auto &thread : threads) thread.join();
+
+        for (auto &result : results) this->Notify(result);
+    }
+
+    // the risk grid of a scenario
+    virtual ScenarioRisk &GetData(std::string key) {
+        for (auto &result : results)
+            if (result.GetName() == key) return result;
+        std::cout << "Can't find scenario " << key << std::endl;
+        exit(0);
+    }
+
+    // the scenarios are run here, not fed by a connector
+    virtual void OnMessage(ScenarioRisk &data) {}
+
+    // the scenario with the largest loss
+    const ScenarioRisk &GetWorst() const {
+        return *std::min_element(results.begin(), results.end(), [](const ScenarioRisk &a, const ScenarioRisk &b) { return a.GetTotal() < b.GetTotal(); });
+    }
+
+    // number of scenarios
+    size_t GetScenarioCount() const { return scenarios.size(); }
+};
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * settlement.hpp
+ * Coupon schedules, T+1 settlement dates and accrued interest of the bonds,
+ * precomputed from the security master (BondInfo) at load time.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef SETTLEMENT_HPP
+#define SETTLEMENT_HPP
+
+#include <algorithm>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bondanalytics.hpp"
+#include "bondinfo.hpp"
+#include "products.hpp"
+
+/**
+ * Settlement engine for a universe of semi-annual treasuries.
+ * The dates are day numbers counted from the first day of a window
+ * starting at the trade date. At load time, and only then, the boost
+ * date arithmetic rolls the coupon schedule of every security back from
+ * its maturity and fills two tables over the window:
+ *   - the settlement day of every trade day (T+1 business day),
+ *   - the accrued interest (actual/actual) of every security on every day,
+ * so that the accrued interest and the dirty price of a trade are two
+ * array lookups. Dates past the window fall back to a binary search in
+ * the schedule. Everything is per 100 face.
+ */
+class SettlementEngine {
+   public:
+    static const int kSettlementLag = 1;  // business days
+
+   private:
+    boost::gregorian::date start;  // day 0 of the window
+    int today;                     // trade date, day number
+    int window;
+    std::vector<std::string> cusips;
+    std::unordered_map<std::string, int> index;
+    std::vector<int> byBondInfo;                // index of every BondInfo security, -1 if not in the universe
+    std::vector<double> coupon;                 // semi-annual coupon per 100 face
+    std::vector<std::vector<int> > schedule;    // coupon dates, from the one before day 0 to maturity
+    std::vector<int> settlement;                // by trade day
+    std::vector<double> accrued;                // securities x days
+
+    int DayNumber(const boost::gregorian::date &date) const { return int((date - start).days()); }
+
+    // actual/actual accrued interest from the schedule
+    double AccruedFromSchedule(size_t i, int day) const {
+        const std::vector<int> &dates = schedule[i];
+        if (day < dates.front() || day >= dates.back()) return 0.0;
+        size_t k = size_t(std::upper_bound(dates.begin(), dates.end(), day) - dates.begin());
+        return coupon[i] * double(day - dates[k - 1]) / double(dates[k] - dates[k - 1]);
+    }
+
+   public:
+    // ctor, the window covers window_days days from the trade date
+    explicit SettlementEngine(const std::vector<std::string> &_cusips = BondInfo::GetCUSIP(),
+                              boost::gregorian::date trade_date = BondAnalytics::ValuationDate(),
+                              int window_days = 730)
+        : start(trade_date), today(0), window(window_days), cusips(_cusips) {
+        using namespace boost::gregorian;
+        size_t size = cusips.size();
+        coupon.resize(size);
+        schedule.resize(size);
+        byBondInfo.assign(BondInfo::GetCUSIP().size(), -1);
+        for (size_t i = 0; i < size; ++i) {
+            index[cusips[i]] = int(i);
+            int k = BondInfo::GetIndex(cusips[i]);
+            if (k >= 0) byBondInfo[k] = int(i);
+            const Bond &bond = *BondInfo::GetBond(cusips[i]);
+            coupon[i] = 50.0 * bond.GetCoupon();
+            // every 6 months back from the maturity, to the last coupon before the window
+            date maturity = bond.GetMaturityDate();
+            std::vector<int> &dates = schedule[i];
+            for (int back = 0;; back += 6) {
+                date d = maturity - months(back);
+                dates.push_back(DayNumber(d));
+                if (d <= start) break;
+            }
+            std::reverse(dates.begin(), dates.end());
+        }
+
+        // T+1 business day of every trade day, then the accrued interest up to the last settlement day
+        settlement.resize(window);
+        for (int day = 0; day < window; ++day) {
+            date d = start + days(day);
+            for (int lag = 0; lag < kSettlementLag;) {
+                d += days(1);
+                if (d.day_of_week() != Saturday && d.day_of_week() != Sunday) ++lag;
+            }
+            settlement[day] = DayNumber(d);
+        }
+        int last = settlement.back() + 1;
+        accrued.resize(size * last);
+        for (size_t i = 0; i < size; ++i) {
+            for (int day = 0; day < last; ++day) accrued[i * last + day] = AccruedFromSchedule(i, day);
+        }
+    }
+
+    // index of the security in the tables, -1 if it's not in the universe
+    int GetIndex(const std::string &cusip) const {
+        auto itr = index.find(cusip);
+        return (itr != index.end()) ? itr->second : -1;
+    }
+
+    // index of a bond in the tables from the index cached on it, -1 if it's not in the universe
+    int GetIndex(const Bond &bond) const {
+        int k = BondInfo::GetIndex(bond);
+        return (k >= 0 && size_t(k) < byBondInfo.size()) ? byBondInfo[k] : GetIndex(bond.GetProductId());
+    }
+
+    // move the trade date, the only call doing date arithmetic after the ctor
+    void SetTradeDate(const boost::gregorian::date &date) { today = DayNumber(date); }
+
+    // the trade date
+    boost::gregorian::date GetTradeDate() const { return start + boost::gregorian::days(today); }
+
+    // settlement day of a trade day
+    int GetSettlementDay(int day) const {
+        if (day >= 0 && day < window) return settlement[day];
+        // outside the window, skip the weekend the slow way
+        boost::gregorian::date d = start + boost::gregorian::days(day);
+        int lag = 0;
+        while (lag < kSettlementLag) {
+            d += boost::gregorian::days(1);
+            if (d.day_of_week() != boost::gregorian::Saturday && d.day_of_week() != boost::gregorian::Sunday) ++lag;
+        }
+        return DayNumber(d);
+    }
+
+    // the settlement date of a trade done today
+    boost::gregorian::date GetSettlementDate() const { return start + boost::gregorian::days(GetSettlementDay(today)); }
+
+    // accrued interest of a security on a (settlement) day
+    double GetAccrued(size_t i, int day) const {
+        size_t last = accrued.size() / cusips.size();
+        if (day >= 0 && size_t(day) < last) return accrued[i * last + day];
+        return AccruedFromSchedule(i, day);
+    }
+
+    // accrued interest of a security settling T+1 from today
+    double GetAccrued(size_t i) const { return GetAccrued(i, GetSettlementDay(today)); }
+
+    double GetAccrued(const std::string &cusip) const {
+        int i = GetIndex(cusip);
+        return (i >= 0) ? GetAccrued(size_t(i)) : 0.0;
+    }
+
+    // dirty price of a trade done today at a clean price
+    double GetDirtyPrice(const Bond &bond, double clean) const {
+        int i = GetIndex(bond);
+        return (i >= 0) ? clean + GetAccrued(size_t(i)) : clean;
+    }
+
+    // batch mode: dirty market value of every position (in the order of the cusips)
+    // from the clean prices, settling T+1 from today
+    void Revalue(const double *clean, const long *quantity, double *value) const {
+        size_t size = cusips.size();
+        size_t last = accrued.size() / size;
+        int day = GetSettlementDay(today);
+        for (size_t i = 0; i < size; ++i) {
+            double ai = (day >= 0 && size_t(day) < last) ? accrued[i * last + day] : AccruedFromSchedule(i, day);
+            value[i] = quantity[i] * (clean[i] + ai) / 100.0;
+        }
+    }
+
+    // the coupon dates of a security, as day numbers
+    const std::vector<int> &GetSchedule(size_t i) const { return schedule[i]; }
+
+    // the date of a day number
+    boost::gregorian::date GetDate(int day) const { return start + boost::gregorian::days(day); }
+
+    // number of securities
+    size_t GetSize() const { return cusips.size(); }
+};
+
+#endif
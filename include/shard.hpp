@@ -0,0 +1,383 @@
+/**
+ * shard.hpp
+ * Sharded runtime: the securities are partitioned across N shards, each one
+ * a thread pinned to a core running its own market data, algo execution,
+ * execution, trade booking, position and risk services for its CUSIPs
+ * (and its pre-trade risk checks, when the limits are given).
+ * The connectors hand the records to the owning shard through SPSC queues
+ * and the shards hand their output back the same way, so no mutable state
+ * is shared between the shards.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef SHARD_HPP
+#define SHARD_HPP
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include "bondanalytics.hpp"
+#include "bondinfo.hpp"
+#include "executionservice.hpp"
+#include "marketdataservice.hpp"
+#include "positionservice.hpp"
+#include "pretraderiskservice.hpp"
+#include "riskservice.hpp"
+#include "soa.hpp"
+#include "tradebookingservice.hpp"
+
+/**
+ * Bounded single-producer single-consumer queue.
+ * The slots are constructed once from a prototype and then assigned to,
+ * so pushing an event reuses the capacity of the strings and vectors
+ * of the slot it lands in.
+ * Type T is the event type.
+ */
+template <typename T>
+class SpscQueue {
+   private:
+    std::vector<T> slots;
+    size_t mask;
+    // consumer and producer positions on their own cache lines
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+
+   public:
+    // capacity is rounded up to a power of two
+    SpscQueue(size_t capacity, const T& prototype) : head(0), tail(0) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots.assign(size, prototype);
+        mask = size - 1;
+    }
+
+    // producer side, false if the queue is full
+    bool TryPush(const T& data) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size()) return false;
+        slots[t & mask] = data;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // producer side, wait for room if the queue is full
+    void Push(const T& data) {
+        while (!TryPush(data)) std::this_thread::yield();
+    }
+
+    // consumer side, the oldest event or nullptr if the queue is empty
+    T* Front() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return nullptr;
+        return &slots[h & mask];
+    }
+
+    // consumer side, release the slot returned by Front()
+    void Pop() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    bool Empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+};
+
+/**
+ * Listener pushing the events of a shard's service into an outbound queue.
+ * Type V is the event type.
+ */
+template <typename V>
+class SpscQueueListener : public ServiceListener<V> {
+   private:
+    SpscQueue<V>* queue;
+
+   public:
+    explicit SpscQueueListener(SpscQueue<V>* _queue) : queue(_queue) {}
+    virtual void ProcessAdd(V& data) { queue->Push(data); }
+    virtual void ProcessRemove(V& data) {}
+    virtual void ProcessUpdate(V& data) {}
+};
+
+/**
+ * One shard of the trading pipeline.
+ * The services are built and torn down on the shard's own thread, so
+ * every event they pool comes from (and goes back to) that thread's
+ * pools.
+ */
+class BondShard {
+   private:
+    // slots per queue
+    static const size_t kQueueCapacity = 1024;
+
+    int index;
+    std::vector<std::string> cusips;
+    const BondAnalytics* analytics;
+    // limits of the pre-trade checks, none if nullptr
+    const PreTradeLimits* limits;
+    // order ids shared by the shards, so no two shards send the same id
+    std::atomic<long>* orderIds;
+    std::atomic<long> rejects;
+    // inbound, one producer each (the marketdata and the trades connector)
+    SpscQueue<OrderBook<Bond> > marketdata;
+    SpscQueue<Trade<Bond> > trades;
+    // outbound, consumed by the thread running the publishers
+    SpscQueue<ExecutionOrder<Bond> > executions;
+    SpscQueue<Position<Bond> > positions;
+    SpscQueue<PV01<Bond> > risks;
+    std::atomic<bool> stopping;
+    std::atomic<bool> finished;
+    std::thread thread;
+
+    // pin the calling thread to core index % cores (linux only)
+    void Pin() {
+#ifdef __linux__
+        unsigned cores = std::thread::hardware_concurrency();
+        if (cores == 0) return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cores, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+#endif
+    }
+
+    void Run() {
+        Pin();
+
+        // trades and executions -> positions -> risk
+        BondRiskService risk_service(analytics);
+        SpscQueueListener<PV01<Bond> > risk_out(&risks);
+        risk_service.AddListener(&risk_out);
+        BondRiskListener risk_listener(&risk_service);
+        BondPositionService position_service(cusips);
+        SpscQueueListener<Position<Bond> > position_out(&positions);
+        position_service.AddListener(&risk_listener);
+        position_service.AddListener(&position_out);
+        BondPositionListener position_listener(&position_service);
+        BondTradeBookingService trade_booking_service;
+        trade_booking_service.AddListener(&position_listener);
+
+        // marketdata -> algo execution -> execution -> trade booking
+        BondTradeBookingListener trade_booking_listener(&trade_booking_service);
+        SpscQueueListener<ExecutionOrder<Bond> > execution_out(&executions);
+        BondExecutionService execution_service;
+        execution_service.AddListener(&trade_booking_listener);
+        execution_service.AddListener(&execution_out);
+        BondExecutionListener execution_listener(&execution_service);
+        // the checks read the shard's own positions and risk
+        std::unique_ptr<BondPreTradeRiskService> pretrade_risk_service;
+        std::unique_ptr<BondPreTradeRiskListener> pretrade_risk_listener;
+        std::unique_ptr<BondPreTradeClockListener> pretrade_clock_listener;
+        BondAlgoExecutionService algo_execution_service(orderIds, true);
+        if (limits != nullptr) {
+            pretrade_risk_service.reset(new BondPreTradeRiskService(&position_service, &risk_service, *limits, cusips));
+            pretrade_risk_service->SetRotation(&trade_booking_listener.GetRotation());
+            pretrade_risk_service->AddListener(&execution_listener);
+            pretrade_clock_listener.reset(new BondPreTradeClockListener(pretrade_risk_service.get()));
+            pretrade_risk_listener.reset(new BondPreTradeRiskListener(pretrade_risk_service.get()));
+            algo_execution_service.AddListener(pretrade_risk_listener.get());
+        } else {
+            algo_execution_service.AddListener(&execution_listener);
+        }
+        BondAlgoExecutionListener algo_execution_listener(&algo_execution_service);
+        BondMarketDataService marketdata_service;
+        if (pretrade_clock_listener) marketdata_service.AddListener(pretrade_clock_listener.get());
+        marketdata_service.AddListener(&algo_execution_listener);
+
+        while (true) {
+            bool idle = true;
+            while (OrderBook<Bond>* orderbook = marketdata.Front()) {
+                marketdata_service.OnMessage(*orderbook);
+                marketdata.Pop();
+                idle = false;
+            }
+            while (Trade<Bond>* trade = trades.Front()) {
+                trade_booking_service.OnMessage(*trade);
+                trades.Pop();
+                idle = false;
+            }
+            if (!idle) continue;
+            // stopping is set after the last push, check the queues once more
+            if (stopping.load() && marketdata.Empty() && trades.Empty()) break;
+            std::this_thread::yield();
+        }
+        if (pretrade_risk_service) rejects.store(pretrade_risk_service->GetRejects());
+    }
+
+    // hand the events of an outbound queue to a listener
+    template <typename V>
+    static bool DrainQueue(SpscQueue<V>& queue, ServiceListener<V>* listener) {
+        bool drained = false;
+        while (V* data = queue.Front()) {
+            listener->ProcessAdd(*data);
+            queue.Pop();
+            drained = true;
+        }
+        return drained;
+    }
+
+   public:
+    BondShard(int _index, const std::vector<std::string>& _cusips, const Bond& bond, std::atomic<long>* _orderIds, const BondAnalytics* _analytics,
+              const PreTradeLimits* _limits = nullptr)
+        : index(_index),
+          cusips(_cusips),
+          analytics(_analytics),
+          limits(_limits),
+          orderIds(_orderIds),
+          rejects(0),
+          marketdata(kQueueCapacity, OrderBook<Bond>(bond, vector<Order>(), vector<Order>())),
+          trades(kQueueCapacity, Trade<Bond>(bond, "", 0.0, "", -1, 0, BUY)),
+          executions(kQueueCapacity, ExecutionOrder<Bond>(bond, BID, "", MARKET, 0.0, 0.0, 0.0, "", false)),
+          positions(kQueueCapacity, Position<Bond>(bond)),
+          risks(kQueueCapacity, PV01<Bond>(bond, 0.0, 0)),
+          stopping(false),
+          finished(false) {}
+
+    void Start() {
+        thread = std::thread([this] {
+            Run();
+            finished.store(true);
+        });
+    }
+
+    // called by the marketdata connector's thread
+    void Route(OrderBook<Bond>& orderbook) { marketdata.Push(orderbook); }
+
+    // called by the trades connector's thread
+    void Route(Trade<Bond>& trade) { trades.Push(trade); }
+
+    // forward the shard's output to the publishing side, true if there was any
+    bool Drain(ServiceListener<ExecutionOrder<Bond> >* execution_listener,
+               ServiceListener<Position<Bond> >* position_listener,
+               ServiceListener<PV01<Bond> >* risk_listener) {
+        bool drained = DrainQueue(executions, execution_listener);
+        drained |= DrainQueue(positions, position_listener);
+        drained |= DrainQueue(risks, risk_listener);
+        return drained;
+    }
+
+    // no more inbound records, the shard finishes its queues and exits
+    void Stop() { stopping.store(true); }
+
+    bool IsFinished() const { return finished.load(); }
+
+    void Join() {
+        if (thread.joinable()) thread.join();
+    }
+
+    const std::vector<std::string>& GetCUSIPs() const { return cusips; }
+
+    // number of orders rejected by the pre-trade checks, once the shard has finished
+    long GetRejects() const { return rejects.load(); }
+};
+
+/**
+ * The set of shards, and the routing of a security to its shard:
+ * the known CUSIPs are dealt round-robin by their BondInfo index,
+ * any other security by the hash of its identifier.
+ */
+class ShardedRuntime {
+   private:
+    std::vector<std::unique_ptr<BondShard> > shards;
+    std::atomic<long> orderIds;
+    ServiceListener<ExecutionOrder<Bond> >* execution_listener;
+    ServiceListener<Position<Bond> >* position_listener;
+    ServiceListener<PV01<Bond> >* risk_listener;
+
+   public:
+    // the output of the shards goes to the given listeners, on the thread calling Drain(),
+    // the risk of the shards reads its PV01 from the analytics engine, the order ids of the shards
+    // come from one counter, and the algo orders of the shards are checked against the limits if any
+    ShardedRuntime(int num_shards,
+                   ServiceListener<ExecutionOrder<Bond> >* _execution_listener,
+                   ServiceListener<Position<Bond> >* _position_listener,
+                   ServiceListener<PV01<Bond> >* _risk_listener,
+                   const BondAnalytics* analytics = nullptr,
+                   const PreTradeLimits* limits = nullptr)
+        : orderIds(0), execution_listener(_execution_listener), position_listener(_position_listener), risk_listener(_risk_listener) {
+        if (num_shards < 1) num_shards = 1;
+        std::vector<std::vector<std::string> > cusips(num_shards);
+        for (auto& cusip : BondInfo::GetCUSIP()) cusips[BondInfo::GetIndex(cusip) % num_shards].push_back(cusip);
+        const Bond& bond = *BondInfo::GetBond(BondInfo::GetCUSIP()[0]);
+        for (int i = 0; i < num_shards; ++i) shards.emplace_back(new BondShard(i, cusips[i], bond, &orderIds, analytics, limits));
+    }
+
+    ~ShardedRuntime() {
+        for (auto& shard : shards) {
+            shard->Stop();
+            shard->Join();
+        }
+    }
+
+    void Start() {
+        for (auto& shard : shards) shard->Start();
+    }
+
+    // the shard owning a security
+    BondShard& ShardOf(const std::string& cusip) {
+        int index = BondInfo::GetIndex(cusip);
+        size_t key = (index >= 0) ? size_t(index) : std::hash<std::string>()(cusip);
+        return *shards[key % shards.size()];
+    }
+
+    // forward the output of every shard, true if there was any
+    bool Drain() {
+        bool drained = false;
+        for (auto& shard : shards) drained |= shard->Drain(execution_listener, position_listener, risk_listener);
+        return drained;
+    }
+
+    // stop the shards once the connectors are done, draining their output until they exit
+    void Stop() {
+        for (auto& shard : shards) shard->Stop();
+        for (auto& shard : shards) {
+            while (!shard->IsFinished())
+                if (!Drain()) std::this_thread::yield();
+            shard->Join();
+        }
+        Drain();
+    }
+
+    int GetShardCount() const { return int(shards.size()); }
+
+    // number of orders rejected by the pre-trade checks of the shards, once they are stopped
+    long GetRejects() const {
+        long total = 0;
+        for (auto& shard : shards) total += shard->GetRejects();
+        return total;
+    }
+};
+
+/**
+ * Stand-in for BondMarketDataService on the connector side:
+ * routes every order book to the shard owning the security.
+ */
+class ShardedMarketDataService : public BondMarketDataService {
+   private:
+    ShardedRuntime* runtime;
+
+   public:
+    explicit ShardedMarketDataService(ShardedRuntime* _runtime) : runtime(_runtime) {}
+    virtual void OnMessage(OrderBook<Bond>& _orderbook) {
+        runtime->ShardOf(_orderbook.GetProduct().GetProductId()).Route(_orderbook);
+    }
+};
+
+/**
+ * Stand-in for BondTradeBookingService on the connector side:
+ * routes every trade to the shard owning the security.
+ */
+class ShardedTradeBookingService : public BondTradeBookingService {
+   private:
+    ShardedRuntime* runtime;
+
+   public:
+    explicit ShardedTradeBookingService(ShardedRuntime* _runtime) : runtime(_runtime) {}
+    virtual void OnMessage(Trade<Bond>& _trade) {
+        runtime->ShardOf(_trade.GetProduct().GetProductId()).Route(_trade);
+    }
+};
+
+#endif
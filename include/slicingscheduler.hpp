@@ -0,0 +1,229 @@
+/**
+ * slicingscheduler.hpp
+ * Execution algos slicing the parent orders into timed child orders
+ * (TWAP, iceberg), scheduled on a timer wheel.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef SLICING_SCHEDULER_HPP
+#define SLICING_SCHEDULER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "executionservice.hpp"
+#include "marketdataservice.hpp"
+#include "objectpool.hpp"
+#include "soa.hpp"
+#include "timerwheel.hpp"
+#include "tradebookingservice.hpp"
+
+enum SliceAlgo { TWAP,
+                 ICEBERG };
+
+/**
+ * Parameters of a slicing algo.
+ * TWAP sends the order in slices equal child orders, one every interval.
+ * ICEBERG shows display at a time: every interval the visible quantity
+ * of the next child order is refreshed from the hidden quantity left.
+ */
+struct SliceParams {
+    SliceAlgo algo = TWAP;
+    int slices = 5;
+    long display = 1000000;
+    long interval = 10;  // milliseconds
+};
+
+/**
+ * Scheduler of the slicing algos, between BondAlgoExecutionService and
+ * BondPreTradeRiskService. Submit() takes the visible quantity of a parent
+ * order as its size and returns a handle; the parent's state lives in a
+ * pool addressed by that handle and its next slice is a timer of a
+ * TimerWheel ticking every millisecond, so thousands of parents cost no
+ * thread and no lookup, and scheduling, firing and cancelling a slice are
+ * O(1). The first slice goes out right away, the child orders are
+ * identified as parentOrderId.k and carry the quantity still hidden.
+ * A parent without a book takes the next book of the rotation of the
+ * trade booking (SetRotation), and all its children are booked in it.
+ * The wheel is advanced by Poll(), called on the thread submitting the
+ * orders (by the feed, see BondSlicingClockListener); Drain() sends what
+ * is left at once, in the slices the algo would have sent.
+ * Keyed on product identifier.
+ */
+class BondSlicingScheduler : public ExecutionService<Bond> {
+   public:
+    typedef uint64_t Handle;
+    static const Handle kNoParent = UINT64_MAX;
+
+   private:
+    struct Parent {
+        ExecutionOrder<Bond> order;
+        SliceParams params;
+        long remaining;
+        int sent;
+        uint32_t generation;
+        TimerWheel::Handle timer;
+        bool active;
+    };
+
+    SliceParams defaults;
+    TimerWheel wheel;
+    std::chrono::steady_clock::time_point start;
+    std::vector<Parent> parents;
+    std::vector<uint32_t> freeSlots;
+    std::string childId;
+    BookRotation *rotation;
+    size_t active;
+    long children;
+
+    uint64_t Elapsed() const {
+        return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    // send the next slice of a parent and schedule the one after (unless draining)
+    void Slice(uint32_t slot, bool schedule = true) {
+        Parent &parent = parents[slot];
+        const SliceParams &params = parent.params;
+        long quantity = parent.remaining;
+        if (params.algo == TWAP) {
+            int left = std::max(1, params.slices - parent.sent);
+            quantity = (parent.remaining + left - 1) / left;
+        } else {
+            quantity = std::min(parent.remaining, std::max(1L, params.display));
+        }
+        parent.remaining -= quantity;
+        ++parent.sent;
+        ++children;
+
+        const ExecutionOrder<Bond> &order = parent.order;
+        childId = order.GetOrderId();
+        childId += '.';
+        childId += std::to_string(parent.sent);
+        Pooled<ExecutionOrder<Bond> > child(order.GetProduct(), order.GetPricingSide(), childId, order.GetOrderType(), order.GetPrice(),
+                                            double(quantity), double(parent.remaining), order.GetOrderId(), true, order.GetBookId());
+        if (parent.remaining > 0) {
+            if (schedule) parent.timer = wheel.Schedule(uint64_t(std::max(1L, params.interval)), slot);
+        } else {
+            Release(slot);
+        }
+        this->Notify(*child);
+    }
+
+    void Release(uint32_t slot) {
+        Parent &parent = parents[slot];
+        parent.active = false;
+        parent.timer = TimerWheel::kNoTimer;
+        ++parent.generation;
+        freeSlots.push_back(slot);
+        --active;
+    }
+
+   public:
+    // ctor, the algo used by ExecuteOrder
+    explicit BondSlicingScheduler(const SliceParams &_defaults = SliceParams()) : defaults(_defaults), start(std::chrono::steady_clock::now()), rotation(nullptr), active(0), children(0) {}
+
+    // book the parents without a book in the next book of a rotation (BondTradeBookingListener::GetRotation)
+    void SetRotation(BookRotation *_rotation) { rotation = _rotation; }
+
+    // slice a parent order, returns the handle to cancel it
+    Handle Submit(const ExecutionOrder<Bond> &order, const SliceParams &params) {
+        if (order.GetVisibleQuantity() <= 0) return kNoParent;
+        Poll();
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+            Parent &parent = parents[slot];
+            parent.order = order;
+            parent.params = params;
+            parent.remaining = order.GetVisibleQuantity();
+            parent.sent = 0;
+            parent.active = true;
+        } else {
+            slot = uint32_t(parents.size());
+            parents.push_back(Parent{order, params, order.GetVisibleQuantity(), 0, 0, TimerWheel::kNoTimer, true});
+        }
+        ++active;
+        ExecutionOrder<Bond> &parent = parents[slot].order;
+        if (rotation != nullptr && rotation->Slot(parent.GetBookId()) == rotation->GetBookIds().size())
+            parent.SetBookId(rotation->GetBookIds()[rotation->Next()]);
+        Handle handle = (Handle(parents[slot].generation) << 32) | slot;
+        Slice(slot);
+        return handle;
+    }
+
+    // stop slicing a parent, false if it is already complete or cancelled
+    bool Cancel(Handle handle) {
+        uint32_t slot = uint32_t(handle);
+        if (handle == kNoParent || slot >= parents.size()) return false;
+        Parent &parent = parents[slot];
+        if (!parent.active || parent.generation != uint32_t(handle >> 32)) return false;
+        wheel.Cancel(parent.timer);
+        Release(slot);
+        return true;
+    }
+
+    // send the slices due by now
+    void Poll() {
+        wheel.Advance(Elapsed(), [this](uint64_t slot) { Slice(uint32_t(slot)); });
+    }
+
+    // send the rest of every parent at once, still in slices of its algo
+    // (display-sized for an iceberg, the TWAP slice size for TWAP)
+    void Drain() {
+        for (uint32_t slot = 0; slot < parents.size(); ++slot) {
+            if (!parents[slot].active) continue;
+            wheel.Cancel(parents[slot].timer);
+            parents[slot].timer = TimerWheel::kNoTimer;
+            while (parents[slot].active) Slice(slot, false);
+        }
+    }
+
+    // number of parents being sliced
+    size_t GetActiveCount() const { return active; }
+
+    // number of child orders sent
+    long GetChildCount() const { return children; }
+
+    void ExecuteOrder(const ExecutionOrder<Bond> &order, Market market) { Submit(order, defaults); }
+};
+
+/**
+ * Slicing listener
+ * to listen the BondAlgoExecutionService
+ * then pass the parent orders to BondSlicingScheduler
+ */
+class BondSlicingListener : public ServiceListener<ExecutionOrder<Bond> > {
+   private:
+    BondSlicingScheduler *service;
+    SliceParams params;
+
+   public:
+    BondSlicingListener(BondSlicingScheduler *_service, const SliceParams &_params) : service(_service), params(_params) {}
+    virtual void ProcessAdd(ExecutionOrder<Bond> &_order) {
+        DEBUG_TEST("BondAlgoExecutionService -> BondSlicingScheduler\n");
+        service->Submit(_order, params);
+    }
+    virtual void ProcessRemove(ExecutionOrder<Bond> &_order) {}
+    virtual void ProcessUpdate(ExecutionOrder<Bond> &_order) {}
+};
+
+/**
+ * Listener advancing the clock of BondSlicingScheduler on every update of
+ * BondMarketDataService, on the thread running the algo execution.
+ */
+class BondSlicingClockListener : public ServiceListener<OrderBook<Bond> > {
+   private:
+    BondSlicingScheduler *service;
+
+   public:
+    explicit BondSlicingClockListener(BondSlicingScheduler *_service) : service(_service) {}
+    virtual void ProcessAdd(OrderBook<Bond> &_orderbook) { service->Poll(); }
+    virtual void ProcessRemove(OrderBook<Bond> &_orderbook) {}
+    virtual void ProcessUpdate(OrderBook<Bond> &_orderbook) {}
+};
+
+#endif
@@ -0,0 +1,391 @@
+/**
+ * smartorderrouter.hpp
+ * Smart order router splitting the orders across the venues
+ * (BROKERTEC, ESPEED, CME) on their consolidated top of book.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef SMART_ORDER_ROUTER_HPP
+#define SMART_ORDER_ROUTER_HPP
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bondinfo.hpp"
+#include "exchange.hpp"
+#include "executionservice.hpp"
+#include "marketdataservice.hpp"
+#include "objectpool.hpp"
+#include "soa.hpp"
+
+/**
+ * Static profile of a venue: its fee and its latency, both turned into
+ * a price penalty when ranking the venues.
+ */
+struct VenueProfile {
+    Market market;
+    double fee;      // per 100 face
+    double latency;  // microseconds
+};
+
+/**
+ * Smart order router between BondPreTradeRiskService and BondExecutionService.
+ * Every venue rests its share of the market data feed, and the router caches
+ * the top of book of every venue for every security in a dense array
+ * (securities x venues). A parent order is split in child orders: the venues
+ * are ranked on their top of book price plus the fee and latency penalty,
+ * each one gets what it shows at the top in rank order and the best one
+ * gets the rest. The children are IOC at their venue's top (MARKET for a
+ * MARKET parent), identified as parentOrderId.k and executed on their market,
+ * so their executions carry the parent's id downstream. What a MARKET
+ * parent didn't fill keeps working and is routed again on the next order
+ * book update of the security; what a LIMIT parent didn't fill rests as a
+ * LIMIT child at its limit on the venue of the lowest penalty, whose
+ * passive fills count towards the parent. Both work until they are
+ * complete, cancelled or have worked for longer than the time limit, and
+ * the resting child of a parent cancelled goes with it; IOC and FOK
+ * parents are done after one pass. The time limit runs in event time, as
+ * the pre-trade rates do: every security updates once per kUpdateInterval,
+ * so every order book update moves the router's clock by kUpdateInterval
+ * over the number of securities, and the parents of all the securities are
+ * checked for expiry once per kUpdateInterval of it, whether their
+ * security ticks or not. A FOK parent is only split if the tops of the venues add up to
+ * its quantity, in FOK children of at most what each venue shows, so it
+ * fills in full or not at all. A parent of a type the venues don't
+ * support (STOP), of a security they don't list, or with the id of one
+ * still working is rejected.
+ * Keyed on product identifier.
+ */
+class BondSmartOrderRouter : public ExecutionService<Bond>, public VenueFillListener {
+   public:
+    static constexpr double kLatencyCost = 1e-5;     // price per 100 face per microsecond
+    static constexpr double kUpdateInterval = 0.01;  // seconds of event time between two order book updates of a security
+
+    // a parent order still working
+    struct Parent {
+        ExecutionOrder<Bond> order;
+        long filled;
+        int children;
+        double expiry;        // event time
+        std::string resting;  // id of the LIMIT child resting, empty if there is none
+        size_t venue;         // of the resting child
+    };
+
+   private:
+    // top of book of a security on a venue
+    struct Top {
+        double bid;
+        long bidQuantity;
+        double offer;
+        long offerQuantity;
+    };
+
+    BondExecutionService *execution;
+    std::vector<ExchangeSimulator *> venues;
+    std::vector<VenueProfile> profiles;
+    std::unordered_map<std::string, int> index;
+    std::vector<Top> tops;                          // securities x venues
+    std::unordered_map<std::string, Parent> parents;
+    std::vector<std::vector<std::string> > working;  // ids of the parents working, by security
+    // buffers reused across orders
+    std::vector<int> ranking;
+    std::vector<long> allocation;
+    std::vector<std::string> retry;
+    std::string childId;
+    double timeout;       // seconds of event time
+    double now;           // event time
+    double nextExpiry;    // of the next check of all the parents
+    size_t passiveVenue;  // where the LIMIT parents rest
+    long routed;
+    long children;
+    long filled;
+    long cancelled;
+    long rejected;
+
+    Top &TopOf(int security, size_t venue) { return tops[security * venues.size() + venue]; }
+
+    // cache the top of book of a venue
+    void Refresh(int security, size_t venue, const LimitOrderBook &book) {
+        Top &top = TopOf(security, venue);
+        int bid = book.GetBestBid();
+        int offer = book.GetBestOffer();
+        top.bid = (bid >= 0) ? LimitOrderBook::ToPrice(bid) : 0.0;
+        top.bidQuantity = (bid >= 0) ? book.GetQuantity(bid) : 0;
+        top.offer = (offer < LimitOrderBook::kLevels) ? LimitOrderBook::ToPrice(offer) : 0.0;
+        top.offerQuantity = (offer < LimitOrderBook::kLevels) ? book.GetQuantity(offer) : 0;
+    }
+
+    // the next child id of a parent
+    const std::string &NextChild(Parent &parent) {
+        childId = parent.order.GetOrderId();
+        childId += '.';
+        childId += std::to_string(++parent.children);
+        ++children;
+        return childId;
+    }
+
+    // rest what a LIMIT parent didn't fill at its limit on the passive venue
+    void Rest(int security, Parent &parent) {
+        const ExecutionOrder<Bond> &order = parent.order;
+        size_t v = passiveVenue;
+        Pooled<ExecutionOrder<Bond> > child(order.GetProduct(), order.GetPricingSide(), NextChild(parent), LIMIT, order.GetPrice(),
+                                            double(order.GetVisibleQuantity() - parent.filled), 0.0, order.GetOrderId(), true, order.GetBookId());
+        long done = execution->Execute(*child, profiles[v].market);
+        parent.filled += done;
+        filled += done;
+        if (parent.filled < order.GetVisibleQuantity()) {
+            parent.resting = child->GetOrderId();
+            parent.venue = v;
+        }
+        Refresh(security, v, *venues[v]->GetBook(order.GetProduct().GetProductId()));
+    }
+
+    // one pass of a parent over the venues, returns whether it is complete;
+    // a LIMIT parent left incomplete rests what it didn't fill
+    bool Split(int security, Parent &parent) {
+        Sweep(security, parent);
+        bool complete = parent.filled >= parent.order.GetVisibleQuantity();
+        if (!complete && parent.order.GetOrderType() == LIMIT && parent.resting.empty()) Rest(security, parent);
+        return parent.filled >= parent.order.GetVisibleQuantity();
+    }
+
+    // take what the venues show at the top within the limit of a parent
+    void Sweep(int security, Parent &parent) {
+        const ExecutionOrder<Bond> &order = parent.order;
+        bool buy = (order.GetPricingSide() == BID);
+        bool market = (order.GetOrderType() == MARKET);
+        bool fok = (order.GetOrderType() == FOK);
+        long quantity = order.GetVisibleQuantity() - parent.filled;
+
+        // the venues showing liquidity within the limit, ranked on price plus penalties
+        ranking.clear();
+        for (size_t v = 0; v < venues.size(); ++v) {
+            const Top &top = TopOf(security, v);
+            if ((buy ? top.offerQuantity : top.bidQuantity) <= 0) continue;
+            if (!market && (buy ? top.offer > order.GetPrice() : top.bid < order.GetPrice())) continue;
+            ranking.push_back(int(v));
+        }
+        if (ranking.empty()) return;
+        auto cost = [&](int v) {
+            const Top &top = TopOf(security, v);
+            double penalty = profiles[v].fee + profiles[v].latency * kLatencyCost;
+            return buy ? top.offer + penalty : penalty - top.bid;
+        };
+        std::sort(ranking.begin(), ranking.end(), [&](int a, int b) { return cost(a) < cost(b); });
+
+        // what every venue shows at the top, the rest to the best venue
+        allocation.assign(venues.size(), 0);
+        long left = quantity;
+        for (int v : ranking) {
+            const Top &top = TopOf(security, v);
+            long take = std::min(left, buy ? top.offerQuantity : top.bidQuantity);
+            allocation[v] = take;
+            left -= take;
+        }
+        // a FOK parent the venues can't fill in full sends nothing
+        if (fok && left > 0) return;
+        allocation[ranking.front()] += left;
+
+        for (int v : ranking) {
+            if (allocation[v] == 0) continue;
+            const Top &top = TopOf(security, v);
+            double price = market ? order.GetPrice() : (buy ? top.offer : top.bid);
+            Pooled<ExecutionOrder<Bond> > child(order.GetProduct(), order.GetPricingSide(), NextChild(parent), market ? MARKET : (fok ? FOK : IOC),
+                                                price, double(allocation[v]), 0.0, order.GetOrderId(), true, order.GetBookId());
+            long done = execution->Execute(*child, profiles[v].market);
+            parent.filled += done;
+            filled += done;
+            Refresh(security, v, *venues[v]->GetBook(order.GetProduct().GetProductId()));
+        }
+    }
+
+    // stop working a parent of a security
+    void Remove(int security, const std::string &orderId) {
+        std::vector<std::string> &ids = working[security];
+        auto itr = std::find(ids.begin(), ids.end(), orderId);
+        if (itr != ids.end()) ids.erase(itr);
+        parents.erase(orderId);
+    }
+
+    // cancel a parent before it is complete, with its resting child
+    void Close(std::unordered_map<std::string, Parent>::iterator parent) {
+        if (!parent->second.resting.empty()) execution->Cancel(parent->second.resting, profiles[parent->second.venue].market);
+        parents.erase(parent);
+        ++cancelled;
+    }
+
+   public:
+    // ctor, the venues with their profiles (in the same order), the children are executed on execution;
+    // the parents left working are cancelled after timeout milliseconds of event time
+    BondSmartOrderRouter(BondExecutionService *_execution, const std::vector<ExchangeSimulator *> &_venues, const std::vector<VenueProfile> &_profiles, long _timeout = 1000)
+        : execution(_execution), venues(_venues), profiles(_profiles), timeout(_timeout / 1000.0), now(0.0), nextExpiry(kUpdateInterval), passiveVenue(0), routed(0), children(0), filled(0), cancelled(0), rejected(0) {
+        for (auto &cusip : BondInfo::GetCUSIP()) index[cusip] = int(index.size());
+        tops.assign(index.size() * venues.size(), Top{0.0, 0, 0.0, 0});
+        working.resize(index.size());
+        for (ExchangeSimulator *venue : venues) execution->SetVenue(venue->GetMarket(), venue);
+        execution->SetFillListener(this);
+        auto penalty = [&](size_t v) { return profiles[v].fee + profiles[v].latency * kLatencyCost; };
+        for (size_t v = 1; v < profiles.size(); ++v)
+            if (penalty(v) < penalty(passiveVenue)) passiveVenue = v;
+    }
+
+    // the default profiles of BROKERTEC, ESPEED and CME:
+    // the fastest venue charges the most
+    static std::vector<VenueProfile> GetProfiles() {
+        return {{BROKERTEC, 0.0020, 50.0},
+                {ESPEED, 0.0015, 80.0},
+                {CME, 0.0010, 120.0}};
+    }
+
+    // an order book update: every venue rests its share and its top of book is cached,
+    // then the parents working on the security are routed again, or cancelled once expired
+    // (and once per kUpdateInterval those of every security)
+    void OnMarketData(const OrderBook<Bond> &orderbook) {
+        const std::string &cusip = orderbook.GetProduct().GetProductId();
+        auto itr = index.find(cusip);
+        if (itr == index.end()) return;
+        int security = itr->second;
+        now += kUpdateInterval / index.size();
+        if (now >= nextExpiry) {
+            Expire();
+            nextExpiry = now + kUpdateInterval;
+        }
+        for (size_t v = 0; v < venues.size(); ++v) {
+            venues[v]->OnMarketData(orderbook);
+            Refresh(security, v, *venues[v]->GetBook(cusip));
+        }
+        if (working[security].empty()) return;
+        retry.swap(working[security]);
+        for (const std::string &orderId : retry) {
+            auto parent = parents.find(orderId);
+            if (parent == parents.end()) continue;
+            if (now >= parent->second.expiry) {
+                Close(parent);
+            } else if (parent->second.resting.empty() && Split(security, parent->second)) {
+                parents.erase(parent);
+            } else {
+                working[security].push_back(orderId);
+            }
+        }
+        retry.clear();
+    }
+
+    // split a parent order across the venues and execute the children,
+    // rejecting it for an unsupported type or security, or if a parent with its id is still working
+    void Route(const ExecutionOrder<Bond> &order) {
+        auto itr = index.find(order.GetProduct().GetProductId());
+        if (itr == index.end() || order.GetOrderType() == STOP || parents.count(order.GetOrderId()) != 0) {
+            ++rejected;
+            return;
+        }
+        ++routed;
+        Parent parent{order, 0, 0, now + timeout, std::string(), 0};
+        if (Split(itr->second, parent) || order.GetOrderType() == IOC || order.GetOrderType() == FOK) return;
+        parents.emplace(order.GetOrderId(), parent);
+        working[itr->second].push_back(order.GetOrderId());
+    }
+
+    // stop working a parent order, false if it isn't working
+    bool Cancel(const std::string &orderId) {
+        auto itr = parents.find(orderId);
+        if (itr == parents.end()) return false;
+        std::vector<std::string> &ids = working[index[itr->second.order.GetProduct().GetProductId()]];
+        auto id = std::find(ids.begin(), ids.end(), orderId);
+        if (id != ids.end()) ids.erase(id);
+        Close(itr);
+        return true;
+    }
+
+    // a resting child hit at its venue: the parent is complete once it has filled its quantity
+    virtual void OnPassiveFill(const ExecutionOrder<Bond> &order, const VenueFill &fill) {
+        auto itr = parents.find(order.GetParentOrderId());
+        if (itr == parents.end()) return;
+        Parent &parent = itr->second;
+        parent.filled += fill.quantity;
+        filled += fill.quantity;
+        // the child rests what the parent had left, so it is gone once the parent is complete
+        if (parent.filled >= parent.order.GetVisibleQuantity()) Remove(index[order.GetProduct().GetProductId()], order.GetParentOrderId());
+    }
+
+    // cancel the parents working for longer than the time limit, whether their security ticks or not
+    void Expire() {
+        for (size_t security = 0; security < working.size(); ++security) {
+            retry.swap(working[security]);
+            for (const std::string &orderId : retry) {
+                auto parent = parents.find(orderId);
+                if (parent == parents.end()) continue;
+                if (now < parent->second.expiry) {
+                    working[security].push_back(orderId);
+                } else {
+                    Close(parent);
+                }
+            }
+            retry.clear();
+        }
+    }
+
+    // a parent order still working, nullptr once complete
+    const Parent *GetParent(const std::string &orderId) const {
+        auto itr = parents.find(orderId);
+        return (itr != parents.end()) ? &itr->second : nullptr;
+    }
+
+    // number of parent orders routed, of child orders sent and the quantity filled
+    long GetRoutedCount() const { return routed; }
+    long GetChildCount() const { return children; }
+    long GetFilledQuantity() const { return filled; }
+
+    // number of parent orders still working, and cancelled (or expired) before they were complete
+    size_t GetWorkingCount() const { return parents.size(); }
+    long GetCancelledCount() const { return cancelled; }
+
+    // number of parent orders rejected for their type or security, or for the id of one still working
+    long GetRejectedCount() const { return rejected; }
+
+    // event time, in seconds
+    double GetTime() const { return now; }
+
+    void ExecuteOrder(const ExecutionOrder<Bond> &order, Market market) { Route(order); }
+};
+
+/**
+ * Listener feeding the order books of BondMarketDataService to the venues
+ * through the router, registered before the algo execution so the venues
+ * have the new book when the algo trades on it.
+ */
+class BondSmartOrderRouterMarketDataListener : public ServiceListener<OrderBook<Bond> > {
+   private:
+    BondSmartOrderRouter *router;
+
+   public:
+    explicit BondSmartOrderRouterMarketDataListener(BondSmartOrderRouter *_router) : router(_router) {}
+    virtual void ProcessAdd(OrderBook<Bond> &_orderbook) {
+        DEBUG_TEST("BondMarketDataService -> BondSmartOrderRouter\n");
+        router->OnMarketData(_orderbook);
+    }
+    virtual void ProcessRemove(OrderBook<Bond> &_orderbook) {}
+    virtual void ProcessUpdate(OrderBook<Bond> &_orderbook) {}
+};
+
+/**
+ * Smart order router listener
+ * to listen the BondPreTradeRiskService
+ * then pass the execution order to BondSmartOrderRouter
+ */
+class BondSmartOrderRouterListener : public ServiceListener<ExecutionOrder<Bond> > {
+   private:
+    BondSmartOrderRouter *router;
+
+   public:
+    explicit BondSmartOrderRouterListener(BondSmartOrderRouter *_router) : router(_router) {}
+    virtual void ProcessAdd(ExecutionOrder<Bond> &_order) {
+        DEBUG_TEST("BondPreTradeRiskService -> BondSmartOrderRouter\n");
+        router->Route(_order);
+    }
+    virtual void ProcessRemove(ExecutionOrder<Bond> &_order) {}
+    virtual void ProcessUpdate(ExecutionOrder<Bond> &_order) {}
+};
+
+#endif
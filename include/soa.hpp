@@ -14,6 +14,9 @@
 #include <string>
 #include <vector>
 
+#include "executor.hpp"
+#include "objectpool.hpp"
+
 using namespace std;
 using namespace boost::asio;
 using ip::tcp;
@@ -46,6 +49,9 @@ class ServiceListener {
 template <typename K, typename V>
 class Service {
    public:
+    // ctor, listeners are called inline by default
+    Service() : executor(nullptr), laneKey(nullptr) {}
+
     // The callback that a Connector should invoke for any new or updated data
     virtual void OnMessage(V &data) {}
 
@@ -60,8 +66,29 @@ class Service {
         return listeners;
     }
 
+    // Post the listener invocations to an executor instead of calling them inline.
+    // The listeners of an event run in one task on the lane of laneKey(data),
+    // with one copy of the data, in the order they were added (as inline), so a
+    // listener can rely on the ones before it; the events of different keys run
+    // in parallel and every listener sees the events of one key in order.
+    // The copy comes from a pool of the service and the task only holds a
+    // pointer to it, so posting an event doesn't allocate once warmed up.
+    virtual void SetExecutor(WorkStealingExecutor *_executor, size_t (*_laneKey)(const V &) = &ProductLaneKey<V>) {
+        executor = _executor;
+        laneKey = _laneKey;
+    }
+
     // Notify all the listeners
     virtual void Notify(V &data) {
+        if (executor != nullptr) {
+            V *event = events.Acquire(data);
+            executor->Post(laneKey(data), [this, event]() {
+                for (auto listener : listeners)
+                    listener->ProcessAdd(*event);
+                events.Release(event);
+            });
+            return;
+        }
         for (auto listener : listeners)
             listener->ProcessAdd(data);
     }
@@ -69,6 +96,11 @@ class Service {
    protected:
     // vector of listeners
     vector<ServiceListener<V> *> listeners;
+    // executor the listener invocations are posted to (nullptr: inline)
+    WorkStealingExecutor *executor;
+    size_t (*laneKey)(const V &);
+    // copies of the events posted to the executor
+    SharedObjectPool<V> events;
 };
 
 /**
@@ -89,13 +121,23 @@ class Connector {
     // split the string
     std::vector<std::string> split(const std::string &s, char delimiter) {
         std::vector<std::string> tokens;
-        std::string token;
-        std::istringstream tokenStream(s);
-        while (std::getline(tokenStream, token, delimiter)) {
-            tokens.push_back(token);
-        }
+        split(s, delimiter, tokens);
         return tokens;
     }
+    // split the string into a reused vector of tokens
+    // (the tokens keep their capacity so no allocation once warmed up)
+    void split(const std::string &s, char delimiter, std::vector<std::string> &tokens) {
+        size_t count = 0;
+        size_t start = 0;
+        while (start < s.size()) {
+            size_t end = s.find(delimiter, start);
+            if (end == std::string::npos) end = s.size();
+            if (count == tokens.size()) tokens.emplace_back();
+            tokens[count++].assign(s, start, end - start);
+            start = end + 1;
+        }
+        tokens.resize(count);
+    }
     // remove the \n from the string
     void trim(string &str) {
         str.erase(std::remove(str.begin(), str.end(), '\n'), str.end());
@@ -107,11 +149,21 @@ class Connector {
         string data = boost::asio::buffer_cast<const char *>(buf.data());
         return data;
     }
+    // read one line from the socket into a reused string,
+    // bytes after the delimiter stay in read_buffer for the next call
+    void read_socket(tcp::socket &socket, string &line) {
+        size_t n = boost::asio::read_until(socket, read_buffer, "\n");
+        line.resize(n);
+        boost::asio::buffer_copy(boost::asio::buffer(&line[0], n), read_buffer.data());
+        read_buffer.consume(n);
+    }
     // send the data to the socket
     void send_socket(tcp::socket &socket, const string &message) {
-        const string msg = message + "\n";
         boost::asio::write(socket, boost::asio::buffer(message));
     }
+
+   private:
+    boost::asio::streambuf read_buffer;
 };
 
 #endif
@@ -7,11 +7,23 @@
 #ifndef STREAMING_SERVICE_HPP
 #define STREAMING_SERVICE_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
+#include "bondinfo.hpp"
+#include "coroconnector.hpp"
 #include "marketdataservice.hpp"
+#include "objectpool.hpp"
+#include "positionservice.hpp"
 #include "products.hpp"
-#include "bondinfo.hpp"
+#include "riskservice.hpp"
 #include "soa.hpp"
 
 /**
@@ -60,6 +72,15 @@ class PriceStream {
                                                        bidOrder(_bidOrder),
                                                        offerOrder(_offerOrder) {}
 
+    // Overwrite the stream in place when recycled by an ObjectPool
+    void Reset(const T& _product,
+               const PriceStreamOrder& _bidOrder,
+               const PriceStreamOrder& _offerOrder) {
+        product = _product;
+        bidOrder = _bidOrder;
+        offerOrder = _offerOrder;
+    }
+
     // Get the product
     const T& GetProduct() const { return product; }
 
@@ -96,46 +117,82 @@ class StreamingService : public Service<string, PriceStream<T> > {
 
 using BondStreamingService = StreamingService<Bond>;
 
+/**
+ * Skew of the two-way prices with the inventory, as a fraction of the
+ * PV01 limit held: at the limit, long or short, the mid moves by
+ * maxSkew half spreads against the position and the spread widens by
+ * maxWiden spreads. Beyond the limit both stay at their maximum.
+ * The PV01 is in currency per basis point.
+ */
+struct QuoteSkew {
+    double pv01Limit = 50000.0;
+    double maxSkew = 1.0;
+    double maxWiden = 1.0;
+};
+
 /**
  * Bond Algo Streaming service to publish two-way prices.
  * Keyed on product identifier.
  * with value an AlgoStream object.
  * (what's the point of AlgoStream object?)
+ * With SetInventory() the quotes lean against the position: every quote
+ * reads the aggregate position of BondPositionService and the unit PV01
+ * of BondRiskService from their atomics (resolved once per security),
+ * so quoting never waits on a lock or on the risk pipeline, and a long
+ * position lowers and widens the two-way price (a short one raises it).
  */
 class BondAlgoStreamingService : public Service<string, PriceStream<Bond> > {
    private:
+    // the inventory of a security
+    struct Inventory {
+        const AtomicPosition<Bond>* position;
+        const std::atomic<double>* pv01;  // per 100 face
+    };
+
     // do we need this?
     std::map<string, PriceStream<Bond> > algo_stream;
     // counter to alternate the order size
-    int count;
+    std::atomic<int> count;
+    // filled in SetInventory only, so the threads can look up concurrently
+    std::unordered_map<string, Inventory> inventory;
+    QuoteSkew skew;
 
    public:
     // ctor to initailize count
-    BondAlgoStreamingService() { count = 0; }
+    BondAlgoStreamingService() : count(0) {}
+
+    // skew the quotes with the positions and the risk
+    void SetInventory(BondPositionService* positions, BondRiskService* risk, const QuoteSkew& _skew = QuoteSkew()) {
+        skew = _skew;
+        for (auto& cusip : BondInfo::GetCUSIP()) inventory[cusip] = Inventory{&positions->GetAtomicPosition(cusip), &risk->GetUnitPV01Source(cusip)};
+    }
 
     // method to generate algo streams and notify all the listeners
     void PublishPrice(Price<Bond>& _price) {
         // get the bid/offer price
         double spread = _price.GetBidOfferSpread();
         double mid_price = _price.GetMid();
+        // lean against the inventory
+        auto itr = inventory.find(_price.GetProduct().GetProductId());
+        if (itr != inventory.end()) {
+            long position = itr->second.position->GetAggregatePosition();
+            double pv01 = position / 100.0 * itr->second.pv01->load(std::memory_order_relaxed);
+            double held = std::max(-1.0, std::min(1.0, pv01 / skew.pv01Limit));
+            mid_price -= held * skew.maxSkew * spread * 0.5;
+            spread += std::abs(held) * skew.maxWiden * spread;
+        }
         double bid_price = mid_price - spread * 0.5;
         double offer_price = mid_price + spread * 0.5;
         // Alternate visible sizes between 1000000 and 2000000
         // on subsequent updates for both sides
-        int visible_size = 1000000;
-        if (count == 0) {
-            visible_size = 2000000;
-            count = 1;
-        } else {
-            count = 0;
-        }
+        int visible_size = (count.fetch_xor(1) == 0) ? 2000000 : 1000000;
         // Hidden size should be twice the visible size at all times.
         int hidden_size = 2 * visible_size;
         // send the priceStreamOrder to the listeners
         PriceStreamOrder bid_order(bid_price, visible_size, hidden_size, BID);
         PriceStreamOrder offer_order(offer_price, visible_size, hidden_size, OFFER);
-        PriceStream<Bond> price_stream(_price.GetProduct(), bid_order, offer_order);
-        Service<string, PriceStream<Bond> >::Notify(price_stream);
+        Pooled<PriceStream<Bond> > price_stream(_price.GetProduct(), bid_order, offer_order);
+        Service<string, PriceStream<Bond> >::Notify(*price_stream);
     }
 };
 
@@ -183,6 +240,149 @@ class BondStreamingListener : public ServiceListener<PriceStream<Bond> > {
 };
 
 
+/**
+ * Publish policy of BondStreamingThrottle: a security is published at most
+ * once every minInterval, and all of them together at most maxRate times
+ * a second with bursts of maxBurst.
+ */
+struct StreamingThrottlePolicy {
+    long minInterval = 10;   // milliseconds
+    double maxRate = 1000.0;  // quotes per second
+    double maxBurst = 100.0;
+};
+
+/**
+ * Throttle between BondAlgoStreamingService and BondStreamingService
+ * bounding the rate of the price streams downstream, whatever the input:
+ *   - a quote the same as the last one published for its security (prices
+ *     and visible and hidden sizes of both sides) is dropped,
+ *   - a quote within minInterval of the last one of its security, or
+ *     over the token bucket of all the securities, is held back, and a
+ *     newer quote replaces it (conflation),
+ *   - the quotes held back go out as soon as they are allowed, on the
+ *     next quote or on Flush() from a timer, and all of them on
+ *     Flush(true) at the end of the run.
+ * The state of every security is in arrays indexed by BondInfo::GetIndex.
+ * The streams may come from several threads, the throttle takes a mutex.
+ */
+class BondStreamingThrottle : public ServiceListener<PriceStream<Bond> > {
+   private:
+    struct Security {
+        bool published;
+        double bid;
+        long bidVisible;
+        long bidHidden;
+        double offer;
+        long offerVisible;
+        long offerHidden;
+        std::chrono::steady_clock::time_point last;
+        bool held;
+    };
+
+    // whether a quote is the one last published for its security
+    static bool Same(const Security& security, const PriceStream<Bond>& stream) {
+        const PriceStreamOrder& bid = stream.GetBidOrder();
+        const PriceStreamOrder& offer = stream.GetOfferOrder();
+        return security.published && bid.GetPrice() == security.bid && bid.GetVisibleQuantity() == security.bidVisible &&
+               bid.GetHiddenQuantity() == security.bidHidden && offer.GetPrice() == security.offer &&
+               offer.GetVisibleQuantity() == security.offerVisible && offer.GetHiddenQuantity() == security.offerHidden;
+    }
+
+    BondStreamingService* service;
+    StreamingThrottlePolicy policy;
+    std::vector<Security> securities;
+    std::vector<std::unique_ptr<PriceStream<Bond> > > latest;
+    std::vector<int> pending;
+    double tokens;
+    std::chrono::steady_clock::time_point refill;
+    long published;
+    long unchanged;
+    long conflated;
+    std::mutex mutex;
+
+    // publish the quotes held back that are allowed now (all of them if forced)
+    void FlushLocked(bool force) {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - refill).count();
+        refill = now;
+        tokens = std::min(policy.maxBurst, tokens + elapsed * policy.maxRate);
+        size_t kept = 0;
+        for (size_t k = 0; k < pending.size(); ++k) {
+            int i = pending[k];
+            Security& security = securities[i];
+            if (!security.held) continue;  // reverted to the prices published
+            bool due = security.last + std::chrono::milliseconds(policy.minInterval) <= now;
+            if (!force && (!due || tokens < 1.0)) {
+                pending[kept++] = i;
+                continue;
+            }
+            tokens = std::max(0.0, tokens - 1.0);
+            const PriceStreamOrder& bid = latest[i]->GetBidOrder();
+            const PriceStreamOrder& offer = latest[i]->GetOfferOrder();
+            security = Security{true, bid.GetPrice(), bid.GetVisibleQuantity(), bid.GetHiddenQuantity(),
+                                offer.GetPrice(), offer.GetVisibleQuantity(), offer.GetHiddenQuantity(), now, false};
+            ++published;
+            service->PublishPrice(*latest[i]);
+        }
+        pending.resize(kept);
+    }
+
+   public:
+    BondStreamingThrottle(BondStreamingService* _service, const StreamingThrottlePolicy& _policy = StreamingThrottlePolicy())
+        : service(_service), policy(_policy), securities(BondInfo::GetCUSIP().size()), latest(BondInfo::GetCUSIP().size()),
+          tokens(_policy.maxBurst), refill(std::chrono::steady_clock::now()), published(0), unchanged(0), conflated(0) {
+        for (auto& security : securities) security = Security{false, 0.0, 0, 0, 0.0, 0, 0, std::chrono::steady_clock::time_point(), false};
+    }
+
+    virtual void ProcessAdd(PriceStream<Bond>& _priceStream) {
+        DEBUG_TEST("BondAlgoStreamingService -> BondStreamingThrottle\n");
+        int i = BondInfo::GetIndex(_priceStream.GetProduct().GetProductId());
+        if (i < 0) {
+            service->PublishPrice(_priceStream);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        Security& security = securities[i];
+        if (Same(security, _priceStream)) {
+            // nothing new, and whatever was held back is stale
+            if (security.held) ++conflated;
+            security.held = false;
+            ++unchanged;
+            return;
+        }
+        if (latest[i]) *latest[i] = _priceStream;
+        else latest[i].reset(new PriceStream<Bond>(_priceStream));
+        if (security.held) {
+            ++conflated;
+        } else {
+            security.held = true;
+            pending.push_back(i);
+        }
+        FlushLocked(false);
+    }
+    virtual void ProcessRemove(PriceStream<Bond>& _priceStream) {}
+    virtual void ProcessUpdate(PriceStream<Bond>& _priceStream) {}
+
+    // publish the quotes held back that are allowed now, or all of them (at the end of the run)
+    void Flush(bool force = false) {
+        std::lock_guard<std::mutex> lock(mutex);
+        FlushLocked(force);
+    }
+
+    // number of quotes published, dropped as unchanged and replaced while held back
+    long GetPublishedCount() const { return published; }
+    long GetUnchangedCount() const { return unchanged; }
+    long GetConflatedCount() const { return conflated; }
+
+    // number of quotes held back, none after Flush(true)
+    size_t GetHeldCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t held = 0;
+        for (const Security& security : securities) held += security.held ? 1 : 0;
+        return held;
+    }
+};
+
 /**
  * Bond Streaming Connector
  * to publish the streaming to another process via TCP/IP
@@ -193,10 +393,21 @@ class BondStreamingConnector : public Connector<PriceStream<Bond> > {
     std::string file_name;
     boost::asio::io_service io_service;
     tcp::socket socket;
+    // buffers reused across publications
+    std::string line;
+    std::string reply;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<LineWriter> writer;
 
    public:
     // ctor
-    explicit BondStreamingConnector(string file_name_, int port = 1237) : file_name(file_name_), socket(io_service) {
+    explicit BondStreamingConnector(string file_name_, int port = 1237, Reactor *reactor = nullptr) : file_name(file_name_), socket(io_service) {
+        if (reactor != nullptr) {
+            // asynchronous session on the reactor's event loop
+            writer.reset(MakeLineWriter(*reactor, file_name));
+            writer->Start(port);
+            return;
+        }
         
         // connection of the socket
         std::cout << "connecting to the " << file_name << "...";
@@ -211,20 +422,29 @@ class BondStreamingConnector : public Connector<PriceStream<Bond> > {
     // and prints them when it receives them.
     virtual void Publish(PriceStream<Bond> &_stream) {
         std::chrono::milliseconds ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-        std::string timestamp = std::to_string(ms.count());
-        std::string productId = _stream.GetProduct().GetProductId();
-        std::string bidPrice = BondInfo::FormatPrice(_stream.GetBidOrder().GetPrice());
-        std::string offerPrice = BondInfo::FormatPrice(_stream.GetOfferOrder().GetPrice());
-        std::string line = timestamp + "," + productId + "," + bidPrice + "," + offerPrice + "\n";
-        this->send_socket(socket, line + "\n");
-        auto success = this->read_socket(socket);
+        // timestamp,productId,bidPrice,offerPrice
+        line.clear();
+        line += std::to_string(ms.count());
+        line += ',';
+        line += _stream.GetProduct().GetProductId();
+        line += ',';
+        line += BondInfo::FormatPrice(_stream.GetBidOrder().GetPrice());
+        line += ',';
+        line += BondInfo::FormatPrice(_stream.GetOfferOrder().GetPrice());
+        line += '\n';
+        if (writer) {
+            writer->Write(line);
+        } else {
+            this->send_socket(socket, line);
+            this->read_socket(socket, reply);
+        }
         DEBUG_TEST("PriceStream<Bond> -> BondStreamingConnector\n");
         
     }
     // dtor, we need to kill the data_writer process by sending EOF
     ~BondStreamingConnector() {
         std::cout << "Finished, killing the data_writer (" << file_name << ") process" << std::endl;
-        this->send_socket(socket, "EOF\n");
+        if (!writer) this->send_socket(socket, "EOF\n");
     }
 };
 
@@ -0,0 +1,402 @@
+/**
+ * streamoperators.hpp
+ * Generic operators composing the Services of soa.hpp: keyed join of the
+ * latest values of two streams, tumbling and sliding window aggregates,
+ * filter and map.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef STREAM_OPERATORS_HPP
+#define STREAM_OPERATORS_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "soa.hpp"
+
+/**
+ * Running statistics of a window: every value comes with a weight
+ * (1 unless given), and adding or removing one is O(1).
+ */
+struct WindowStats {
+    long count = 0;
+    double sum = 0.0;
+    double sumSquares = 0.0;
+    double weight = 0.0;
+    double weightedSum = 0.0;
+    double last = 0.0;
+
+    void Add(double value, double w = 1.0) {
+        ++count;
+        sum += value;
+        sumSquares += value * value;
+        weight += w;
+        weightedSum += w * value;
+        last = value;
+    }
+
+    void Remove(double value, double w = 1.0) {
+        --count;
+        sum -= value;
+        sumSquares -= value * value;
+        weight -= w;
+        weightedSum -= w * value;
+    }
+
+    double Mean() const { return count > 0 ? sum / count : 0.0; }
+
+    // population variance, the rounding of the running sums can't make it negative
+    double Variance() const { return count > 0 ? std::max(0.0, sumSquares / count - Mean() * Mean()) : 0.0; }
+
+    double WeightedMean() const { return weight != 0.0 ? weightedSum / weight : 0.0; }
+};
+
+/**
+ * A window aggregate of a key, as published by the window operators.
+ * Type K is the key type.
+ */
+template <typename K>
+class Window {
+   public:
+    Window() {}
+    Window(const K &_key, const WindowStats &_stats) : key(_key), stats(_stats) {}
+
+    const K &GetKey() const { return key; }
+    const WindowStats &GetStats() const { return stats; }
+
+   private:
+    K key;
+    WindowStats stats;
+};
+
+/**
+ * Dense slots of the keys seen by an operator: a key is hashed once
+ * when an event comes in and its state lives in vectors at its slot.
+ * Type K is the key type.
+ */
+template <typename K>
+class KeySlots {
+   private:
+    std::unordered_map<K, size_t> slots;
+    std::vector<K> keys;
+
+   public:
+    // the slot of a key, and whether it is new
+    size_t Find(const K &key, bool *added = nullptr) {
+        auto itr = slots.find(key);
+        if (added != nullptr) *added = (itr == slots.end());
+        if (itr != slots.end()) return itr->second;
+        slots.emplace(key, keys.size());
+        keys.push_back(key);
+        return keys.size() - 1;
+    }
+
+    // the slot of a key, -1 if it was never seen
+    long Get(const K &key) const {
+        auto itr = slots.find(key);
+        return (itr != slots.end()) ? long(itr->second) : -1;
+    }
+
+    const K &GetKey(size_t slot) const { return keys[slot]; }
+    size_t GetSize() const { return keys.size(); }
+};
+
+/**
+ * Keyed join: keeps the latest value of every key on two streams A and B
+ * and, once a key has both, publishes combine(a, b) every time one of
+ * them ticks. Only the latest value of each side is kept.
+ * Keyed on K, with value the Out of combine.
+ */
+template <typename K, typename A, typename B, typename Out>
+class KeyedJoin : public Service<K, Out> {
+   private:
+    std::function<K(const A &)> keyOfA;
+    std::function<K(const B &)> keyOfB;
+    std::function<Out(const A &, const B &)> combine;
+    KeySlots<K> slots;
+    std::vector<std::unique_ptr<A> > left;
+    std::vector<std::unique_ptr<B> > right;
+    std::vector<std::unique_ptr<Out> > joined;
+    std::mutex mutex;
+
+    template <typename T>
+    static void Store(std::unique_ptr<T> &slot, const T &value) {
+        if (slot) *slot = value;
+        else slot.reset(new T(value));
+    }
+
+    size_t Slot(const K &key) {
+        size_t slot = slots.Find(key);
+        if (slot == left.size()) {
+            left.emplace_back();
+            right.emplace_back();
+            joined.emplace_back();
+        }
+        return slot;
+    }
+
+    void Emit(size_t slot) {
+        if (!left[slot] || !right[slot]) return;
+        Store(joined[slot], combine(*left[slot], *right[slot]));
+        this->Notify(*joined[slot]);
+    }
+
+   public:
+    KeyedJoin(std::function<K(const A &)> _keyOfA, std::function<K(const B &)> _keyOfB, std::function<Out(const A &, const B &)> _combine)
+        : keyOfA(_keyOfA), keyOfB(_keyOfB), combine(_combine) {}
+
+    // a value of the left stream
+    void OnLeft(const A &a) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t slot = Slot(keyOfA(a));
+        Store(left[slot], a);
+        Emit(slot);
+    }
+
+    // a value of the right stream
+    void OnRight(const B &b) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t slot = Slot(keyOfB(b));
+        Store(right[slot], b);
+        Emit(slot);
+    }
+
+    // the latest joined value of a key, nullptr until both sides have ticked
+    const Out *Get(const K &key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        long slot = slots.Get(key);
+        return (slot >= 0) ? joined[slot].get() : nullptr;
+    }
+};
+
+/**
+ * Listener passing a stream to the left side of a KeyedJoin
+ */
+template <typename K, typename A, typename B, typename Out>
+class KeyedJoinLeftListener : public ServiceListener<A> {
+   private:
+    KeyedJoin<K, A, B, Out> *join;
+
+   public:
+    explicit KeyedJoinLeftListener(KeyedJoin<K, A, B, Out> *_join) : join(_join) {}
+    virtual void ProcessAdd(A &_data) { join->OnLeft(_data); }
+    virtual void ProcessRemove(A &_data) {}
+    virtual void ProcessUpdate(A &_data) {}
+};
+
+/**
+ * Listener passing a stream to the right side of a KeyedJoin
+ */
+template <typename K, typename A, typename B, typename Out>
+class KeyedJoinRightListener : public ServiceListener<B> {
+   private:
+    KeyedJoin<K, A, B, Out> *join;
+
+   public:
+    explicit KeyedJoinRightListener(KeyedJoin<K, A, B, Out> *_join) : join(_join) {}
+    virtual void ProcessAdd(B &_data) { join->OnRight(_data); }
+    virtual void ProcessRemove(B &_data) {}
+    virtual void ProcessUpdate(B &_data) {}
+};
+
+/**
+ * Tumbling window: aggregates the values of every key in consecutive,
+ * non overlapping windows of ms milliseconds (or of count values), and
+ * publishes the aggregate of a window when it closes. A window closes
+ * on the first value of its key past its end, or on Flush() from a timer.
+ * Keyed on K, with value the Window<K> of a key.
+ */
+template <typename K, typename V>
+class TumblingWindow : public Service<K, Window<K> > {
+   private:
+    struct State {
+        WindowStats stats;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    std::function<K(const V &)> keyOf;
+    std::function<double(const V &)> valueOf;
+    std::function<double(const V &)> weightOf;
+    std::chrono::milliseconds interval;
+    long count;
+    KeySlots<K> slots;
+    std::vector<State> states;
+    std::mutex mutex;
+
+    void Close(size_t slot, std::chrono::steady_clock::time_point now) {
+        State &state = states[slot];
+        if (state.stats.count > 0) {
+            Window<K> window(slots.GetKey(slot), state.stats);
+            this->Notify(window);
+        }
+        state.stats = WindowStats();
+        state.start = now;
+    }
+
+   public:
+    // ctor, windows of ms milliseconds (0 for no time limit) and of count values (0 for no count limit);
+    // the weight defaults to 1
+    TumblingWindow(std::function<K(const V &)> _keyOf, std::function<double(const V &)> _valueOf, long ms, long _count = 0,
+                   std::function<double(const V &)> _weightOf = nullptr)
+        : keyOf(_keyOf), valueOf(_valueOf), weightOf(_weightOf), interval(ms), count(_count) {}
+
+    virtual void OnMessage(V &data) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        bool added;
+        size_t slot = slots.Find(keyOf(data), &added);
+        if (added) states.push_back(State{WindowStats(), now});
+        State &state = states[slot];
+        if (interval.count() > 0 && now - state.start >= interval) Close(slot, now);
+        states[slot].stats.Add(valueOf(data), weightOf ? weightOf(data) : 1.0);
+        if (count > 0 && states[slot].stats.count >= count) Close(slot, now);
+    }
+
+    // close the windows past their end (all of them if forced)
+    void Flush(bool force = false) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t slot = 0; slot < states.size(); ++slot)
+            if (force || (interval.count() > 0 && now - states[slot].start >= interval)) Close(slot, now);
+    }
+};
+
+/**
+ * Sliding window: aggregates the last size values of every key (and only
+ * those younger than ms milliseconds if ms > 0), and publishes the
+ * aggregate on every value. The values of a key are in a ring buffer of
+ * size entries and the aggregate is a running sum: a value in, the oldest
+ * ones out, O(1) per value.
+ * Keyed on K, with value the Window<K> of a key.
+ */
+template <typename K, typename V>
+class SlidingWindow : public Service<K, Window<K> > {
+   private:
+    struct Entry {
+        double value;
+        double weight;
+        std::chrono::steady_clock::time_point time;
+    };
+
+    struct State {
+        WindowStats stats;
+        size_t head;  // oldest entry
+    };
+
+    std::function<K(const V &)> keyOf;
+    std::function<double(const V &)> valueOf;
+    std::function<double(const V &)> weightOf;
+    size_t size;
+    std::chrono::milliseconds age;
+    KeySlots<K> slots;
+    std::vector<State> states;
+    std::vector<Entry> rings;  // keys x size
+    std::mutex mutex;
+
+    void Evict(size_t slot, std::chrono::steady_clock::time_point now) {
+        State &state = states[slot];
+        while (state.stats.count > 0) {
+            Entry &oldest = rings[slot * size + state.head];
+            if (size_t(state.stats.count) < size && (age.count() == 0 || now - oldest.time < age)) break;
+            state.stats.Remove(oldest.value, oldest.weight);
+            state.head = (state.head + 1) % size;
+        }
+    }
+
+   public:
+    // ctor, windows of the last size values younger than ms milliseconds (0 for no age limit);
+    // the weight defaults to 1
+    SlidingWindow(std::function<K(const V &)> _keyOf, std::function<double(const V &)> _valueOf, size_t _size, long ms = 0,
+                  std::function<double(const V &)> _weightOf = nullptr)
+        : keyOf(_keyOf), valueOf(_valueOf), weightOf(_weightOf), size(std::max<size_t>(1, _size)), age(ms) {}
+
+    virtual void OnMessage(V &data) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        bool added;
+        size_t slot = slots.Find(keyOf(data), &added);
+        if (added) {
+            states.push_back(State{WindowStats(), 0});
+            rings.resize(rings.size() + size);
+        }
+        // make room, then append at the tail
+        Evict(slot, now);
+        State &state = states[slot];
+        double value = valueOf(data);
+        double weight = weightOf ? weightOf(data) : 1.0;
+        rings[slot * size + (state.head + state.stats.count) % size] = Entry{value, weight, now};
+        state.stats.Add(value, weight);
+        Window<K> window(slots.GetKey(slot), state.stats);
+        this->Notify(window);
+    }
+
+    // the aggregate of a key over the window as of now, without publishing it
+    WindowStats Get(const K &key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        long slot = slots.Get(key);
+        if (slot < 0) return WindowStats();
+        // the age limit applies as of now
+        State &state = states[slot];
+        WindowStats stats = state.stats;
+        size_t head = state.head;
+        auto now = std::chrono::steady_clock::now();
+        while (age.count() > 0 && stats.count > 0 && now - rings[slot * size + head].time >= age) {
+            const Entry &oldest = rings[slot * size + head];
+            stats.Remove(oldest.value, oldest.weight);
+            head = (head + 1) % size;
+        }
+        return stats;
+    }
+};
+
+/**
+ * Filter and map: publishes map(data) for the data passing filter.
+ * Either may be left out (every data passes, the data is published as is
+ * when In and Out are the same type).
+ * Keyed on K, with value Out.
+ */
+template <typename K, typename In, typename Out = In>
+class FilterMap : public Service<K, Out> {
+   private:
+    std::function<bool(const In &)> filter;
+    std::function<Out(const In &)> map;
+
+   public:
+    FilterMap(std::function<bool(const In &)> _filter, std::function<Out(const In &)> _map = nullptr) : filter(_filter), map(_map) {}
+
+    virtual void OnMessage(In &data) {
+        if (filter && !filter(data)) return;
+        if (map) {
+            Out out = map(data);
+            this->Notify(out);
+        } else if constexpr (std::is_same<In, Out>::value) {
+            this->Notify(data);
+        }
+    }
+};
+
+/**
+ * Listener passing a stream to the OnMessage() of an operator
+ * (a window or a FilterMap)
+ */
+template <typename V, typename Op>
+class OperatorListener : public ServiceListener<V> {
+   private:
+    Op *op;
+
+   public:
+    explicit OperatorListener(Op *_op) : op(_op) {}
+    virtual void ProcessAdd(V &_data) { op->OnMessage(_data); }
+    virtual void ProcessRemove(V &_data) {}
+    virtual void ProcessUpdate(V &_data) {}
+};
+
+#endif
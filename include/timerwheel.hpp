@@ -0,0 +1,155 @@
+/**
+ * timerwheel.hpp
+ * Hierarchical timer wheel: schedules and cancels timers in O(1)
+ * and fires them as the time advances.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Hierarchical timer wheel with kLevels wheels of kSlots slots: the slot
+ * of the first wheel is one tick, the slot of every next wheel the whole
+ * span of the wheel below, so the timers up to kSlots^kLevels ticks away
+ * (16.7M, over 4 hours of 1ms ticks) fit in kLevels * kSlots lists.
+ * A timer is a node of a pool allocated as needed and recycled, linked
+ * in the list of its slot, so scheduling and cancelling it are O(1);
+ * when the first wheel wraps around, the slot of the next wheel whose
+ * time has come is cascaded down. A timer carries a 64-bit payload given
+ * back to the callback of Advance, and its handle is the node index and
+ * a generation so that a stale handle can't cancel the node's next timer.
+ * Not thread safe, the wheel belongs to the thread advancing it.
+ */
+class TimerWheel {
+   public:
+    typedef uint64_t Handle;
+    static const Handle kNoTimer = UINT64_MAX;
+    static const int kBits = 6;
+    static const int kSlots = 1 << kBits;
+    static const int kLevels = 4;
+    static const uint64_t kMaxDelay = (uint64_t(1) << (kBits * kLevels)) - 1;
+
+   private:
+    static const uint32_t kNil = UINT32_MAX;
+
+    struct Node {
+        uint32_t prev;
+        uint32_t next;
+        uint32_t generation;
+        int slot;  // index in heads, -1 when free
+        uint64_t expiry;
+        uint64_t payload;
+    };
+
+    std::vector<Node> pool;
+    uint32_t freeList;
+    std::vector<uint32_t> heads;  // levels x slots
+    uint64_t now;
+    size_t size;
+
+    void Link(uint32_t node) {
+        Node &timer = pool[node];
+        uint64_t delta = timer.expiry - now;
+        int level = 0;
+        while (level + 1 < kLevels && delta >= (uint64_t(1) << (kBits * (level + 1)))) ++level;
+        int slot = level * kSlots + int((timer.expiry >> (kBits * level)) & (kSlots - 1));
+        timer.slot = slot;
+        timer.prev = kNil;
+        timer.next = heads[slot];
+        if (timer.next != kNil) pool[timer.next].prev = node;
+        heads[slot] = node;
+    }
+
+    void Unlink(uint32_t node) {
+        Node &timer = pool[node];
+        if (timer.prev != kNil) pool[timer.prev].next = timer.next;
+        else heads[timer.slot] = timer.next;
+        if (timer.next != kNil) pool[timer.next].prev = timer.prev;
+    }
+
+    void Release(uint32_t node) {
+        pool[node].slot = -1;
+        ++pool[node].generation;
+        pool[node].next = freeList;
+        freeList = node;
+        --size;
+    }
+
+    // move the timers of a slot of an upper wheel down to the wheels below
+    void Cascade(int level) {
+        int slot = level * kSlots + int((now >> (kBits * level)) & (kSlots - 1));
+        uint32_t node = heads[slot];
+        heads[slot] = kNil;
+        while (node != kNil) {
+            uint32_t next = pool[node].next;
+            Link(node);
+            node = next;
+        }
+    }
+
+   public:
+    // ctor, the time starts at start ticks with room for capacity timers before the pool grows
+    explicit TimerWheel(uint64_t start = 0, size_t capacity = 1024) : freeList(kNil), heads(kLevels * kSlots, kNil), now(start), size(0) {
+        pool.reserve(capacity);
+    }
+
+    // schedule a timer delay ticks from now (at least one, at most kMaxDelay)
+    Handle Schedule(uint64_t delay, uint64_t payload) {
+        if (delay == 0) delay = 1;
+        if (delay > kMaxDelay) delay = kMaxDelay;
+        uint32_t node = freeList;
+        if (node != kNil) {
+            freeList = pool[node].next;
+        } else {
+            node = uint32_t(pool.size());
+            pool.push_back(Node{kNil, kNil, 0, -1, 0, 0});
+        }
+        pool[node].expiry = now + delay;
+        pool[node].payload = payload;
+        Link(node);
+        ++size;
+        return (Handle(pool[node].generation) << 32) | node;
+    }
+
+    // cancel a timer, false if it has already fired or been cancelled
+    bool Cancel(Handle handle) {
+        if (handle == kNoTimer) return false;
+        uint32_t node = uint32_t(handle);
+        if (node >= pool.size() || pool[node].generation != uint32_t(handle >> 32) || pool[node].slot < 0) return false;
+        Unlink(node);
+        Release(node);
+        return true;
+    }
+
+    // advance the time to time ticks, calling fire(payload) for every timer expiring on the way;
+    // fire may schedule and cancel timers
+    template <typename F>
+    void Advance(uint64_t time, F &&fire) {
+        while (now < time) {
+            ++now;
+            // the first wheel wrapped around, bring down the timers of the upper wheels now due
+            for (int level = 1; level < kLevels && ((now >> (kBits * (level - 1))) & (kSlots - 1)) == 0; ++level) Cascade(level);
+            int slot = int(now & (kSlots - 1));
+            while (heads[slot] != kNil) {
+                uint32_t node = heads[slot];
+                uint64_t payload = pool[node].payload;
+                Unlink(node);
+                Release(node);
+                fire(payload);
+            }
+        }
+    }
+
+    // the current time in ticks
+    uint64_t GetTime() const { return now; }
+
+    // number of timers scheduled
+    size_t GetSize() const { return size; }
+};
+
+#endif
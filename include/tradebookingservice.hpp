@@ -7,14 +7,21 @@
 #ifndef TRADE_BOOKING_SERVICE_HPP
 #define TRADE_BOOKING_SERVICE_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <boost/date_time/gregorian/gregorian.hpp>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "bondinfo.hpp"
+#include "bookregistry.hpp"
+#include "coroconnector.hpp"
 #include "executionservice.hpp"
+#include "objectpool.hpp"
 #include "products.hpp"
+#include "settlement.hpp"
 #include "soa.hpp"
 
 // Trade sides
@@ -28,11 +35,26 @@ enum Side { BUY,
 template <typename T>
 class Trade {
    public:
-    // ctor for a trade
-    Trade(const T& _product, string _tradeId, double _price, string _book, long _quantity, Side _side) : product(_product) {
+    // ctor for a trade, on the book of id _bookId in the BookRegistry
+    // (resolved once by the caller, not per trade)
+    Trade(const T& _product, string _tradeId, double _price, string _book, int _bookId, long _quantity, Side _side) : product(_product) {
         tradeId = _tradeId;
         price = _price;
+        dirtyPrice = _price;
         book = _book;
+        bookId = _bookId;
+        quantity = _quantity;
+        side = _side;
+    }
+
+    // Overwrite the trade in place when recycled by an ObjectPool
+    void Reset(const T& _product, const string& _tradeId, double _price, const string& _book, int _bookId, long _quantity, Side _side) {
+        product = _product;
+        tradeId = _tradeId;
+        price = _price;
+        dirtyPrice = _price;
+        book = _book;
+        bookId = _bookId;
         quantity = _quantity;
         side = _side;
     }
@@ -46,9 +68,18 @@ class Trade {
     // Get the mid price
     double GetPrice() const { return price; }
 
+    // Get the dirty price (the price plus the accrued interest at settlement), the price until booked
+    double GetDirtyPrice() const { return dirtyPrice; }
+
+    // Set the dirty price, when booked
+    void SetDirtyPrice(double _dirtyPrice) { dirtyPrice = _dirtyPrice; }
+
     // Get the book
     const string& GetBook() const { return book; }
 
+    // Get the id of the book in the BookRegistry
+    int GetBookId() const { return bookId; }
+
     // Get the quantity
     long GetQuantity() const { return quantity; }
 
@@ -59,7 +90,9 @@ class Trade {
     T product;
     string tradeId;
     double price;
+    double dirtyPrice;
     string book;
+    int bookId;
     long quantity;
     Side side;
 };
@@ -86,21 +119,50 @@ class TradeBookingService : public Service<string, Trade<T> > {
 
 class BondTradeBookingService : public TradeBookingService<Bond> {
    private:
-    std::map<string, Trade<Bond> > trades;
+    // the last kMaxTrades trades, the map nodes come from the map's own node arena
+    static const size_t kMaxTrades = 1024;
+    std::map<string, Trade<Bond>, std::less<string>, PoolAllocator<std::pair<const string, Trade<Bond> > > > trades;
+    // trade ids in the order they were booked, the oldest at next once full
+    std::vector<string> booked;
+    size_t next = 0;
+    // the dirty prices of the trades come from the settlement engine if given
+    const SettlementEngine* settlement = nullptr;
+
+    // the price plus the accrued interest settling T+1
+    void Settle(Trade<Bond>& _trade) {
+        if (settlement != nullptr) _trade.SetDirtyPrice(settlement->GetDirtyPrice(_trade.GetProduct(), _trade.GetPrice()));
+    }
 
    public:
+    // stamp the dirty price of the settlement engine on every booked trade
+    void SetSettlement(const SettlementEngine* _settlement) { settlement = _settlement; }
+
     // Book the trade
     void BookTrade(Trade<Bond>& _trade) {
+        Settle(_trade);
         this->Notify(_trade);
     }
-    // get the trade data
+    // get the trade data (one of the last kMaxTrades trades)
     virtual Trade<Bond>& GetData(string key) {
         return trades.find(key)->second;
     }
     // update the trades map and notify the listeners
     virtual void OnMessage(Trade<Bond>& _trade) {
-        trades.erase(_trade.GetTradeId());
-        trades.insert(std::make_pair(_trade.GetTradeId(), _trade));
+        Settle(_trade);
+        auto itr = trades.find(_trade.GetTradeId());
+        if (itr != trades.end()) {
+            itr->second = _trade;
+        } else {
+            // forget the oldest trade to make room
+            if (booked.size() < kMaxTrades) {
+                booked.push_back(_trade.GetTradeId());
+            } else {
+                trades.erase(booked[next]);
+                booked[next] = _trade.GetTradeId();
+                next = (next + 1) % kMaxTrades;
+            }
+            trades.insert(std::make_pair(_trade.GetTradeId(), _trade));
+        }
         this->Notify(_trade);
     }
 };
@@ -110,10 +172,17 @@ class BondTradeBookingService : public TradeBookingService<Bond> {
  * Keyed on trade id.
  * Type T is the product type (Bond).
  */
-class BondTradeBookingConnector : public Connector<Trade<Bond> > {
+class BondTradeBookingConnector : public CoroConnector<Trade<Bond> > {
    private:
     string file_name;
     BondTradeBookingService* trade_booking_service;
+    // buffers reused across records
+    string line;
+    std::vector<std::string> tokens;
+    // the books seen so far with their ids, a handful so a linear scan beats a lookup in the registry
+    std::vector<std::pair<std::string, int> > books;
+    // session on the reactor (reactor mode only)
+    std::unique_ptr<AsyncLineReader> reader;
 
    public:
     explicit BondTradeBookingConnector(string _file_name,
@@ -134,34 +203,103 @@ class BondTradeBookingConnector : public Connector<Trade<Bond> > {
         file_name += "\n";
         send_socket(socket, file_name);
 
-        string line = read_socket(socket);
+        read_socket(socket, line);
 
         trim(line);
         std::cout << "success" << std::endl;
         while (line != "EOF") {
-            // parse the line
-            std::vector<std::string> tokens = this->split(line, ',');
-            std::string productId = tokens[0];
-            std::string tradeId = tokens[1];
-            std::string book = tokens[2];
-            double price = atof(tokens[3].c_str());
-            Side side = tokens[4] == "BUY" ? BUY : SELL;
-            long quantity = atol(tokens[5].c_str());
-
-            double coupon = BondInfo::CUSIPToCoupon(productId);
-            boost::gregorian::date* maturityPtr = BondInfo::CUSIPToDate(productId);
-
-            Bond bond(productId, CUSIP, "T", coupon, *maturityPtr);
-            Trade<Bond> trade(bond, tradeId, price, book, quantity, side);
-            // For each trade, call Service.OnMessage() once to pass this piece of data.
-            trade_booking_service->OnMessage(trade);
-            DEBUG_TEST("side = %s -> BondTradeBookingService\n", tokens[4].c_str());
+            ProcessLine(line);
             // request for another line to the server
             send_socket(socket, file_name);
-            line = read_socket(socket);
+            read_socket(socket, line);
             trim(line);
         }
     }
+
+    // subscribe on the reactor's event loop instead of blocking on the socket
+    void Subscribe(Reactor& reactor, int port) {
+        reader.reset(new AsyncLineReader(reactor, file_name, [this](std::string& _line) { ProcessLine(_line); }));
+        reader->Start(port);
+    }
+
+    // subscribe as a coroutine on the reactor's event loop, run it with CoroConnector::Spawn
+    awaitable<void> CoSubscribe(int port) {
+        LineSocket socket(co_await boost::asio::this_coro::executor);
+        co_await socket.Connect(port);
+        std::string request = file_name + "\n";
+        co_await socket.WriteLine(request);
+        co_await socket.ReadLine(line);
+        std::cout << "connecting to the " << file_name << "...success" << std::endl;
+        while (line != "EOF") {
+            ProcessLine(line);
+            // request for another line to the server
+            co_await socket.WriteLine(request);
+            co_await socket.ReadLine(line);
+        }
+    }
+
+    // id of a book in the BookRegistry, resolved once per book
+    int BookId(const std::string& book) {
+        for (auto& known : books)
+            if (known.first == book) return known.second;
+        books.emplace_back(book, BookRegistry::GetId(book));
+        return books.back().second;
+    }
+
+    // parse one line of trades.txt and pass it to the service
+    void ProcessLine(const std::string& line) {
+        AllocationCounter::RecordEvent();
+        // parse the line
+        this->split(line, ',', tokens);
+        const std::string& productId = tokens[0];
+        const std::string& tradeId = tokens[1];
+        const std::string& book = tokens[2];
+        double price = atof(tokens[3].c_str());
+        Side side = tokens[4] == "BUY" ? BUY : SELL;
+        long quantity = atol(tokens[5].c_str());
+
+        // recycled from the per-thread pool
+        Pooled<Trade<Bond> > trade(*BondInfo::GetBond(productId), tradeId, price, book, BookId(book), quantity, side);
+        // For each trade, call Service.OnMessage() once to pass this piece of data.
+        trade_booking_service->OnMessage(*trade);
+        DEBUG_TEST("side = %s -> BondTradeBookingService\n", tokens[4].c_str());
+    }
+};
+
+/**
+ * Rotation of the books the executions are booked in: TRSY2, TRSY3,
+ * TRSY1, TRSY2, ... one step per order booked without a book. The stages
+ * choosing the book of an order upstream (the slicing of a parent order,
+ * the pre-trade checks) take it from the rotation of the trade booking
+ * listener, so the orders go to the same books with or without them.
+ */
+class BookRotation {
+   private:
+    std::vector<int> bookIds;
+    std::atomic<long> count;
+
+   public:
+    BookRotation() : count(0) {
+        for (auto& book : GetBooks()) bookIds.push_back(BookRegistry::GetId(book));
+    }
+
+    // the books of the rotation, TRSY1, TRSY2, TRSY3
+    static const std::vector<std::string>& GetBooks() {
+        static const std::vector<std::string> books = {"TRSY1", "TRSY2", "TRSY3"};
+        return books;
+    }
+
+    // the BookRegistry ids of the books, in the order of GetBooks()
+    const std::vector<int>& GetBookIds() const { return bookIds; }
+
+    // position of a book id in GetBookIds(), GetBookIds().size() if it isn't one of them
+    size_t Slot(int bookId) const { return std::find(bookIds.begin(), bookIds.end(), bookId) - bookIds.begin(); }
+
+    // the next book (as a slot of GetBookIds()), without taking it
+    size_t Peek() const { return size_t(count.load(std::memory_order_relaxed) + 1) % bookIds.size(); }
+
+    // take the next book
+    size_t Next() { return size_t(count.fetch_add(1, std::memory_order_relaxed) + 1) % bookIds.size(); }
 };
 
 /**
@@ -172,24 +310,30 @@ class BondTradeBookingConnector : public Connector<Trade<Bond> > {
 class BondTradeBookingListener : public ServiceListener<ExecutionOrder<Bond> > {
    private:
     BondTradeBookingService* service;
-    int count;  // counter to alternate the book
+    BookRotation rotation;
 
    public:
-    explicit BondTradeBookingListener(BondTradeBookingService* _service) : service(_service), count(0) {}
+    explicit BondTradeBookingListener(BondTradeBookingService* _service) : service(_service) {}
+
+    // the books the executions are booked in, TRSY1, TRSY2, TRSY3
+    static const std::vector<std::string>& GetBooks() { return BookRotation::GetBooks(); }
+
+    // the rotation of the books, to choose the book of an order upstream
+    BookRotation& GetRotation() { return rotation; }
 
     // Each execution should result in a trade into
     // the BondTradeBookingService via ServiceListener on BondExectionService
     virtual void ProcessAdd(ExecutionOrder<Bond>& _order) {
-        Bond product = _order.GetProduct();
-        std::string tradeId = _order.GetOrderId();
         double price = _order.GetPrice();
-        count = count + 1;
-        std::string book = "TRSY" + std::string(to_string(1 + count % 3));
+        // the book chosen upstream (by the slicing or the pre-trade checks) if any,
+        // otherwise the next of the rotation
+        size_t book = rotation.Slot(_order.GetBookId());
+        if (book == rotation.GetBookIds().size()) book = rotation.Next();
         long quantity = _order.GetVisibleQuantity();
         PricingSide side = _order.GetPricingSide();
         Side order_side = (side == BID) ? BUY : SELL;
-        Trade<Bond> trade(product, tradeId, price, book, quantity, order_side);
-        service->BookTrade(trade);
+        Pooled<Trade<Bond> > trade(_order.GetProduct(), _order.GetOrderId(), price, GetBooks()[book], rotation.GetBookIds()[book], quantity, order_side);
+        service->BookTrade(*trade);
         DEBUG_TEST("BondExecutionService -> BondTradeBookingService\n");
     }
 
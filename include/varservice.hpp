@@ -0,0 +1,299 @@
+/**
+ * varservice.hpp
+ * Defines the data types and Service for the Monte Carlo value at risk
+ * of the positions, per book and in aggregate.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef VAR_SERVICE_HPP
+#define VAR_SERVICE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bondanalytics.hpp"
+#include "bookregistry.hpp"
+#include "bondinfo.hpp"
+#include "positionservice.hpp"
+#include "products.hpp"
+#include "pricingservice.hpp"
+#include "soa.hpp"
+#include "yieldcurveservice.hpp"
+
+/**
+ * Value at risk and expected shortfall of a book (or of all of them).
+ */
+class ValueAtRisk {
+   public:
+    // ctor for a VaR figure
+    ValueAtRisk(const std::string &_name, double _confidence, double _var, double _es, int _paths)
+        : name(_name), confidence(_confidence), var(_var), es(_es), paths(_paths) {}
+
+    // Overwrite the figure in place
+    void Reset(double _var, double _es) {
+        var = _var;
+        es = _es;
+    }
+
+    // Get the name of the book, or "Aggregate"
+    const std::string &GetName() const { return name; }
+
+    // Get the confidence level
+    double GetConfidence() const { return confidence; }
+
+    // Get the VaR (a loss, positive)
+    double GetVaR() const { return var; }
+
+    // Get the expected shortfall beyond the VaR (a loss, positive)
+    double GetExpectedShortfall() const { return es; }
+
+    // Get the number of simulated paths
+    int GetPaths() const { return paths; }
+
+   private:
+    std::string name;
+    double confidence;
+    double var;
+    double es;
+    int paths;
+};
+
+/**
+ * VaR Service listening to BondPositionService and BondPricingService.
+ * Simulate() draws daily yield moves correlated across the curve
+ * (correlation exp(-|Ti - Tj| / kDecorrelation), Cholesky factored),
+ * revalues one unit of every security on every path from the par yields
+ * of the live curve of YieldCurveService, and keeps the unit PnL as one
+ * contiguous row of paths per security. The PnL of a book is the row of paths
+ *     pnl_b = sum_i q_bi * unit_i
+ * so a position change only adds delta * unit_i to the rows of its book
+ * and of the aggregate. The VaR is a quantile of those rows, taken on
+ * demand by GetData(); the paths are redrawn around the curve (and the
+ * figures published) every refresh price ticks.
+ * The paths are generated in blocks, each with its own mt19937_64 seeded
+ * from the seed and the block, and the blocks are split across threads,
+ * so the result doesn't depend on the number of threads.
+ * Keyed on book name ("Aggregate" for all the books).
+ */
+class VaRService : public Service<std::string, ValueAtRisk> {
+   public:
+    static constexpr double kDailyVol = 6e-4;        // daily yield vol, 6bp
+    static constexpr double kDecorrelation = 15.0;   // years
+    static const int kBlock = 1024;                  // paths per RNG stream
+
+   private:
+    const BondAnalytics *analytics;
+    YieldCurveService *curves;
+    int paths;
+    double confidence;
+    unsigned long seed;
+    int num_threads;
+    size_t size;
+    std::vector<double> cholesky;  // lower triangular, size x size
+    std::vector<double> unit;      // securities x paths
+    // quantities and PnL rows of the books by BookRegistry id, then the aggregate
+    std::vector<std::vector<long> > quantities;
+    std::vector<std::vector<double> > pnl;
+    std::vector<double> aggregate;
+    std::map<std::string, ValueAtRisk> results;
+    std::vector<double> scratch;
+    // par yields of the curve the paths are drawn around
+    std::vector<double> yields;
+    // price ticks between two simulations, and since the last one
+    long refresh;
+    long ticks;
+    std::mutex mutex;
+
+    void Factor() {
+        cholesky.assign(size * size, 0.0);
+        for (size_t i = 0; i < size; ++i) {
+            for (size_t j = 0; j <= i; ++j) {
+                double corr = std::exp(-std::fabs(analytics->GetYearsToMaturity(i) - analytics->GetYearsToMaturity(j)) / kDecorrelation);
+                double sum = corr;
+                for (size_t k = 0; k < j; ++k) sum -= cholesky[i * size + k] * cholesky[j * size + k];
+                cholesky[i * size + j] = (i == j) ? std::sqrt(std::max(sum, 0.0)) : sum / cholesky[j * size + j];
+            }
+        }
+    }
+
+    // unit PnL of the paths in blocks [begin, end)
+    void Generate(int begin, int end) {
+        std::vector<double> z(size), base(size), c(size), m(size), n(size), y(size);
+        for (size_t i = 0; i < size; ++i) {
+            c[i] = analytics->GetCoupon(i);
+            m[i] = analytics->GetPeriods(i);
+            n[i] = analytics->GetCouponCount(i);
+            y[i] = yields[i];
+            double slope;
+            BondAnalytics::PriceAndSlope(c[i], m[i], n[i], y[i], base[i], slope);
+        }
+        for (int block = begin; block < end; ++block) {
+            std::mt19937_64 rng(seed + block);
+            std::normal_distribution<double> normal;
+            int last = std::min(paths, (block + 1) * kBlock);
+            for (int p = block * kBlock; p < last; ++p) {
+                for (size_t i = 0; i < size; ++i) z[i] = normal(rng);
+                for (size_t i = 0; i < size; ++i) {
+                    double dy = 0.0;
+                    for (size_t k = 0; k <= i; ++k) dy += cholesky[i * size + k] * z[k];
+                    double price, slope;
+                    BondAnalytics::PriceAndSlope(c[i], m[i], n[i], y[i] + kDailyVol * dy, price, slope);
+                    unit[i * paths + p] = (price - base[i]) / 100.0;
+                }
+            }
+        }
+    }
+
+    // row += delta * unit row of security i
+    void Accumulate(std::vector<double> &row, size_t i, double delta) {
+        const double *u = &unit[i * paths];
+        double *r = row.data();
+        for (int p = 0; p < paths; ++p) r[p] += delta * u[p];
+    }
+
+    // make room for the books registered since the last call
+    void Grow() {
+        size_t books = size_t(BookRegistry::GetCount());
+        while (quantities.size() < books) {
+            quantities.push_back(std::vector<long>(size, 0));
+            pnl.push_back(std::vector<double>(paths, 0.0));
+        }
+    }
+
+    // quantile and tail mean of a PnL row, into the figure of its name
+    ValueAtRisk &Compute(const std::string &name, const std::vector<double> &row) {
+        scratch = row;
+        size_t k = size_t((1.0 - confidence) * paths);
+        std::nth_element(scratch.begin(), scratch.begin() + k, scratch.end());
+        double tail = 0.0;
+        for (size_t p = 0; p <= k; ++p) tail += scratch[p];
+        auto itr = results.find(name);
+        if (itr == results.end()) itr = results.insert(std::make_pair(name, ValueAtRisk(name, confidence, 0.0, 0.0, paths))).first;
+        itr->second.Reset(-scratch[k], -tail / double(k + 1));
+        return itr->second;
+    }
+
+   public:
+    // ctor, the securities are those of the analytics engine, the pillars of the curve;
+    // the paths are redrawn every _refresh price ticks, num_threads = 0 for one thread per core
+    VaRService(const BondAnalytics *_analytics, YieldCurveService *_curves, int _paths = 10000, double _confidence = 0.99, unsigned long _seed = 20201215,
+               long _refresh = 5000, int _num_threads = 0)
+        : analytics(_analytics), curves(_curves), paths(_paths), confidence(_confidence), seed(_seed), num_threads(_num_threads), size(_analytics->GetSize()),
+          yields(_analytics->GetSize()), refresh(_refresh), ticks(0) {
+        if (num_threads <= 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+        unit.resize(size * paths);
+        aggregate.assign(paths, 0.0);
+        Factor();
+        Simulate();
+    }
+
+    // redraw the paths around the current curve, rebuild the PnL of the books and publish their VaR
+    void Simulate() {
+        const YieldCurve &curve = curves->GetData("");
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < size; ++i) yields[i] = curve.GetParYield(i);
+        ticks = 0;
+        int blocks = (paths + kBlock - 1) / kBlock;
+        int chunk = (blocks + num_threads - 1) / num_threads;
+        std::vector<std::thread> threads;
+        for (int begin = chunk; begin < blocks; begin += chunk)
+            threads.emplace_back(&VaRService::Generate, this, begin, std::min(blocks, begin + chunk));
+        Generate(0, std::min(blocks, chunk));
+        for (auto &thread : threads) thread.join();
+
+        std::fill(aggregate.begin(), aggregate.end(), 0.0);
+        for (size_t b = 0; b < quantities.size(); ++b) {
+            std::fill(pnl[b].begin(), pnl[b].end(), 0.0);
+            for (size_t i = 0; i < size; ++i) {
+                if (quantities[b][i] == 0) continue;
+                Accumulate(pnl[b], i, double(quantities[b][i]));
+                Accumulate(aggregate, i, double(quantities[b][i]));
+            }
+            this->Notify(Compute(BookRegistry::GetName(int(b)), pnl[b]));
+        }
+        this->Notify(Compute("Aggregate", aggregate));
+    }
+
+    // a price tick moved the curve, the paths are redrawn around it every refresh ticks
+    void OnPrice() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (refresh <= 0 || ++ticks < refresh) return;
+        }
+        Simulate();
+    }
+
+    // a position change: move the PnL of the books it changed and of the aggregate
+    void AddPosition(Position<Bond> &position) {
+        int i = analytics->GetIndex(position.GetProduct().GetProductId());
+        if (i < 0) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        Grow();
+        for (size_t b = 0; b < quantities.size(); ++b) {
+            long quantity = position.GetPosition(int(b));
+            long delta = quantity - quantities[b][i];
+            if (delta == 0) continue;
+            quantities[b][i] = quantity;
+            Accumulate(pnl[b], size_t(i), double(delta));
+            Accumulate(aggregate, size_t(i), double(delta));
+        }
+    }
+
+    // get the VaR of a book, or "Aggregate", from the PnL paths as of now
+    virtual ValueAtRisk &GetData(std::string key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (key == "Aggregate") return Compute(key, aggregate);
+        int book = BookRegistry::Find(key);
+        if (book < 0 || size_t(book) >= pnl.size()) {
+            std::cout << "Can't find the VaR of " << key << std::endl;
+            exit(0);
+        }
+        return Compute(key, pnl[book]);
+    }
+
+    // the VaR is computed here, not fed by a connector
+    virtual void OnMessage(ValueAtRisk &data) {}
+};
+
+/**
+ * VaR listener to listen to BondPositionService.
+ */
+class VaRListener : public ServiceListener<Position<Bond> > {
+   private:
+    VaRService *service;
+
+   public:
+    explicit VaRListener(VaRService *_service) : service(_service) {}
+    virtual void ProcessAdd(Position<Bond> &_pos) {
+        DEBUG_TEST("BondPositionService -> VaRService\n");
+        service->AddPosition(_pos);
+    }
+    virtual void ProcessRemove(Position<Bond> &_pos) {}
+    virtual void ProcessUpdate(Position<Bond> &_pos) {}
+};
+
+/**
+ * VaR listener to listen to BondPricingService,
+ * registered after YieldCurveListener so the curve has the tick
+ */
+class VaRPricingListener : public ServiceListener<Price<Bond> > {
+   private:
+    VaRService *service;
+
+   public:
+    explicit VaRPricingListener(VaRService *_service) : service(_service) {}
+    virtual void ProcessAdd(Price<Bond> &_price) {
+        DEBUG_TEST("BondPricingService -> VaRService\n");
+        service->OnPrice();
+    }
+    virtual void ProcessRemove(Price<Bond> &_price) {}
+    virtual void ProcessUpdate(Price<Bond> &_price) {}
+};
+
+#endif
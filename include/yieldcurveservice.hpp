@@ -0,0 +1,195 @@
+/**
+ * yieldcurveservice.hpp
+ * Defines the yield curve data type and the Service bootstrapping it
+ * from the on-the-run Treasuries.
+ *
+ * @author Quanzhi Bi
+ */
+#ifndef YIELD_CURVE_SERVICE_HPP
+#define YIELD_CURVE_SERVICE_HPP
+
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bondanalytics.hpp"
+#include "bondinfo.hpp"
+#include "pricingservice.hpp"
+#include "products.hpp"
+#include "soa.hpp"
+
+/**
+ * Par and zero curve on a semi-annual grid out to the longest pillar.
+ * The pillars are the tenors of the benchmark bonds with their par yields,
+ * the par yield at a grid point is interpolated linearly between pillars
+ * (flat outside), and the discount factors are bootstrapped along the grid:
+ *     df_j = (1 - c_j/2 * sum_{i<j} df_i) / (1 + c_j/2)
+ * A grid point only depends on the points before it, so moving a pillar
+ * rebuilds the grid from the previous pillar onward and keeps the rest.
+ */
+class YieldCurve {
+   public:
+    // grid step in years
+    static constexpr double kStep = 0.5;
+
+    // ctor for a curve with pillars at the tenors (years, increasing) and par yields
+    YieldCurve(const std::string &_name, const std::vector<double> &_tenors, const std::vector<double> &_par) : name(_name), tenors(_tenors), par(_par) {
+        size_t points = size_t(std::ceil(tenors.back() / kStep - 1e-9));
+        logdf.resize(points);
+        annuity.resize(points);
+        Rebuild(0);
+    }
+
+    // Get the name of the curve
+    const std::string &GetName() const { return name; }
+
+    // Number of pillars
+    size_t GetPillarCount() const { return tenors.size(); }
+
+    // Get the tenor (years) and par yield of a pillar
+    double GetTenor(size_t pillar) const { return tenors[pillar]; }
+    double GetParYield(size_t pillar) const { return par[pillar]; }
+
+    // move a pillar and rebuild the part of the grid it affects,
+    // returns the first grid point rebuilt
+    size_t SetParYield(size_t pillar, double yield) {
+        par[pillar] = yield;
+        size_t from = 0;
+        if (pillar > 0) from = size_t(std::floor(tenors[pillar - 1] / kStep + 1e-9));
+        Rebuild(from);
+        return from;
+    }
+
+    // move every pillar at once and rebuild the whole grid
+    void SetParYields(const std::vector<double> &yields) {
+        par = yields;
+        Rebuild(0);
+    }
+
+    // discount factor to time t (years), log-linear between the grid points
+    double DiscountFactor(double t) const {
+        if (t <= 0.0) return 1.0;
+        double x = t / kStep;
+        size_t j = size_t(x);
+        // grid point k is at time (k+1) * kStep, with log df = 0 at time 0
+        if (j >= logdf.size()) j = logdf.size() - 1;
+        double lo = (j == 0) ? 0.0 : logdf[j - 1];
+        double hi = logdf[j];
+        return std::exp(lo + (hi - lo) * (x - double(j)));
+    }
+
+    // continuously compounded zero rate to time t (years)
+    double ZeroRate(double t) const {
+        if (t <= 0.0) t = kStep;
+        return -std::log(DiscountFactor(t)) / t;
+    }
+
+   private:
+    std::string name;
+    std::vector<double> tenors;
+    std::vector<double> par;
+    std::vector<double> logdf;    // log of the discount factor at each grid point
+    std::vector<double> annuity;  // kStep * sum of the discount factors up to each grid point
+
+    // par yield at time t, linear between the pillars and flat outside
+    double ParAt(double t) const {
+        if (t <= tenors.front()) return par.front();
+        for (size_t k = 1; k < tenors.size(); ++k)
+            if (t <= tenors[k]) return par[k - 1] + (par[k] - par[k - 1]) * (t - tenors[k - 1]) / (tenors[k] - tenors[k - 1]);
+        return par.back();
+    }
+
+    // bootstrap the grid from point from to the end
+    void Rebuild(size_t from) {
+        double sum = (from == 0) ? 0.0 : annuity[from - 1];
+        for (size_t j = from; j < logdf.size(); ++j) {
+            double c = ParAt((j + 1) * kStep);
+            double df = (1.0 - c * sum) / (1.0 + c * kStep);
+            logdf[j] = std::log(df);
+            sum += kStep * df;
+            annuity[j] = sum;
+        }
+    }
+};
+
+/**
+ * Yield Curve Service bootstrapping the treasury curve from the mids of
+ * BondPricingService and notifying its listeners of every update.
+ * The yield of a tick is solved from its own price with the cash flows of
+ * BondAnalytics, warm-started from the pillar's par yield. The prices of
+ * different securities may come from different threads (executor lanes),
+ * so the curve is updated and read under a mutex.
+ * Keyed on the curve name.
+ */
+class YieldCurveService : public Service<std::string, YieldCurve> {
+   private:
+    const BondAnalytics *analytics;
+    YieldCurve curve;
+    mutable std::mutex mutex;
+
+    static std::vector<double> Tenors(const BondAnalytics *analytics) {
+        std::vector<double> tenors;
+        for (size_t i = 0; i < analytics->GetSize(); ++i) tenors.push_back(analytics->GetYearsToMaturity(i));
+        return tenors;
+    }
+
+    static std::vector<double> Yields(const BondAnalytics *analytics) {
+        std::vector<double> yields;
+        for (size_t i = 0; i < analytics->GetSize(); ++i) yields.push_back(analytics->GetYield(i));
+        return yields;
+    }
+
+   public:
+    // ctor, the pillars are the securities of the analytics engine (in maturity order)
+    explicit YieldCurveService(const BondAnalytics *_analytics, const std::string &name = "UST")
+        : analytics(_analytics), curve(name, Tenors(_analytics), Yields(_analytics)) {}
+
+    // get a copy of the curve
+    // the result belongs to the calling thread and is valid until its next call
+    virtual YieldCurve &GetData(std::string key) {
+        static thread_local std::unique_ptr<YieldCurve> result;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (result) *result = curve;
+        else result.reset(new YieldCurve(curve));
+        return *result;
+    }
+
+    // the curve is built here, not fed by a connector
+    virtual void OnMessage(YieldCurve &data) {}
+
+    // a benchmark ticked: move its pillar, rebuild from there and publish
+    void OnPrice(const Price<Bond> &price) {
+        int i = analytics->GetIndex(price.GetProduct().GetProductId());
+        if (i < 0) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        curve.SetParYield(size_t(i), analytics->SolveYield(size_t(i), price.GetMid(), curve.GetParYield(size_t(i))));
+        this->Notify(curve);
+    }
+
+    // discount factor to time t (years)
+    double DiscountFactor(double t) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return curve.DiscountFactor(t);
+    }
+};
+
+/**
+ * Yield Curve listener to listen to BondPricingService
+ */
+class YieldCurveListener : public ServiceListener<Price<Bond> > {
+   private:
+    YieldCurveService *service;
+
+   public:
+    explicit YieldCurveListener(YieldCurveService *_service) : service(_service) {}
+    virtual void ProcessAdd(Price<Bond> &_price) {
+        DEBUG_TEST("BondPricingService -> YieldCurveService\n");
+        service->OnPrice(_price);
+    }
+    virtual void ProcessRemove(Price<Bond> &_price) {}
+    virtual void ProcessUpdate(Price<Bond> &_price) {}
+};
+
+#endif
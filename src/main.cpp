@@ -4,30 +4,106 @@
  * @author Quanzhi Bi
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
 
+#include "barservice.hpp"
+#include "bondanalytics.hpp"
 #include "bondinfo.hpp"
+#include "coroconnector.hpp"
 #include "executionservice.hpp"
+#include "exchange.hpp"
+#include "executor.hpp"
+#include "fairvalueservice.hpp"
 #include "guiservice.hpp"
 #include "historicaldataservice.hpp"
 #include "inquiryservice.hpp"
 #include "marketdataservice.hpp"
+#include "marketstatsservice.hpp"
+#include "objectpool.hpp"
+#include "pnlservice.hpp"
 #include "positionservice.hpp"
+#include "pretraderiskservice.hpp"
 #include "pricingservice.hpp"
 #include "products.hpp"
+#include "reactor.hpp"
 #include "riskservice.hpp"
+#include "scenarioservice.hpp"
+#include "settlement.hpp"
+#include "shard.hpp"
+#include "slicingscheduler.hpp"
+#include "smartorderrouter.hpp"
 #include "streamingservice.hpp"
 #include "tradebookingservice.hpp"
+#include "varservice.hpp"
+#include "yieldcurveservice.hpp"
 
 std::vector<std::string> BondInfo::cusips = {};
 std::map<std::string, boost::gregorian::date *> BondInfo::date_map = {};
 std::map<std::string, Bond *> BondInfo::bond_map = {};
+std::unordered_map<std::string, int> BondInfo::index_map = {};
+
+#ifdef COUNT_ALLOCATIONS
+// count every heap allocation, see `make profile`
+DEFINE_ALLOCATION_COUNTER
+#endif
 
 int main(int argc, char *argv[]) {
     DEBUG_TEST("Running the program in the debug mode.\n");
 
     BondInfo::init();
 
+    // runtime mode
+    //   (no argument)   run the four pipelines one after another
+    //   --executor N    run the pipelines concurrently and post the listener
+    //                   invocations to N work-stealing workers
+    //   --reactor       run every connector asynchronously on one event loop thread
+    //   --coroutine     same event loop, with the connector sessions written as coroutines
+    //   --shards N      partition the securities of the trades and marketdata pipelines
+    //                   across N shards, each one a thread pinned to a core
+    //   --exchange      route the orders across simulated venues instead of filling them in full
+    //                   (not with --shards)
+    //   --twap          slice the algo orders in 5 child orders 10ms apart (not with --shards)
+    //   --iceberg       slice the algo orders showing 250000 at a time, refreshed every 10ms
+    //                   (not with --shards)
+    //   --limits        check the algo orders against the position, notional, PV01 and
+    //                   order rate limits of pretraderiskservice.hpp (per security and in the
+    //                   book they are booked in) before they are executed
+    //   --batch N       evaluate the algo signals over the whole universe every N market data
+    //                   updates, and reprice the analytics and the risk of the whole universe
+    //                   every N price ticks (and both every 10ms in reactor mode) (not with --shards)
+    int executor_threads = 0;
+    int shard_count = 0;
+    bool reactor_mode = false;
+    bool coroutine_mode = false;
+    bool exchange_mode = false;
+    bool slicing_mode = false;
+    bool limits_mode = false;
+    SliceParams slice_params;
+    bool batch_mode = false;
+    AlgoSignalParams signal_params;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--executor" && i + 1 < argc) executor_threads = atoi(argv[++i]);
+        if (arg == "--shards" && i + 1 < argc) shard_count = atoi(argv[++i]);
+        if (arg == "--reactor") reactor_mode = true;
+        if (arg == "--coroutine") reactor_mode = coroutine_mode = true;
+        if (arg == "--exchange") exchange_mode = true;
+        if (arg == "--limits") limits_mode = true;
+        if (arg == "--twap") slicing_mode = true, slice_params.algo = TWAP;
+        if (arg == "--iceberg") slicing_mode = true, slice_params.algo = ICEBERG, slice_params.display = 250000;
+        if (arg == "--batch" && i + 1 < argc) batch_mode = true, signal_params.batch = size_t(std::max(0, atoi(argv[++i])));
+    }
+    // event loop shared by the connectors in reactor mode
+    Reactor reactor;
+    reactor.SetCoroutines(coroutine_mode);
+    Reactor *reactor_ptr = reactor_mode ? &reactor : nullptr;
+
     /* trades.txt 
      *         |
      *         v          (port=1236)    
@@ -56,16 +132,21 @@ int main(int argc, char *argv[]) {
      *                                 
      */
 
-    BondPositionConnector bond_position_connector("./output/positions.txt", 1239);
+    BondPositionConnector bond_position_connector("./output/positions.txt", 1239, reactor_ptr);
     HistoricalDataService<Position<Bond>> bond_position_HDS(&bond_position_connector, "Position<Bond>");
     HistoricalDataListener<Position<Bond>> bond_position_HDL(&bond_position_HDS);
 
-    BondRiskConnector bond_risk_connector("./output/risk.txt", 1240);
+    BondRiskConnector bond_risk_connector("./output/risk.txt", 1240, reactor_ptr);
     HistoricalDataService<PV01<Bond>> bond_risk_HDS(&bond_risk_connector, "PV01<Bond>");
     HistoricalDataListener<PV01<Bond>> bond_risk_HDL(&bond_risk_HDS);
 
+    // yield, duration and PV01 of every security, fed by BondPricingService below
+    BondAnalytics bond_analytics;
+    // and the treasury curve bootstrapped from the yields of the prices
+    YieldCurveService yield_curve_service(&bond_analytics);
+
     // BondRiskService and Listener
-    BondRiskService bond_risk_service;
+    BondRiskService bond_risk_service(&bond_analytics);
     BondRiskListener bond_risk_listener(&bond_risk_service);
     bond_risk_service.AddListener(&bond_risk_HDL);
 
@@ -73,16 +154,58 @@ int main(int argc, char *argv[]) {
     BondPositionService bond_position_service;
     bond_position_service.AddListener(&bond_risk_listener);
     bond_position_service.AddListener(&bond_position_HDL);
+    // Monte Carlo VaR of the books, moved incrementally by every position change
+    // and redrawn around the live curve as the prices tick
+    VaRService var_service(&bond_analytics, &yield_curve_service);
+    VaRListener var_listener(&var_service);
+    bond_position_service.AddListener(&var_listener);
+
+    // BondPnLService, persisted conflated to the latest PnL of every security and book
+    BondPnLConnector bond_pnl_connector("./output/pnl.txt", 1244, reactor_ptr);
+    HistoricalDataService<PnL<Bond>> bond_pnl_HDS(&bond_pnl_connector, "PnL<Bond>");
+    ConflatingHistoricalDataListener<PnL<Bond>> bond_pnl_HDL(
+        &bond_pnl_HDS, [](const PnL<Bond> &pnl) { return pnl.GetProduct().GetProductId() + "," + pnl.GetBook(); }, 100);
+    // (in reactor mode by a flush timer, whose last call comes after the last trades of the producing timers)
+    if (reactor_mode) reactor.EveryFlush(100, [&bond_pnl_HDL] { bond_pnl_HDL.Flush(); });
+    // coupon schedules and accrued interest, the PnL reports the accrued interest of the positions
+    SettlementEngine settlement_engine;
+    BondPnLService bond_pnl_service(&settlement_engine);
+    bond_pnl_service.AddListener(&bond_pnl_HDL);
 
     // BondPositionListener
     BondPositionListener bond_position_listener(&bond_position_service);
     // BondTradeBookingService, register the BondPositionListener
     BondTradeBookingService bond_trade_booking_service;
+    // the booked trades carry their dirty price at T+1
+    bond_trade_booking_service.SetSettlement(&settlement_engine);
     bond_trade_booking_service.AddListener(&bond_position_listener);
+    BondPnLTradeListener bond_pnl_trade_listener(&bond_pnl_service);
+    bond_trade_booking_service.AddListener(&bond_pnl_trade_listener);
+    // rolling VWAP, volatility, spread and imbalance of every security
+    MarketStatsService market_stats_service;
+    MarketStatsTradeListener market_stats_trade_listener(&market_stats_service);
+    bond_trade_booking_service.AddListener(&market_stats_trade_listener);
+    // OHLCV bars of the prices and the trades, persisted as they close
+    BondBarConnector bond_bar_connector("./output/bars.txt", 1245, reactor_ptr);
+    HistoricalDataService<Bar<Bond>> bond_bar_HDS(&bond_bar_connector, "Bar<Bond>");
+    HistoricalDataListener<Bar<Bond>> bond_bar_HDL(&bond_bar_HDS);
+    BondBarService bond_bar_service;
+    bond_bar_service.AddListener(&bond_bar_HDL);
+    // the bars are closed by a reactor flush timer (the last call closes them all, after the
+    // last trades of the producing timers), or by a clock thread of their own
+    if (reactor_mode) {
+        reactor.EveryFlush(10, [&reactor, &bond_bar_service] {
+            if (reactor.IsFinished()) bond_bar_service.Flush();
+            else bond_bar_service.Poll();
+        });
+    } else {
+        bond_bar_service.Start(10);
+    }
+    BondBarTradeListener bond_bar_trade_listener(&bond_bar_service);
+    bond_trade_booking_service.AddListener(&bond_bar_trade_listener);
 
     // connector connect to the data server via TCP/IP
     BondTradeBookingConnector bond_trade_booking_connector("./data/trades.txt", &bond_trade_booking_service);
-    bond_trade_booking_connector.Subscribe(1236);
 
     /* marketdata.txt 
      *         |
@@ -99,7 +222,13 @@ int main(int argc, char *argv[]) {
      * BondAlgoExecutionService
      *         |
      *         V
-     * (BondExecutionListener)
+     * (BondPreTradeRiskListener, through BondSlicingScheduler with --twap/--iceberg)
+     *         |
+     *         V
+     * BondPreTradeRiskService (with --limits)
+     *         |
+     *         V
+     * (BondExecutionListener, or BondSmartOrderRouter with --exchange)
      *         |
      *         V
      * BondExecutionService -----------------------------------------
@@ -117,7 +246,7 @@ int main(int argc, char *argv[]) {
      *     output/executions.txt
      */
 
-    BondExecutionConnector bond_execution_connector("./output/executions.txt", 1238);
+    BondExecutionConnector bond_execution_connector("./output/executions.txt", 1238, reactor_ptr);
     HistoricalDataService<ExecutionOrder<Bond>> bond_execution_HDS(&bond_execution_connector, "ExecutionOrder<Bond>");
     HistoricalDataListener<ExecutionOrder<Bond>> bond_execution_HDL(&bond_execution_HDS);
 
@@ -130,18 +259,79 @@ int main(int argc, char *argv[]) {
     bond_execution_service.AddListener(&bond_trade_booking_listener);
     bond_execution_service.AddListener(&bond_execution_HDL);
 
-    // BondAlgoExecutionService, register the BondExecutionListener
+    // the simulated venues and the smart order router splitting the orders across them
+    std::vector<std::unique_ptr<ExchangeSimulator>> venues;
+    std::unique_ptr<BondSmartOrderRouter> smart_order_router;
+    std::unique_ptr<BondSmartOrderRouterListener> smart_order_router_listener;
+    std::unique_ptr<BondSmartOrderRouterMarketDataListener> smart_order_router_marketdata_listener;
+    if (exchange_mode) {
+        // every venue shows its share of the displayed size
+        venues.emplace_back(new ExchangeSimulator(BROKERTEC, 0.5));
+        venues.emplace_back(new ExchangeSimulator(ESPEED, 0.3));
+        venues.emplace_back(new ExchangeSimulator(CME, 0.2));
+        std::vector<ExchangeSimulator *> venue_ptrs;
+        for (auto &venue : venues) venue_ptrs.push_back(venue.get());
+        smart_order_router.reset(new BondSmartOrderRouter(&bond_execution_service, venue_ptrs, BondSmartOrderRouter::GetProfiles()));
+        smart_order_router_listener.reset(new BondSmartOrderRouterListener(smart_order_router.get()));
+        smart_order_router_marketdata_listener.reset(new BondSmartOrderRouterMarketDataListener(smart_order_router.get()));
+    }
+
+    // BondPreTradeRiskService, register the BondExecutionListener (or the router's listener)
+    ServiceListener<ExecutionOrder<Bond> > *order_listener = &bond_execution_listener;
+    if (exchange_mode) order_listener = smart_order_router_listener.get();
+    PreTradeLimits pretrade_limits;
+    BondPreTradeRiskService bond_pretrade_risk_service(&bond_position_service, &bond_risk_service, pretrade_limits);
+    BondPreTradeRiskListener bond_pretrade_risk_listener(&bond_pretrade_risk_service);
+    BondPreTradeClockListener bond_pretrade_clock_listener(&bond_pretrade_risk_service);
+    // the orders go to the books they go to without the checks
+    bond_pretrade_risk_service.SetRotation(&bond_trade_booking_listener.GetRotation());
+    bond_pretrade_risk_service.AddListener(order_listener);
+    // the orders only go through the checks with --limits
+    if (limits_mode) order_listener = &bond_pretrade_risk_listener;
+
+    // BondSlicingScheduler, register the BondPreTradeRiskListener
+    BondSlicingScheduler bond_slicing_scheduler(slice_params);
+    // the children of a parent are booked in the parent's book
+    bond_slicing_scheduler.SetRotation(&bond_trade_booking_listener.GetRotation());
+    BondSlicingListener bond_slicing_listener(&bond_slicing_scheduler, slice_params);
+    BondSlicingClockListener bond_slicing_clock_listener(&bond_slicing_scheduler);
+    bond_slicing_scheduler.AddListener(order_listener);
+
+    // BondAlgoExecutionService, register the BondPreTradeRiskListener (or the BondSlicingListener)
     BondAlgoExecutionService bond_algo_execution_service;
     BondAlgoExecutionListener bond_algo_execution_listener(&bond_algo_execution_service);
-    bond_algo_execution_service.AddListener(&bond_execution_listener);
+    if (slicing_mode) bond_algo_execution_service.AddListener(&bond_slicing_listener);
+    else bond_algo_execution_service.AddListener(order_listener);
+    if (batch_mode) bond_algo_execution_service.SetBatch(signal_params);
+    if (batch_mode && reactor_mode) {
+        // the last updates are evaluated before the slices are drained
+        reactor.Every(10, [&bond_algo_execution_service] { bond_algo_execution_service.Evaluate(); });
+    }
+    if (slicing_mode && reactor_mode) {
+        // the slices still due go out before the publishers close
+        reactor.Every(10, [&reactor, &bond_slicing_scheduler] {
+            if (reactor.IsFinished()) bond_slicing_scheduler.Drain();
+            else bond_slicing_scheduler.Poll();
+        });
+    }
 
     // BondMarketDataService, register the BondAlgoExecutionListener
     BondMarketDataService bond_marketdata_service;
+    // the simulated venues rest the liquidity of the new book before the algo trades on it
+    if (exchange_mode) bond_marketdata_service.AddListener(smart_order_router_marketdata_listener.get());
+    if (slicing_mode) bond_marketdata_service.AddListener(&bond_slicing_clock_listener);
+    // the checks see the event time of the update the algo trades on
+    if (limits_mode) bond_marketdata_service.AddListener(&bond_pretrade_clock_listener);
+    // the statistics are up to date with the book the algo trades on
+    MarketStatsMarketDataListener market_stats_marketdata_listener(&market_stats_service);
+    bond_marketdata_service.AddListener(&market_stats_marketdata_listener);
     bond_marketdata_service.AddListener(&bond_algo_execution_listener);
+    // mark the PnL at the mid of the top of book
+    BondPnLMarketDataListener bond_pnl_marketdata_listener(&bond_pnl_service);
+    bond_marketdata_service.AddListener(&bond_pnl_marketdata_listener);
 
     // connector connect to the data server via TCP/IP
     BondMarketDataConnector bond_marketdata_connector("./data/marketdata.txt", &bond_marketdata_service);
-    bond_marketdata_connector.Subscribe(1237);
 
     /* prices.txt 
      *     |
@@ -149,7 +339,14 @@ int main(int argc, char *argv[]) {
      * (data_reader ->  TCP/IP -> BondPricingConnector) 
      *     |
      *     V
-     * BondPricingService -----------------------------------
+     * BondPricingService                      BondMarketDataService
+     *     |                                       |
+     *     V                                       V
+     * (BondFairValuePricingListener)          (BondFairValueMarketDataListener)
+     *     |                                       |
+     *     V                                       V
+     * BondFairValueService <-----------------------
+     *     |------------------------------------------------
      *     |                                                |
      *     V                                                V
      * (GUIServiceListener)                         (BondAlgoStreamingListener)
@@ -158,7 +355,7 @@ int main(int argc, char *argv[]) {
      * GUIService                                   BondAlgoStreamingService
      *      |                                               |
      *      V           (port=1235)                         V
-     * (GUIConnector -> TCP/IP -> data_wrtier)      (BondStreamingListener)
+     * (GUIConnector -> TCP/IP -> data_wrtier)      (BondStreamingThrottle)
      *        |                                             |
      *        V                                             V
      * output/gui.txt                                BondStreamingService
@@ -173,32 +370,70 @@ int main(int argc, char *argv[]) {
      *                                               BondStreamingConnector -> output/streaming.txt
      */
     // GUI connector/service/listerner
-    GUIConnector<Bond> gui_connector("./output/gui.txt");
+    GUIConnector<Bond> gui_connector("./output/gui.txt", 1235, reactor_ptr);
     GUIService<Bond> gui_service(&gui_connector, 300);
     GUIServiceListener<Bond> gui_service_listener(&gui_service);
 
-    BondStreamingConnector bond_streaming_connector("./output/streaming.txt", 1241);
+    BondStreamingConnector bond_streaming_connector("./output/streaming.txt", 1241, reactor_ptr);
     HistoricalDataService<PriceStream<Bond>> bond_streaming_HDS(&bond_streaming_connector, "PriceStream<Bond>");
     HistoricalDataListener<PriceStream<Bond>> bond_streaming_HDL(&bond_streaming_HDS);
 
-    // BondStreaming service/listner
+    // BondStreaming service, behind the throttle bounding its rate
     BondStreamingService bond_streaming_service;
-    BondStreamingListener bond_streaming_listener(&bond_streaming_service);
+    BondStreamingThrottle bond_streaming_throttle(&bond_streaming_service);
     bond_streaming_service.AddListener(&bond_streaming_HDL);
+    if (reactor_mode) {
+        // the quotes held back go out every 10ms, and all of them before the publishers close
+        reactor.EveryFlush(10, [&reactor, &bond_streaming_throttle] { bond_streaming_throttle.Flush(reactor.IsFinished()); });
+    }
 
-    // BondAlgoStreaming service/listener, register bond_streaming_service
+    // BondAlgoStreaming service/listener, register the throttle
     BondAlgoStreamingService bond_algo_streaming_service;
+    // lean the quotes against the positions and their risk
+    bond_algo_streaming_service.SetInventory(&bond_position_service, &bond_risk_service);
     BondAlgoStreamingListener bond_algo_streaming_listener(&bond_algo_streaming_service);
-    bond_algo_streaming_service.AddListener(&bond_streaming_listener);
+    bond_algo_streaming_service.AddListener(&bond_streaming_throttle);
 
-    // BondPricing service, register GUI/BondAlgoStreaming listener
+    // BondFairValue service joining the prices and the order books, register GUI/BondAlgoStreaming listener
+    BondFairValueService bond_fair_value_service;
+    bond_fair_value_service.AddListener(&gui_service_listener);
+    bond_fair_value_service.AddListener(&bond_algo_streaming_listener);
+    BondAlgoFairValueListener bond_algo_fair_value_listener(&bond_algo_execution_service);
+    if (batch_mode) bond_fair_value_service.AddListener(&bond_algo_fair_value_listener);
+    BondFairValuePricingListener bond_fair_value_pricing_listener(&bond_fair_value_service);
+    BondFairValueMarketDataListener bond_fair_value_marketdata_listener(&bond_fair_value_service);
+    bond_marketdata_service.AddListener(&bond_fair_value_marketdata_listener);
+
+    // BondPricing service, register the BondFairValue listener
     BondPricingService pricing_service;
-    pricing_service.AddListener(&gui_service_listener);
-    pricing_service.AddListener(&bond_algo_streaming_listener);
+    pricing_service.AddListener(&bond_fair_value_pricing_listener);
+    // keep the analytics engine (and so the risk) on the market
+    BondAnalyticsListener bond_analytics_listener(&bond_analytics);
+    // and move the stored risk and the sector totals with the PV01 of the tick
+    BondRiskPricingListener bond_risk_pricing_listener(&bond_risk_service);
+    // or, in batch mode, with the PV01 of the whole universe repriced at once every batch ticks
+    BondRiskBatchListener bond_risk_batch_listener(&bond_analytics, &bond_risk_service, signal_params.batch);
+    if (batch_mode) {
+        pricing_service.AddListener(&bond_risk_batch_listener);
+        if (reactor_mode) reactor.Every(10, [&bond_risk_batch_listener] { bond_risk_batch_listener.Refresh(); });
+    } else {
+        pricing_service.AddListener(&bond_analytics_listener);
+        pricing_service.AddListener(&bond_risk_pricing_listener);
+    }
+    // and bootstrap the treasury curve from the yields of the prices
+    YieldCurveListener yield_curve_listener(&yield_curve_service);
+    pricing_service.AddListener(&yield_curve_listener);
+    // and keep the VaR paths around the curve
+    VaRPricingListener var_pricing_listener(&var_service);
+    pricing_service.AddListener(&var_pricing_listener);
+    // and mark the PnL at the mid
+    BondPnLPricingListener bond_pnl_pricing_listener(&bond_pnl_service);
+    pricing_service.AddListener(&bond_pnl_pricing_listener);
+    BondBarPricingListener bond_bar_pricing_listener(&bond_bar_service);
+    pricing_service.AddListener(&bond_bar_pricing_listener);
 
     // Pricing connector
     BondPricingConnector pricing_connector("./data/prices.txt", &pricing_service);
-    pricing_connector.Subscribe(1234);
 
     /* inquiries.txt 
      *         |
@@ -221,7 +456,7 @@ int main(int argc, char *argv[]) {
      * ./output/allinquiries.txt                         
      */
 
-    BondAllInquiriesConnector bond_allinquiries_connector("./output/allinquiries.txt", 1243);
+    BondAllInquiriesConnector bond_allinquiries_connector("./output/allinquiries.txt", 1243, reactor_ptr);
     HistoricalDataService<Inquiry<Bond>> bond_allinquiries_HDS(&bond_allinquiries_connector, "Inquiry<Bond>");
     HistoricalDataListener<Inquiry<Bond>> bond_allinquiries_HDL(&bond_allinquiries_HDS);
 
@@ -229,7 +464,145 @@ int main(int argc, char *argv[]) {
     BondInquiryService bond_inquiry_service(&quote_connector);
     bond_inquiry_service.AddListener(&bond_allinquiries_HDL);
     BondInquiryConnector bond_inquiry_connector("./data/inquiries.txt", &bond_inquiry_service);
-    bond_inquiry_connector.Subscribe(1242);
+
+    long shard_rejects = 0;
+    if (shard_count > 0) {
+        // each shard runs its own copy of the trades/marketdata services for its CUSIPs,
+        // the connectors route the records to the shards and this thread
+        // publishes what comes out of them
+        ShardedRuntime runtime(shard_count, &bond_execution_HDL, &bond_position_HDL, &bond_risk_HDL, &bond_analytics, limits_mode ? &pretrade_limits : nullptr);
+        ShardedTradeBookingService sharded_trade_booking_service(&runtime);
+        ShardedMarketDataService sharded_marketdata_service(&runtime);
+        BondTradeBookingConnector sharded_trade_booking_connector("./data/trades.txt", &sharded_trade_booking_service);
+        BondMarketDataConnector sharded_marketdata_connector("./data/marketdata.txt", &sharded_marketdata_service);
+        runtime.Start();
+
+        std::atomic<int> running(2);
+        std::thread trades_thread([&] {
+            sharded_trade_booking_connector.Subscribe(1236);
+            --running;
+        });
+        std::thread marketdata_thread([&] {
+            sharded_marketdata_connector.Subscribe(1237);
+            --running;
+        });
+        while (running.load() > 0)
+            if (!runtime.Drain()) std::this_thread::yield();
+        trades_thread.join();
+        marketdata_thread.join();
+        runtime.Stop();
+        shard_rejects = runtime.GetRejects();
+
+        pricing_connector.Subscribe(1234);
+        bond_inquiry_connector.Subscribe(1242);
+    } else if (executor_threads > 0) {
+        // the fan-out points post their listener invocations to the executor,
+        // keyed by CUSIP so the events of one security stay in order
+        // (trade booking is posted too since trades.txt and the executions
+        // both feed BondPositionService)
+        std::unique_ptr<WorkStealingExecutor> executor(new WorkStealingExecutor(executor_threads));
+        bond_trade_booking_service.SetExecutor(executor.get());
+        bond_execution_service.SetExecutor(executor.get());
+        pricing_service.SetExecutor(executor.get());
+
+        // one thread per ingest pipeline
+        std::thread trades_thread([&] { bond_trade_booking_connector.Subscribe(1236); });
+        std::thread marketdata_thread([&] { bond_marketdata_connector.Subscribe(1237); });
+        std::thread pricing_thread([&] { pricing_connector.Subscribe(1234); });
+        std::thread inquiry_thread([&] { bond_inquiry_connector.Subscribe(1242); });
+        trades_thread.join();
+        marketdata_thread.join();
+        pricing_thread.join();
+        inquiry_thread.join();
+        // the last updates are evaluated and the slices still due go out before the executor stops
+        bond_algo_execution_service.Evaluate();
+        if (slicing_mode) bond_slicing_scheduler.Drain();
+        // wait for the listeners still queued on the executor
+        executor->Drain();
+    } else if (coroutine_mode) {
+        // every connector session is a coroutine suspended on the same io_context
+        BondTradeBookingConnector::Spawn(reactor, bond_trade_booking_connector.CoSubscribe(1236));
+        BondMarketDataConnector::Spawn(reactor, bond_marketdata_connector.CoSubscribe(1237));
+        BondPricingConnector::Spawn(reactor, pricing_connector.CoSubscribe(1234));
+        BondInquiryConnector::Spawn(reactor, bond_inquiry_connector.CoSubscribe(1242));
+        reactor.Run();
+    } else if (reactor_mode) {
+        // every connector is an asynchronous session on the same io_context,
+        // the whole system runs on this thread without blocking on a socket
+        bond_trade_booking_connector.Subscribe(reactor, 1236);
+        bond_marketdata_connector.Subscribe(reactor, 1237);
+        pricing_connector.Subscribe(reactor, 1234);
+        bond_inquiry_connector.Subscribe(reactor, 1242);
+        reactor.Run();
+    } else {
+        bond_trade_booking_connector.Subscribe(1236);
+        bond_marketdata_connector.Subscribe(1237);
+        pricing_connector.Subscribe(1234);
+        bond_inquiry_connector.Subscribe(1242);
+    }
+
+    // the last updates are evaluated at the end of the feed (already done in reactor and executor modes)
+    if (batch_mode && shard_count == 0) {
+        bond_algo_execution_service.Evaluate();
+        bond_risk_batch_listener.Refresh();
+        std::cout << "Batch signals: " << bond_algo_execution_service.GetEvaluationCount() << " evaluations of the universe, "
+                  << bond_algo_execution_service.GetBatchOrderCount() << " orders" << std::endl;
+        std::cout << "Batch risk: " << bond_risk_batch_listener.GetRefreshCount() << " refreshes of the universe" << std::endl;
+    }
+    if (slicing_mode) {
+        // the slices still due go out at the end of the feed (already done in reactor and executor modes)
+        bond_slicing_scheduler.Drain();
+        std::cout << "Slicing scheduler: " << bond_slicing_scheduler.GetChildCount() << " child orders" << std::endl;
+    }
+    if (smart_order_router) {
+        std::cout << "Smart order router: " << smart_order_router->GetRoutedCount() << " orders in " << smart_order_router->GetChildCount()
+                  << " child orders, " << smart_order_router->GetFilledQuantity() << " filled, " << smart_order_router->GetWorkingCount() << " working, "
+                  << smart_order_router->GetCancelledCount() << " cancelled, " << smart_order_router->GetRejectedCount() << " rejected" << std::endl;
+    }
+    long rejects = bond_pretrade_risk_service.GetRejects() + shard_rejects;
+    if (rejects > 0) std::cout << "Pre-trade checks rejected " << rejects << " orders" << std::endl;
+
+    // persist the PnL and the bars still open, and publish the quotes still held back in every mode
+    // (in reactor mode the flush timers did, after the producing ones and before the publishers closed)
+    bond_bar_service.Stop();
+    if (!reactor_mode) {
+        bond_pnl_HDL.Flush();
+        bond_bar_service.Flush();
+        bond_streaming_throttle.Flush(true);
+    }
+    std::cout << "Bars: " << bond_bar_service.GetClosedCount() << " bars closed" << std::endl;
+    std::cout << "Streaming throttle: " << bond_streaming_throttle.GetPublishedCount() << " quotes published, " << bond_streaming_throttle.GetUnchangedCount()
+              << " unchanged, " << bond_streaming_throttle.GetConflatedCount() << " conflated, " << bond_streaming_throttle.GetHeldCount() << " held back" << std::endl;
+
+    // in shards mode the trades and the market data go to the shards, so there are no statistics (nor positions)
+    if (shard_count == 0) {
+        for (auto &cusip : BondInfo::GetCUSIP()) {
+            MarketStats stats;
+            market_stats_service.GetStats(cusip, stats);
+            std::cout << "Market stats " << cusip << ": VWAP " << stats.vwap << ", volatility " << stats.volatility << ", spread " << stats.spread
+                      << ", imbalance " << stats.imbalance << std::endl;
+        }
+        std::cout << "Dirty market value of the positions: " << bond_pnl_service.GetMarketValue() << std::endl;
+    }
+
+    // end of day stress: revalue the positions under the standard scenarios of the bootstrapped curve
+    // (in shards mode the positions live in the shards, so there is nothing to stress here)
+    if (shard_count == 0) {
+        ScenarioService scenario_service(&bond_analytics, &yield_curve_service, &bond_position_service);
+        scenario_service.AddStandardScenarios();
+        scenario_service.Run();
+        const ScenarioRisk &worst = scenario_service.GetWorst();
+        std::cout << "Stressed " << scenario_service.GetScenarioCount() << " scenarios, worst: " << worst.GetName() << " PnL " << worst.GetTotal() << std::endl;
+
+        // redraw the VaR paths around the closing curve
+        var_service.Simulate();
+        ValueAtRisk &var = var_service.GetData("Aggregate");
+        std::cout << "1-day " << var.GetConfidence() * 100 << "% VaR " << var.GetVaR() << ", ES " << var.GetExpectedShortfall() << " (" << var.GetPaths() << " paths)" << std::endl;
+    }
+
+#ifdef COUNT_ALLOCATIONS
+    AllocationCounter::Report();
+#endif
 
     BondInfo::clean();
 
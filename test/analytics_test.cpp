@@ -0,0 +1,74 @@
+/**
+ * analytics_test.cpp
+ * Checks the batch repricing of BondAnalytics (Recompute) against the
+ * repricing of every tick (OnPrice) on the same prices.
+ *
+ * @author Quanzhi Bi
+ */
+#include <cmath>
+#include <iostream>
+#include <string>
+
+#include "bondanalytics.hpp"
+
+std::vector<std::string> BondInfo::cusips = {};
+std::map<std::string, boost::gregorian::date *> BondInfo::date_map = {};
+std::map<std::string, Bond *> BondInfo::bond_map = {};
+std::unordered_map<std::string, int> BondInfo::index_map = {};
+
+int failures = 0;
+
+void Check(bool condition, const std::string &what) {
+    if (condition) return;
+    std::cout << "FAILED " << what << std::endl;
+    ++failures;
+}
+
+// the results of the batch engine are those of the scalar one, to the digits
+// the closed form keeps: it is 0/0 at a zero yield, so both lose digits near it
+void Compare(const BondAnalytics &scalar, const BondAnalytics &batch, int tick) {
+    for (size_t i = 0; i < scalar.GetSize(); ++i) {
+        std::string cusip = BondInfo::GetCUSIP()[i];
+        std::string what = cusip + " at tick " + std::to_string(tick);
+        double tolerance = (std::fabs(scalar.GetYield(i)) > 1e-4) ? 1e-9 : 1e-5;
+        Check(std::fabs(scalar.GetYield(i) - batch.GetYield(i)) < 1e-10, "yield of " + what);
+        Check(std::fabs(scalar.GetModifiedDuration(i) - batch.GetModifiedDuration(i)) < tolerance * scalar.GetModifiedDuration(i), "duration of " + what);
+        Check(std::fabs(scalar.GetPV01(i) - batch.GetPV01(i)) < tolerance * scalar.GetPV01(i), "PV01 of " + what);
+        Check(std::fabs(scalar.GetPV01(cusip) - batch.GetPV01(cusip)) < tolerance * scalar.GetPV01(cusip), "published PV01 of " + what);
+    }
+}
+
+int main() {
+    BondInfo::init();
+    BondAnalytics scalar, batch;
+    Compare(scalar, batch, 0);
+
+    // prices oscillating around par as in the feed, repriced in batches of 7 ticks
+    int tick = 0;
+    for (int step = 0; step < 2000; ++step) {
+        for (size_t i = 0; i < scalar.GetSize(); ++i) {
+            std::string cusip = BondInfo::GetCUSIP()[i];
+            double price = 99.0 + 2.0 * std::fabs(std::sin(0.01 * step + 0.3 * i)) + (step % 3) / 256.0;
+            scalar.OnPrice(cusip, price);
+            batch.SetPrice(cusip, price);
+            if (++tick % 7 == 0) {
+                batch.Recompute();
+                Compare(scalar, batch, tick);
+            }
+        }
+    }
+
+    // far from the last yields, and outside the range of the polynomials
+    for (double price : {60.0, 140.0, 100.0}) {
+        for (size_t i = 0; i < scalar.GetSize(); ++i) {
+            scalar.OnPrice(BondInfo::GetCUSIP()[i], price);
+            batch.SetPrice(BondInfo::GetCUSIP()[i], price);
+        }
+        batch.Recompute();
+        Compare(scalar, batch, ++tick);
+    }
+
+    std::cout << (failures == 0 ? "PASSED" : "FAILED") << " analytics_test" << std::endl;
+    BondInfo::clean();
+    return failures == 0 ? 0 : 1;
+}
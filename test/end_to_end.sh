@@ -0,0 +1,72 @@
+#!/bin/bash
+# end to end checks of the bond trading system on the data in ./data
+# (python data_generator.py), run from the root of the repository after make
+#
+# usage: test/end_to_end.sh [path to the apps, build/apps by default]
+
+APP_DIR=${1:-./build/apps}
+FAILED=0
+
+# run the system with its data_reader and data_writer processes
+run() {
+    rm -f ./output/*.txt ./output/run.log
+    for port in 1234 1236 1237 1242; do $APP_DIR/data_reader $port > /dev/null & done
+    for port in 1238 1239 1240 1241 1235 1243 1244 1245; do $APP_DIR/data_writer $port > /dev/null & done
+    sleep 1
+    $APP_DIR/bond_trading_system "$@" > ./output/run.log
+    local status=$?
+    sleep 1
+    pkill -f "$APP_DIR/data_reader"
+    pkill -f "$APP_DIR/data_writer"
+    wait 2> /dev/null
+    return $status
+}
+
+check() {
+    if [ "$2" = "0" ]; then
+        echo "PASSED $1"
+    else
+        echo "FAILED $1"
+        FAILED=1
+    fi
+}
+
+# default mode: the algo alternates BID/OFFER on every order book update,
+# so an order is a BUY iff its id (the number of the update) is odd
+run
+check "default run" $?
+awk -F, '{ if (($5 == "BUY") != ($3 % 2 == 1) || $3 <= last) bad = 1; last = $3 } END { exit (NR == 0 || bad) }' ./output/executions.txt
+check "default sides follow the baseline alternation" $?
+cut -d, -f2- ./output/positions.txt > ./output/positions.default
+
+# the streaming throttle publishes the quotes it held back at the end of the run, in every mode
+grep -q " conflated, 0 held back" ./output/run.log
+check "default quotes held back published" $?
+for mode in "--executor 2" "--shards 2"; do
+    run $mode && grep -q " conflated, 0 held back" ./output/run.log
+    check "$mode quotes held back published" $?
+done
+
+# the pre-trade checks pass the sample data and book every trade where the default mode does
+run --limits
+check "limits run" $?
+cut -d, -f2- ./output/positions.txt | cmp -s - ./output/positions.default
+check "limits book the trades as the default mode" $?
+rm -f ./output/positions.default
+
+# reactor mode: the trades of the last batch evaluation and of the slices drained at the end
+# reach the bars (their volume is all the traded quantity) and the PnL (its positions are the
+# last positions) before the publishers close
+run --reactor --twap --batch 64
+check "reactor twap batch run" $?
+awk -F, 'FILENAME ~ /trades/ { v[$1] += $6 } FILENAME ~ /executions/ { v[$2] += $7 } FILENAME ~ /bars/ && $3 == 300000 { b[$2] += $9 }
+    END { for (c in v) if (v[c] != b[c]) bad = 1; exit (length(v) == 0 || bad) }' ./data/trades.txt ./output/executions.txt ./output/bars.txt
+check "reactor twap batch last trades in the bars" $?
+awk -F, 'FILENAME ~ /positions/ { p[$2] = $NF } FILENAME ~ /pnl/ && $3 == "ALL" { q[$2] = $4 }
+    END { for (c in p) if (p[c] != q[c]) bad = 1; exit (length(p) == 0 || bad) }' ./output/positions.txt ./output/pnl.txt
+check "reactor twap batch last trades in the PnL" $?
+grep -q " conflated, 0 held back" ./output/run.log
+check "reactor quotes held back published" $?
+
+rm -f ./output/run.log
+exit $FAILED
@@ -0,0 +1,191 @@
+/**
+ * exchange_test.cpp
+ * Checks the limit order book (best prices, handles), the LIMIT orders
+ * resting at the venues through the smart order router, and the expiry
+ * and rejections of the router.
+ *
+ * @author Quanzhi Bi
+ */
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "smartorderrouter.hpp"
+
+std::vector<std::string> BondInfo::cusips = {};
+std::map<std::string, boost::gregorian::date *> BondInfo::date_map = {};
+std::map<std::string, Bond *> BondInfo::bond_map = {};
+std::unordered_map<std::string, int> BondInfo::index_map = {};
+
+int failures = 0;
+
+void Check(bool condition, const std::string &what) {
+    if (condition) return;
+    std::cout << "FAILED " << what << std::endl;
+    ++failures;
+}
+
+// the executions coming out of BondExecutionService
+class ExecutionRecorder : public ServiceListener<ExecutionOrder<Bond> > {
+   public:
+    std::vector<ExecutionOrder<Bond> > executions;
+    virtual void ProcessAdd(ExecutionOrder<Bond> &_order) { executions.push_back(_order); }
+    virtual void ProcessRemove(ExecutionOrder<Bond> &_order) {}
+    virtual void ProcessUpdate(ExecutionOrder<Bond> &_order) {}
+};
+
+void TestBook() {
+    typedef LimitOrderBook::Handle Handle;
+    std::vector<LimitOrderBook::Fill> fills;
+    LimitOrderBook book(8);
+
+    // levels in different words of the bitmap, and of its summary
+    Handle low = book.Add(BID, 100, 10, 1);
+    Handle mid = book.Add(BID, 1000, 10, 2);
+    Handle high = book.Add(BID, 5000, 10, 3);
+    Handle near = book.Add(OFFER, 6000, 10, 4);
+    Handle far = book.Add(OFFER, 20000, 10, 5);
+    Check(book.GetBestBid() == 5000 && book.GetBestOffer() == 6000, "best prices after adding");
+    Check(book.Add(BID, 6000, 10, 6) == LimitOrderBook::kNil, "a bid crossing the offers doesn't rest");
+
+    Check(book.Cancel(high) && book.GetBestBid() == 1000, "best bid after cancelling it");
+    Check(!book.Cancel(high), "a handle cancelled twice");
+    Check(!book.Cancel(LimitOrderBook::kNil) && !book.Cancel(Handle(12345)), "invalid handles");
+
+    // the slot of the cancelled order holds a new one, which the old handle doesn't cancel
+    Handle reused = book.Add(BID, 2000, 10, 7);
+    Check(uint32_t(reused) == uint32_t(high), "the freed slot is reused");
+    Check(!book.Cancel(high) && book.GetBestBid() == 2000, "a stale handle of a reused slot");
+
+    // a sell order taking two levels and half of the third one
+    Check(book.Execute(OFFER, IOC, 0, 25, 8, fills) == 25, "quantity filled");
+    Check(fills.size() == 3 && fills[0].level == 2000 && fills[1].level == 1000 && fills[2].level == 100, "levels filled in price priority");
+    Check(fills[0].done && fills[1].done && !fills[2].done && fills[2].handle == low, "passive orders filled");
+    Check(book.GetBestBid() == 100 && book.GetQuantity(100) == 5, "best bid after the fills");
+    Check(!book.Cancel(mid) && !book.Cancel(reused), "handles of filled orders");
+
+    // FOK across the offers, then nothing left on that side
+    fills.clear();
+    Check(book.Execute(BID, FOK, 20000, 30, 9, fills) == 0 && fills.empty(), "FOK larger than the offers");
+    Check(book.Execute(BID, FOK, 20000, 20, 9, fills) == 20 && book.GetBestOffer() == LimitOrderBook::kLevels, "FOK of all the offers");
+    Check(!book.Cancel(near) && !book.Cancel(far), "handles of the offers filled");
+
+    // a LIMIT order rests what it didn't fill
+    fills.clear();
+    Handle rested;
+    Check(book.Execute(OFFER, LIMIT, 50, 15, 10, fills, &rested) == 5, "LIMIT filled up to its limit");
+    Check(rested != LimitOrderBook::kNil && book.GetBestOffer() == 50 && book.GetBestBid() == -1, "LIMIT resting");
+    Check(book.Cancel(rested) && book.GetBestOffer() == LimitOrderBook::kLevels, "resting LIMIT cancelled");
+}
+
+// random adds and cancels, the best prices against a scan of every level
+void TestBestPrices() {
+    LimitOrderBook book(4096);
+    std::mt19937 random(42);
+    std::vector<LimitOrderBook::Handle> handles;
+    int mismatches = 0;
+    for (int step = 0; step < 5000; ++step) {
+        if (handles.empty() || random() % 3 != 0) {
+            // bids in the lower half of the band, offers in the upper half
+            PricingSide side = (random() % 2) ? BID : OFFER;
+            int level = int(random() % (LimitOrderBook::kLevels / 2)) + ((side == BID) ? 0 : LimitOrderBook::kLevels / 2);
+            LimitOrderBook::Handle handle = book.Add(side, level, 1, 1);
+            if (handle != LimitOrderBook::kNil) handles.push_back(handle);
+        } else {
+            size_t k = random() % handles.size();
+            book.Cancel(handles[k]);
+            handles[k] = handles.back();
+            handles.pop_back();
+        }
+        int bid = -1, offer = LimitOrderBook::kLevels;
+        for (int l = 0; l < LimitOrderBook::kLevels / 2; ++l)
+            if (book.GetQuantity(l) > 0) bid = l;
+        for (int l = LimitOrderBook::kLevels; l-- > LimitOrderBook::kLevels / 2;)
+            if (book.GetQuantity(l) > 0) offer = l;
+        if (bid != book.GetBestBid() || offer != book.GetBestOffer()) ++mismatches;
+    }
+    Check(mismatches == 0, "best prices against a scan");
+}
+
+OrderBook<Bond> Book(const std::string &cusip, double bid, double offer) {
+    return OrderBook<Bond>(*BondInfo::GetBond(cusip), {Order(bid, 1000000, BID)}, {Order(offer, 1000000, OFFER)});
+}
+
+void TestRestingLimit() {
+    BondExecutionService execution;
+    ExecutionRecorder recorder;
+    execution.AddListener(&recorder);
+    ExchangeSimulator brokertec(BROKERTEC, 0.5), espeed(ESPEED, 0.3), cme(CME, 0.2);
+    BondSmartOrderRouter router(&execution, {&brokertec, &espeed, &cme}, BondSmartOrderRouter::GetProfiles());
+    const std::string cusip = BondInfo::GetCUSIP()[0];
+    const Bond &bond = *BondInfo::GetBond(cusip);
+
+    // a bid below the offers rests on CME, the venue of the lowest penalty
+    router.OnMarketData(Book(cusip, 99.0, 99.5));
+    router.Route(ExecutionOrder<Bond>(bond, BID, "1", LIMIT, 99.25, 1000000, 0, "", false));
+    const BondSmartOrderRouter::Parent *parent = router.GetParent("1");
+    Check(parent != nullptr && parent->resting == "1.1" && recorder.executions.empty(), "LIMIT parent resting");
+    Check(cme.GetRestingCount() == 1 && cme.GetBook(cusip)->GetBestBid() == LimitOrderBook::ToLevel(99.25), "LIMIT child resting at its limit");
+
+    // offers at the limit fill it passively
+    router.OnMarketData(Book(cusip, 99.0, 99.25));
+    Check(recorder.executions.size() == 1, "passive fill reported");
+    if (recorder.executions.size() == 1) {
+        const ExecutionOrder<Bond> &fill = recorder.executions[0];
+        Check(fill.GetOrderId() == "1.1" && fill.GetParentOrderId() == "1" && fill.GetPrice() == 99.25 && fill.GetVisibleQuantity() == 200000, "passive fill");
+    }
+    Check(router.GetParent("1") != nullptr && router.GetParent("1")->filled == 200000, "parent filled passively");
+
+    // cancelling the parent takes its child off the venue
+    Check(router.Cancel("1") && cme.GetRestingCount() == 0, "resting child cancelled with the parent");
+    Check(cme.GetBook(cusip)->GetBestBid() == LimitOrderBook::ToLevel(99.0), "venue bid after the cancel");
+    Check(!cme.Cancel("1.1"), "the child cancelled twice");
+
+    // a parent filled in full passively is complete
+    recorder.executions.clear();
+    router.OnMarketData(Book(cusip, 99.0, 99.5));
+    router.Route(ExecutionOrder<Bond>(bond, BID, "2", LIMIT, 99.25, 100000, 0, "", false));
+    router.OnMarketData(Book(cusip, 99.0, 99.25));
+    Check(router.GetParent("2") == nullptr && router.GetWorkingCount() == 0 && cme.GetRestingCount() == 0, "parent complete");
+    Check(recorder.executions.size() == 1 && recorder.executions[0].GetVisibleQuantity() == 100000, "full passive fill");
+    Check(router.GetCancelledCount() == 1 && router.GetFilledQuantity() == 300000, "router counts");
+}
+
+// a parent expires after its time limit in event time, even if its security stops ticking
+void TestExpiry() {
+    BondExecutionService execution;
+    ExchangeSimulator brokertec(BROKERTEC, 0.5), espeed(ESPEED, 0.3), cme(CME, 0.2);
+    BondSmartOrderRouter router(&execution, {&brokertec, &espeed, &cme}, BondSmartOrderRouter::GetProfiles(), 100);
+    const std::string quiet = BondInfo::GetCUSIP()[0], busy = BondInfo::GetCUSIP()[1];
+    const Bond &bond = *BondInfo::GetBond(quiet);
+
+    router.OnMarketData(Book(quiet, 99.0, 99.5));
+    router.Route(ExecutionOrder<Bond>(bond, BID, "1", LIMIT, 99.25, 1000000, 0, "", false));
+    Check(router.GetParent("1") != nullptr && cme.GetRestingCount() == 1, "parent working");
+
+    // 100ms is 10 updates of every security, all of them on another security here
+    size_t updates = 10 * BondInfo::GetCUSIP().size();
+    for (size_t k = 0; k + 2 < updates; ++k) router.OnMarketData(Book(busy, 99.0, 99.5));
+    Check(router.GetParent("1") != nullptr, "parent working before its time limit");
+    for (size_t k = 0; k < BondInfo::GetCUSIP().size() + 2; ++k) router.OnMarketData(Book(busy, 99.0, 99.5));
+    Check(router.GetParent("1") == nullptr && router.GetCancelledCount() == 1, "parent expired");
+    Check(cme.GetRestingCount() == 0, "resting child of the expired parent cancelled");
+
+    // the venues don't take STOP orders, nor two parents with the same id
+    router.Route(ExecutionOrder<Bond>(bond, BID, "2", STOP, 99.25, 1000000, 0, "", false));
+    router.Route(ExecutionOrder<Bond>(bond, BID, "3", LIMIT, 99.25, 1000000, 0, "", false));
+    router.Route(ExecutionOrder<Bond>(bond, BID, "3", LIMIT, 99.25, 1000000, 0, "", false));
+    Check(router.GetRejectedCount() == 2 && router.GetRoutedCount() == 2, "rejected parents");
+}
+
+int main() {
+    BondInfo::init();
+    TestBook();
+    TestBestPrices();
+    TestRestingLimit();
+    TestExpiry();
+    std::cout << (failures == 0 ? "PASSED" : "FAILED") << " exchange_test" << std::endl;
+    BondInfo::clean();
+    return failures == 0 ? 0 : 1;
+}
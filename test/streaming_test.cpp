@@ -0,0 +1,76 @@
+/**
+ * streaming_test.cpp
+ * Checks what BondStreamingThrottle drops, holds back and publishes.
+ *
+ * @author Quanzhi Bi
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "streamingservice.hpp"
+
+std::vector<std::string> BondInfo::cusips = {};
+std::map<std::string, boost::gregorian::date *> BondInfo::date_map = {};
+std::map<std::string, Bond *> BondInfo::bond_map = {};
+std::unordered_map<std::string, int> BondInfo::index_map = {};
+
+int failures = 0;
+
+void Check(bool condition, const std::string &what) {
+    if (condition) return;
+    std::cout << "FAILED " << what << std::endl;
+    ++failures;
+}
+
+// the quotes coming out of BondStreamingService
+class StreamRecorder : public ServiceListener<PriceStream<Bond> > {
+   public:
+    std::vector<PriceStream<Bond> > streams;
+    virtual void ProcessAdd(PriceStream<Bond> &_stream) { streams.push_back(_stream); }
+    virtual void ProcessRemove(PriceStream<Bond> &_stream) {}
+    virtual void ProcessUpdate(PriceStream<Bond> &_stream) {}
+};
+
+PriceStream<Bond> Quote(const Bond &bond, double bid, double offer, long visible, long hidden) {
+    return PriceStream<Bond>(bond, PriceStreamOrder(bid, visible, hidden, BID), PriceStreamOrder(offer, visible, hidden, OFFER));
+}
+
+int main() {
+    BondInfo::init();
+    BondStreamingService service;
+    StreamRecorder recorder;
+    service.AddListener(&recorder);
+    // a security at most once an hour, so every quote after the first is held back
+    StreamingThrottlePolicy policy;
+    policy.minInterval = 3600 * 1000;
+    BondStreamingThrottle throttle(&service, policy);
+    const Bond &bond = *BondInfo::GetBond(BondInfo::GetCUSIP()[0]);
+
+    PriceStream<Bond> first = Quote(bond, 99.0, 99.5, 1000000, 2000000);
+    throttle.ProcessAdd(first);
+    Check(recorder.streams.size() == 1 && throttle.GetHeldCount() == 0, "first quote published");
+
+    // the same prices with other sizes are news, held back until the end
+    PriceStream<Bond> resized = Quote(bond, 99.0, 99.5, 2000000, 4000000);
+    throttle.ProcessAdd(resized);
+    Check(throttle.GetUnchangedCount() == 0 && throttle.GetHeldCount() == 1, "new sizes held back, not dropped");
+
+    // back to the quote published: what was held back is stale
+    throttle.ProcessAdd(first);
+    Check(throttle.GetUnchangedCount() == 1 && throttle.GetHeldCount() == 0, "quote published again dropped");
+
+    PriceStream<Bond> hidden = Quote(bond, 99.0, 99.5, 1000000, 3000000);
+    throttle.ProcessAdd(hidden);
+    Check(throttle.GetHeldCount() == 1, "new hidden size held back");
+    throttle.Flush();
+    Check(recorder.streams.size() == 1, "nothing due before the interval");
+    throttle.Flush(true);
+    Check(recorder.streams.size() == 2 && throttle.GetHeldCount() == 0, "quotes held back published at the end");
+    if (recorder.streams.size() == 2) Check(recorder.streams[1].GetBidOrder().GetHiddenQuantity() == 3000000, "last quote published");
+    Check(throttle.GetPublishedCount() == 2 && throttle.GetConflatedCount() == 1, "throttle counts");
+
+    std::cout << (failures == 0 ? "PASSED" : "FAILED") << " streaming_test" << std::endl;
+    BondInfo::clean();
+    return failures == 0 ? 0 : 1;
+}